@@ -0,0 +1,545 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+/*
+ * Rate-distortion sweep. The input is encoded once at the highest
+ * rate asked for. Every lower rate is obtained by cutting each
+ * record to that rate's budget. With raw bits that gives exactly
+ * what encoding at that rate would, since the bitstream is embedded;
+ * cut range coded records (-a) decode the same but differ in bytes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <agstream.h>
+#include <agio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <popt.h>
+#include <glib.h>
+
+#define SEGMENT_MS   20
+#define SEGMENT_MIN  -10.0
+#define SEGMENT_MAX  35.0
+
+poptContext ctx;
+
+gchar *input = NULL;
+gchar *ratio_list = "2,4,8,16,32,64";
+gint frame = 1024;
+gint mode = MODE_JSTEREO;
+gint threads = 1;
+gint smooth = 5;
+gdouble ms_ratio = 70.0;
+gint encode_each = 0;
+gint arith = 0;
+gint nls = 0;
+gint flags = 0;
+
+agress_wave w_fmt;
+
+gdouble *ratios;
+gint ratio_count;
+
+guint8 *pcm;                /* source, padded to whole frames */
+gint64 samples;             /* per channel, without padding */
+gint frames;
+gint frame_bytes;
+
+guint8 ***records;          /* [frame][channel] at the highest rate */
+gint **sizes;
+gint coded;
+
+void print_help ();
+void parse_options (int argc, char **argv);
+void parse_ratios ();
+void read_input ();
+gdouble encode_all (gdouble ratio, gboolean keep);
+gdouble decode_at (gdouble ratio, guint8 *out, gint64 *bytes);
+gint reference (gint64 index, gint channel, gint out_channels);
+void measure (guint8 *out, gint out_channels, gdouble *snr,
+              gdouble *segsnr, gint *peak);
+
+void
+print_help ()
+{
+    poptPrintHelp (ctx, stderr, 0);
+    exit (1);
+}
+
+void
+parse_options (int argc, char **argv)
+{
+    gint msf, lsf;
+    gint rc;
+
+    struct poptOption options[] =
+    {
+        {
+            "input", 'i', POPT_ARG_STRING, &input, 0,
+            "Input wav file", "PATHNAME"
+        },
+        {
+            "ratios", 'r', POPT_ARG_STRING, &ratio_list, 0,
+            "Compression ratios, comma separated", "LIST"
+        },
+        {
+            "frame", 'f', POPT_ARG_INT, &frame, 0,
+            "Frame size (power of 2)", "NUMBER"
+        },
+        {
+            "smooth", 'h', POPT_ARG_INT, &smooth, 0,
+            "Smooth factor", "NUMBER"
+        },
+        {
+            "mono", 'm', POPT_ARG_VAL, &mode, MODE_MONO,
+            "Downsample to mono", NULL
+        },
+        {
+            "stereo", 's', POPT_ARG_VAL, &mode, MODE_STEREO,
+            "Full stereo", NULL
+        },
+        {
+            "jstereo", 'j', POPT_ARG_VAL, &mode, MODE_JSTEREO,
+            "Joint stereo", NULL
+        },
+        {
+            "mid-side-ratio", 'R', POPT_ARG_DOUBLE, &ms_ratio, 0,
+            "Mid-side percent ratio", "NUMBER"
+        },
+        {
+            "threads", 't', POPT_ARG_INT, &threads, 0,
+            "Channels coded in parallel", "NUMBER"
+        },
+        {
+            "encode-each", 'E', POPT_ARG_VAL, &encode_each, 1,
+            "Also encode at every ratio to time it and check the cut",
+            NULL
+        },
+        {
+            "arithmetic", 'a', POPT_ARG_VAL, &arith, 1,
+            "Range code the SPIHT decisions", NULL
+        },
+        {
+            "no-lists", 'n', POPT_ARG_VAL, &nls, 1,
+            "Code with state markers instead of SPIHT lists", NULL
+        },
+        POPT_AUTOHELP POPT_TABLEEND
+    };
+
+    ctx = poptGetContext (NULL, argc, (const char **) argv, options, 0);
+    rc = poptGetNextOpt (ctx);
+
+    if (rc < -1)
+    {
+        fprintf (stderr, "%s: %s\n",
+                 poptBadOption (ctx, POPT_BADOPTION_NOALIAS),
+                 poptStrerror (rc));
+        exit (1);
+    }
+
+    if ((ms_ratio <= 1.0) || (ms_ratio >= 99.0))
+        print_help ();
+
+    msf = g_bit_nth_msf (frame, -1);
+    lsf = g_bit_nth_lsf (frame, -1);
+
+    if ((frame < 2) || (frame > G_MAXUINT16) || (msf != lsf))
+        print_help ();
+
+    smooth = CLAMP (smooth, 1, frame);
+
+    if ((threads < 1) || (threads > MAX_CHANNELS))
+        print_help ();
+
+    if (input == NULL)
+        print_help ();
+
+    if (arith)
+        flags |= AG_ARITH;
+
+    if (nls)
+        flags |= AG_NLS;
+
+    parse_ratios ();
+}
+
+void
+parse_ratios ()
+{
+    gchar **items;
+    gchar *end;
+    gint i;
+
+    items = g_strsplit (ratio_list, ",", -1);
+
+    for (ratio_count = 0; items[ratio_count] != NULL; ratio_count++)
+        ;
+
+    ratios = g_new (gdouble, ratio_count);
+
+    for (i = 0; i < ratio_count; i++)
+    {
+        ratios[i] = strtod (items[i], &end);
+
+        if ((end == items[i]) || (*end != '\0') || (ratios[i] < 1.0))
+            print_help ();
+    }
+
+    g_strfreev (items);
+
+    if (ratio_count == 0)
+        print_help ();
+}
+
+void
+read_input ()
+{
+    agress_reader *reader;
+    guint8 *data;
+    GArray *buf;
+    gsize bytes_read;
+    gint width;
+    gint rc;
+
+    reader = agress_reader_open (input);
+
+    if (!reader)
+    {
+        fprintf (stderr, "Cannot open file: %s: %m\n", input);
+        exit (1);
+    }
+
+    rc = agress_reader_wave (reader, &w_fmt);
+
+    if (rc == 0)
+    {
+        fprintf (stderr, "%s: not a wav file\n", input);
+        exit (1);
+    }
+
+    if ((rc != 1) || (w_fmt.channels > MAX_CHANNELS))
+    {
+        fprintf (stderr, "%s: unsupported wav format\n", input);
+        exit (1);
+    }
+
+    buf = g_array_new (FALSE, FALSE, 1);
+
+    while ((w_fmt.length > 0)
+            && ((bytes_read = agress_reader_fetch (reader,
+                              MIN (1 << 20, w_fmt.length), &data)) > 0))
+    {
+        g_array_append_vals (buf, data, bytes_read);
+        w_fmt.length -= bytes_read;
+    }
+
+    agress_reader_close (reader);
+
+    width = w_fmt.bits / 8;
+    samples = buf->len / (width * w_fmt.channels);
+
+    if (samples == 0)
+    {
+        fprintf (stderr, "%s: no samples\n", input);
+        exit (1);
+    }
+
+    frames = (samples + frame - 1) / frame;
+    frame_bytes = frame * width * w_fmt.channels;
+
+    /* Pad like agcodec does: zero bytes */
+    pcm = g_malloc0 ((gsize) frames * frame_bytes);
+    memcpy (pcm, buf->data, samples * width * w_fmt.channels);
+
+    g_array_free (buf, TRUE);
+}
+
+/*
+ * Encodes every frame at ratio and returns the time it took. With
+ * keep the records are stored for decoding, otherwise they are
+ * compared with the cut of the stored ones. Range coded records
+ * only decode the same when cut, a carry can change their bytes.
+ */
+gdouble
+encode_all (gdouble ratio, gboolean keep)
+{
+    agress_encoder *encoder;
+    gint64 start, elapsed;
+    gint f, c;
+
+    encoder = agress_encoder_new (w_fmt.freq, w_fmt.bits, w_fmt.channels,
+                                  frame, mode, ratio, ms_ratio, threads,
+                                  flags);
+    coded = encoder->coded;
+
+    if (keep)
+    {
+        records = g_new (guint8 **, frames);
+        sizes = g_new (gint *, frames);
+    }
+
+    elapsed = 0;
+
+    for (f = 0; f < frames; f++)
+    {
+        start = g_get_monotonic_time ();
+        agress_encoder_frame (encoder, pcm + (gsize) f * frame_bytes);
+        elapsed += g_get_monotonic_time () - start;
+
+        if (keep)
+        {
+            records[f] = g_new (guint8 *, coded);
+            sizes[f] = g_new (gint, coded);
+
+            for (c = 0; c < coded; c++)
+            {
+                sizes[f][c] = encoder->size[c];
+                records[f][c] = g_memdup (encoder->data[c], encoder->size[c]);
+            }
+
+            continue;
+        }
+
+        if (flags & AG_ARITH)
+            continue;
+
+        for (c = 0; c < coded; c++)
+        {
+            if ((encoder->size[c] != MIN (sizes[f][c], encoder->budget[c]))
+                    || memcmp (encoder->data[c], records[f][c],
+                               encoder->size[c]))
+            {
+                fprintf (stderr, "ratio %.2f: frame %d channel %d "
+                         "differs from the cut stream\n", ratio, f, c);
+                break;
+            }
+        }
+    }
+
+    agress_encoder_free (encoder);
+
+    return elapsed / (gdouble) G_USEC_PER_SEC;
+}
+
+/*
+ * Decodes the stored records cut to the budgets of ratio into out.
+ * Returns the decoding time, *bytes gets the size of the stream.
+ */
+gdouble
+decode_at (gdouble ratio, guint8 *out, gint64 *bytes)
+{
+    agress_encoder *encoder;
+    agress_decoder *decoder;
+    agress_header header;
+    gint *budget, *size;
+    gint64 start, elapsed;
+    gint f, c, pos;
+
+    /* Only the budgets are needed, nothing is encoded */
+    encoder = agress_encoder_new (w_fmt.freq, w_fmt.bits, w_fmt.channels,
+                                  frame, mode, ratio, ms_ratio, 1, flags);
+    header = encoder->header;
+    budget = g_memdup (encoder->budget, coded * sizeof (gint));
+    agress_encoder_free (encoder);
+
+    decoder = agress_decoder_new (&header, smooth, threads);
+    size = g_new (gint, coded);
+
+    *bytes = agress_header_size (&header);
+    elapsed = 0;
+    pos = 0;
+
+    for (f = 0; f < frames; f++)
+    {
+        for (c = 0; c < coded; c++)
+        {
+            size[c] = MIN (sizes[f][c], budget[c]);
+            *bytes += sizeof (guint16) + size[c];
+        }
+
+        start = g_get_monotonic_time ();
+
+        if (agress_decoder_frame (decoder, records[f], size))
+        {
+            elapsed += g_get_monotonic_time () - start;
+            memcpy (out + (gsize) pos * decoder->pcm_size, decoder->pcm,
+                    decoder->pcm_size);
+            pos++;
+        }
+        else
+            elapsed += g_get_monotonic_time () - start;
+    }
+
+    start = g_get_monotonic_time ();
+
+    if (agress_decoder_flush (decoder))
+    {
+        elapsed += g_get_monotonic_time () - start;
+        memcpy (out + (gsize) pos * decoder->pcm_size, decoder->pcm,
+                decoder->pcm_size);
+    }
+
+    agress_decoder_free (decoder);
+    g_free (budget);
+    g_free (size);
+
+    return elapsed / (gdouble) G_USEC_PER_SEC;
+}
+
+/*
+ * Source sample as a signed value. In mono mode the decoded channel
+ * is compared with the same downmix the encoder codes.
+ */
+gint
+reference (gint64 index, gint channel, gint out_channels)
+{
+    gint channels = w_fmt.channels;
+    gint sum = 0;
+    gint c;
+
+    if (w_fmt.bits == 8)
+    {
+        if (out_channels == channels)
+            return pcm[index * channels + channel] + G_MININT8;
+
+        for (c = 0; c < channels; c++)
+            sum += pcm[index * channels + c];
+
+        return sum / channels + G_MININT8;
+    }
+
+    if (out_channels == channels)
+        return GINT16_FROM_LE (((gint16 *) pcm)[index * channels + channel]);
+
+    for (c = 0; c < channels; c++)
+        sum += GINT16_FROM_LE (((gint16 *) pcm)[index * channels + c]);
+
+    return sum / channels;
+}
+
+void
+measure (guint8 *out, gint out_channels, gdouble *snr,
+         gdouble *segsnr, gint *peak)
+{
+    gdouble signal = 0.0, noise = 0.0;
+    gdouble seg_signal = 0.0, seg_noise = 0.0;
+    gdouble seg_sum = 0.0, seg_db;
+    gint64 segment, segments = 0;
+    gint64 i;
+    gint c, s, d;
+
+    segment = MAX (w_fmt.freq * SEGMENT_MS / 1000, 1);
+    *peak = 0;
+
+    for (i = 0; i < samples; i++)
+    {
+        for (c = 0; c < out_channels; c++)
+        {
+            s = reference (i, c, out_channels);
+
+            if (w_fmt.bits == 8)
+                d = out[i * out_channels + c] + G_MININT8;
+            else
+                d = GINT16_FROM_LE (((gint16 *) out)[i * out_channels + c]);
+
+            seg_signal += (gdouble) s * s;
+            seg_noise += (gdouble) (s - d) * (s - d);
+            *peak = MAX (*peak, ABS (s - d));
+        }
+
+        if (((i + 1) % segment == 0) || (i + 1 == samples))
+        {
+            /* Silent segments say nothing about quality */
+            if (seg_signal > 0.0)
+            {
+                seg_db = seg_noise > 0.0
+                         ? 10.0 * log10 (seg_signal / seg_noise)
+                         : SEGMENT_MAX;
+                seg_sum += CLAMP (seg_db, SEGMENT_MIN, SEGMENT_MAX);
+                segments++;
+            }
+
+            signal += seg_signal;
+            noise += seg_noise;
+            seg_signal = seg_noise = 0.0;
+        }
+    }
+
+    *snr = noise > 0.0 ? 10.0 * log10 (signal / noise) : INFINITY;
+    *segsnr = segments > 0 ? seg_sum / segments : 0.0;
+}
+
+int
+main (int argc, char **argv)
+{
+    guint8 *out;
+    gdouble top, enc_time, dec_time;
+    gdouble snr, segsnr, seconds;
+    gint64 bytes, total;
+    gint out_channels;
+    gint peak;
+    gint r;
+
+    parse_options (argc, argv);
+    read_input ();
+
+    if (w_fmt.channels == 1)
+        mode = MODE_MONO;
+
+    top = ratios[0];
+
+    for (r = 1; r < ratio_count; r++)
+        top = MIN (top, ratios[r]);
+
+    enc_time = encode_all (top, TRUE);
+
+    out_channels = mode == MODE_MONO ? 1 : w_fmt.channels;
+    out = g_malloc ((gsize) frames * frame * out_channels * w_fmt.bits / 8);
+
+    total = samples * w_fmt.channels;
+    seconds = (gdouble) samples / w_fmt.freq;
+
+    printf ("ratio,frame,mode,ms_ratio,bytes,kbps,snr_db,segsnr_db,"
+            "peak_error,encode_samples_per_sec,decode_samples_per_sec\n");
+
+    for (r = 0; r < ratio_count; r++)
+    {
+        if (encode_each)
+            enc_time = encode_all (ratios[r], FALSE);
+
+        dec_time = decode_at (ratios[r], out, &bytes);
+        measure (out, out_channels, &snr, &segsnr, &peak);
+
+        printf ("%.2f,%d,%s,%.1f,%" G_GINT64_FORMAT ",%.2f,%.3f,%.3f,%d,"
+                "%.0f,%.0f\n",
+                ratios[r], frame,
+                mode == MODE_MONO ? "mono"
+                : mode == MODE_STEREO ? "stereo" : "jstereo",
+                ms_ratio, bytes, bytes * 8 / seconds / 1000.0,
+                snr, segsnr, peak,
+                enc_time > 0.0 ? total / enc_time : 0.0,
+                dec_time > 0.0 ? total / dec_time : 0.0);
+        fflush (stdout);
+    }
+
+    g_free (out);
+
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+/*
+ * Throughput benchmark. The codec is included as source so that
+ * its internal stages can be timed one by one. Results are printed
+ * as CSV, one line per measurement.
+ */
+
+#include "agress.c"
+
+#include <agstream.h>
+#include <popt.h>
+#include <math.h>
+
+#define MIN_BENCH_FRAME 256
+#define MAX_BENCH_FRAME 65536
+
+#define STREAM_FREQ     44100
+#define STREAM_CHANNELS 2
+
+typedef struct bench_format_tag
+{
+    const gchar *name;
+    gint bits;
+    gint sign;
+} bench_format;
+
+typedef struct bench_case_tag
+{
+    gint frame;                 /* samples per channel */
+    gint format;                /* FMT_8 or FMT_16 */
+    gint sign;
+    gint size;                  /* coded bytes per frame */
+    gdouble *signal;
+    gdouble *coeff;
+    gint *dwt;
+    void *pcm;
+    guint8 *stream;
+    gint stream_size;
+    gint samples;               /* samples per stream run */
+    gdouble ratio;
+} bench_case;
+
+typedef void (*bench_func) (bench_case *bc);
+
+poptContext ctx;
+
+gdouble min_time = 0.2;
+gint max_frame = MAX_BENCH_FRAME;
+gint quick = 0;
+
+bench_format formats[] =
+{
+    { "u8", FMT_8, FMT_U },
+    { "s16le", FMT_16, FMT_S },
+    { NULL, 0, 0 }
+};
+
+gdouble ratios[] = { 2.0, 4.0, 8.0, 16.0, 0.0 };
+
+void parse_options (int argc, char **argv);
+gdouble synth_sample (gint i, gint channel);
+void synth_pcm (void *pcm, gint samples, gint channels,
+                gint format, gint sign);
+gdouble measure (bench_func func, bench_case *bc);
+void report (const gchar *stage, const gchar *format, gint frame,
+             gdouble ratio, gint samples, gdouble seconds);
+
+void bench_fdwt (bench_case *bc);
+void bench_idwt (bench_case *bc);
+void bench_spiht_encode (bench_case *bc);
+void bench_spiht_decode (bench_case *bc);
+void bench_encode_frame (bench_case *bc);
+void bench_decode_frame (bench_case *bc);
+void bench_encode_stream (bench_case *bc);
+void bench_decode_stream (bench_case *bc);
+
+void run_transform (gint frame);
+void run_spiht (gint frame);
+void run_frame (gint frame, bench_format *fmt);
+void run_stream (gint frame, bench_format *fmt);
+
+void
+parse_options (int argc, char **argv)
+{
+    gint rc;
+
+    struct poptOption options[] =
+    {
+        {
+            "time", 'T', POPT_ARG_DOUBLE, &min_time, 0,
+            "Minimal time per measurement, seconds", "NUMBER"
+        },
+        {
+            "max-frame", 'f', POPT_ARG_INT, &max_frame, 0,
+            "Largest frame size to sweep", "NUMBER"
+        },
+        {
+            "quick", 'q', POPT_ARG_VAL, &quick, 1,
+            "Fewer frame sizes and a shorter stream", NULL
+        },
+        POPT_AUTOHELP POPT_TABLEEND
+    };
+
+    ctx = poptGetContext (NULL, argc, (const char **) argv, options, 0);
+    rc = poptGetNextOpt (ctx);
+
+    if (rc < -1)
+    {
+        fprintf (stderr, "%s: %s\n",
+                 poptBadOption (ctx, POPT_BADOPTION_NOALIAS),
+                 poptStrerror (rc));
+        exit (1);
+    }
+
+    if ((min_time < 0.0) || (max_frame < MIN_BENCH_FRAME))
+    {
+        poptPrintHelp (ctx, stderr, 0);
+        exit (1);
+    }
+}
+
+/*
+ * Deterministic test signal in [-1, 1]: a few partials with slowly
+ * varying amplitude plus a little pseudo random noise.
+ */
+gdouble
+synth_sample (gint i, gint channel)
+{
+    guint32 noise;
+    gdouble t, x;
+
+    t = (gdouble) i / STREAM_FREQ;
+    noise = (guint32) i * 1664525u + 1013904223u + channel * 69069u;
+    noise ^= noise >> 13;
+    noise *= 1274126177u;
+
+    x = 0.45 * sin (2.0 * G_PI * (220.0 + 110.0 * channel) * t)
+        * (0.6 + 0.4 * sin (2.0 * G_PI * 0.7 * t))
+        + 0.25 * sin (2.0 * G_PI * 1870.0 * t + channel)
+        + 0.1 * sin (2.0 * G_PI * 7350.0 * t)
+        + 0.05 * ((gdouble) (noise >> 8) / (1 << 24) - 0.5);
+
+    return CLAMP (x, -1.0, 1.0);
+}
+
+void
+synth_pcm (void *pcm, gint samples, gint channels, gint format, gint sign)
+{
+    gdouble x;
+    gint i, c;
+
+    for (i = 0; i < samples; i++)
+    {
+        for (c = 0; c < channels; c++)
+        {
+            x = synth_sample (i, c);
+
+            if (format == FMT_8)
+            {
+                gint8 s = (gint8) ROUND (x * G_MAXINT8);
+
+                ((guint8 *) pcm)[i * channels + c] =
+                    (sign == FMT_U) ? (guint8) (s - G_MININT8) : (guint8) s;
+            }
+            else
+            {
+                gint16 s = (gint16) ROUND (x * G_MAXINT16);
+
+                ((gint16 *) pcm)[i * channels + c] =
+                    (sign == FMT_U) ? (gint16) (s - G_MININT16) : s;
+            }
+        }
+    }
+}
+
+/*
+ * Runs func until min_time has passed, at least once, and returns
+ * the mean time of one run in seconds.
+ */
+gdouble
+measure (bench_func func, bench_case *bc)
+{
+    gint64 start, elapsed;
+    gint runs = 0;
+
+    start = g_get_monotonic_time ();
+
+    do
+    {
+        func (bc);
+        runs++;
+        elapsed = g_get_monotonic_time () - start;
+    }
+    while (elapsed < min_time * G_USEC_PER_SEC);
+
+    return (gdouble) elapsed / G_USEC_PER_SEC / runs;
+}
+
+void
+report (const gchar *stage, const gchar *format, gint frame,
+        gdouble ratio, gint samples, gdouble seconds)
+{
+    printf ("%s,%s,%d,%.1f,%d,%.9f,%.0f,%.3f\n",
+            stage, format, frame, ratio, samples, seconds,
+            samples / seconds, seconds * 1e9 / samples);
+    fflush (stdout);
+}
+
+void
+bench_fdwt (bench_case *bc)
+{
+    fdwt (bc->signal, bc->coeff, bc->frame, power_of_two (bc->frame));
+}
+
+void
+bench_idwt (bench_case *bc)
+{
+    idwt (bc->coeff, bc->signal, bc->frame, power_of_two (bc->frame));
+}
+
+void
+bench_spiht_encode (bench_case *bc)
+{
+    spiht_encode (bc->dwt, bc->frame, 1, bc->stream, bc->size, CODER_BITS,
+                  NULL, NULL, NULL, NULL);
+}
+
+void
+bench_spiht_decode (bench_case *bc)
+{
+    spiht_decode (bc->dwt, bc->frame, 1, bc->stream, bc->size, NULL);
+}
+
+void
+bench_encode_frame (bench_case *bc)
+{
+    bc->stream_size = encode_frame (bc->pcm, bc->frame << bc->format,
+                                    bc->stream, bc->size,
+                                    bc->format, FMT_LE, bc->sign);
+}
+
+void
+bench_decode_frame (bench_case *bc)
+{
+    decode_frame (bc->stream, bc->stream_size,
+                  bc->pcm, bc->frame << bc->format,
+                  bc->format, FMT_LE, bc->sign);
+}
+
+/*
+ * Whole stream through the channel layer, joint stereo, in memory.
+ * The encoded records are kept for the decoding run.
+ */
+void
+bench_encode_stream (bench_case *bc)
+{
+    agress_encoder *encoder;
+    gint frames, frame_bytes;
+    gint i, c, pos = 0;
+
+    encoder = agress_encoder_new (STREAM_FREQ, 8 << bc->format,
+                                  STREAM_CHANNELS, bc->frame, MODE_JSTEREO,
+                                  bc->ratio, 70.0, 1, 0);
+
+    frame_bytes = bc->frame * STREAM_CHANNELS << bc->format;
+    frames = bc->samples / bc->frame;
+
+    for (i = 0; i < frames; i++)
+    {
+        agress_encoder_frame (encoder, (guint8 *) bc->pcm + i * frame_bytes);
+
+        for (c = 0; c < encoder->coded; c++)
+        {
+            guint16 size = encoder->size[c];
+
+            memcpy (bc->stream + pos, &size, sizeof (size));
+            memcpy (bc->stream + pos + sizeof (size),
+                    encoder->data[c], size);
+            pos += sizeof (size) + size;
+        }
+    }
+
+    bc->stream_size = pos;
+    agress_encoder_free (encoder);
+}
+
+void
+bench_decode_stream (bench_case *bc)
+{
+    agress_decoder *decoder;
+    agress_header header;
+    guint8 *data[STREAM_CHANNELS];
+    gint size[STREAM_CHANNELS];
+    guint16 record;
+    gint c, pos = 0;
+
+    agress_header_init (&header, STREAM_FREQ, bc->frame, 8 << bc->format,
+                        STREAM_CHANNELS, MODE_JSTEREO);
+    decoder = agress_decoder_new (&header, 5, 1);
+
+    while (pos < bc->stream_size)
+    {
+        for (c = 0; c < decoder->coded; c++)
+        {
+            memcpy (&record, bc->stream + pos, sizeof (record));
+            data[c] = bc->stream + pos + sizeof (record);
+            size[c] = record;
+            pos += sizeof (record) + record;
+        }
+
+        agress_decoder_frame (decoder, data, size);
+    }
+
+    agress_decoder_flush (decoder);
+    agress_decoder_free (decoder);
+}
+
+void
+run_transform (gint frame)
+{
+    bench_case bc;
+    gint i;
+
+    memset (&bc, 0, sizeof (bc));
+    bc.frame = frame;
+    bc.signal = g_new (gdouble, frame);
+    bc.coeff = g_new (gdouble, frame);
+
+    for (i = 0; i < frame; i++)
+        bc.signal[i] = synth_sample (i, 0) * G_MAXINT16;
+
+    report ("fdwt", "double", frame, 0.0, frame, measure (bench_fdwt, &bc));
+    report ("idwt", "double", frame, 0.0, frame, measure (bench_idwt, &bc));
+
+    g_free (bc.signal);
+    g_free (bc.coeff);
+}
+
+void
+run_spiht (gint frame)
+{
+    bench_case bc;
+    gint *dwt;
+    gint r, i;
+
+    memset (&bc, 0, sizeof (bc));
+    bc.frame = frame;
+    bc.signal = g_new (gdouble, frame);
+    bc.coeff = g_new (gdouble, frame);
+    bc.dwt = g_new (gint, frame);
+    bc.stream = g_new (guint8, frame * 2);
+    dwt = g_new (gint, frame);
+
+    for (i = 0; i < frame; i++)
+        bc.signal[i] = synth_sample (i, 0) * G_MAXINT16;
+
+    fdwt (bc.signal, bc.coeff, frame, power_of_two (frame));
+    round_signal (bc.coeff, dwt, frame);
+
+    for (r = 0; ratios[r] > 0.0; r++)
+    {
+        bc.size = CLAMP ((gint) (frame * 2 / ratios[r]), 2, G_MAXUINT16);
+
+        /* spiht_encode consumes nothing, spiht_decode overwrites dwt */
+        memcpy (bc.dwt, dwt, frame * sizeof (gint));
+        report ("spiht_encode", "s16le", frame, ratios[r], frame,
+                measure (bench_spiht_encode, &bc));
+        report ("spiht_decode", "s16le", frame, ratios[r], frame,
+                measure (bench_spiht_decode, &bc));
+    }
+
+    g_free (bc.signal);
+    g_free (bc.coeff);
+    g_free (bc.dwt);
+    g_free (bc.stream);
+    g_free (dwt);
+}
+
+void
+run_frame (gint frame, bench_format *fmt)
+{
+    bench_case bc;
+    gint r;
+
+    memset (&bc, 0, sizeof (bc));
+    bc.frame = frame;
+    bc.format = fmt->bits;
+    bc.sign = fmt->sign;
+    bc.pcm = g_malloc (frame << bc.format);
+    bc.stream = g_new (guint8, frame << bc.format);
+
+    for (r = 0; ratios[r] > 0.0; r++)
+    {
+        synth_pcm (bc.pcm, frame, 1, bc.format, bc.sign);
+        bc.size = CLAMP ((gint) ((frame << bc.format) / ratios[r]),
+                         2, G_MAXUINT16);
+
+        report ("encode_frame", fmt->name, frame, ratios[r], frame,
+                measure (bench_encode_frame, &bc));
+        report ("decode_frame", fmt->name, frame, ratios[r], frame,
+                measure (bench_decode_frame, &bc));
+    }
+
+    g_free (bc.pcm);
+    g_free (bc.stream);
+}
+
+void
+run_stream (gint frame, bench_format *fmt)
+{
+    bench_case bc;
+    gint seconds, r;
+
+    memset (&bc, 0, sizeof (bc));
+    seconds = quick ? 2 : 10;
+
+    bc.frame = frame;
+    bc.format = fmt->bits;
+    bc.sign = fmt->sign;
+    bc.samples = (STREAM_FREQ * seconds / frame + 1) * frame;
+    bc.pcm = g_malloc (bc.samples * STREAM_CHANNELS << bc.format);
+    bc.stream = g_malloc (bc.samples * STREAM_CHANNELS << bc.format);
+
+    synth_pcm (bc.pcm, bc.samples, STREAM_CHANNELS, bc.format, bc.sign);
+
+    for (r = 0; ratios[r] > 0.0; r++)
+    {
+        bc.ratio = ratios[r];
+
+        report ("encode_stream", fmt->name, frame, ratios[r],
+                bc.samples * STREAM_CHANNELS,
+                measure (bench_encode_stream, &bc));
+        report ("decode_stream", fmt->name, frame, ratios[r],
+                bc.samples * STREAM_CHANNELS,
+                measure (bench_decode_stream, &bc));
+    }
+
+    g_free (bc.pcm);
+    g_free (bc.stream);
+}
+
+int
+main (int argc, char **argv)
+{
+    gint frame, step;
+    gint f;
+
+    parse_options (argc, argv);
+
+    step = quick ? 4 : 2;
+
+    printf ("stage,format,frame,ratio,samples,seconds,"
+            "samples_per_sec,ns_per_sample\n");
+
+    for (frame = MIN_BENCH_FRAME; frame <= max_frame; frame *= step)
+    {
+        run_transform (frame);
+        run_spiht (frame);
+
+        for (f = 0; formats[f].name != NULL; f++)
+            run_frame (frame, &formats[f]);
+
+        /* The container stores the frame size in 16 bits */
+        if (frame > G_MAXUINT16)
+            continue;
+
+        for (f = 0; formats[f].name != NULL; f++)
+            run_stream (frame, &formats[f]);
+    }
+
+    return 0;
+}
@@ -17,12 +17,17 @@
 #include <config.h>
 #endif
 
-#include <agress.h>
+#include <agstream.h>
+#include <agio.h>
+#include <aggroup.h>
+#include <agrate.h>
+#include <agstats.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <popt.h>
 #include <glib.h>
+#include <math.h>
 #include <time.h>
 
 #define RIFF 0x46464952
@@ -30,15 +35,11 @@
 #define FMT  0x20746d66
 #define DATA 0x61746164
 
-#define MAGIC 0x4741
+#define STREAM_LENGTH 0xffffffff
 
 #define ENCODE 1
 #define DECODE 2
 
-#define MONO    1
-#define STEREO  2
-#define JSTEREO 3
-
 #define PACKED __attribute__ ((packed))
 
 typedef struct wave_header_tag
@@ -58,50 +59,79 @@ typedef struct wave_header_tag
     guint32 len_data PACKED;
 } wave_header;
 
-typedef struct agress_header_tag
+/* One output of a multi-rate encode */
+typedef struct rung_tag
 {
-    guint16 magic PACKED;
-    guint16 freq PACKED;
-    guint16 frame PACKED;
-    guint8 channels PACKED;
-    guint8 bits PACKED;
-} agress_header;
+    gdouble ratio;
+    gchar *output;
+    agress_writer *writer;
+    agress_group *group;
+    gint *budget;           /* NULL when written as encoded */
+    guint8 **data;          /* records cut to budget */
+    gint *size;
+    agress_rate *rate;      /* cuts records across frames instead */
+    gint tail;              /* of the last frame held by rate */
+} rung;
 
 poptContext ctx;
 
 gint encode = -1;
 gchar *input = NULL;
 gchar *output = NULL;
-gdouble ratio = 4.0;
+gdouble ratio = 0.0;
 gint frame = 1024;
-gint mode = JSTEREO;
+gint mode = MODE_JSTEREO;
+gint threads = 1;
 gint smooth = 5;
 gdouble ms_ratio = 70.0;
+gint direct = 0;
+gint raw = 0;
+gint stats = 0;
+gint flags = 0;
+gint layers = 0;
+gint group_frames = 0;
+gint arith = 0;
+gint nls = 0;
+gchar *ratio_list = NULL;
+gdouble target_snr = 0.0;
+gint max_planes = 0;
+gint window = 0;
+gint adaptive = 0;
+gint block = 0;
+gint perceptual = 0;
+gint levels = 0;
+gint packets = 0;
+gint lapped = 0;
+gdouble reservoir = -1.0;
 
 wave_header w_hdr;
 agress_header a_hdr;
+agress_wave w_fmt;
+
+agress_reader *reader;
+agress_writer *writer;
 
-FILE *wav;
-FILE *agress;
+rung *rungs;
+gint rung_count;
 
 void print_help ();
-gint file_size (FILE *f);
 void parse_options (int argc, char **argv);
-
-void encode_m8 ();
-void encode_m16 ();
-void encode_s8m ();
-void encode_s8s ();
-void encode_s16m ();
-void encode_s16s ();
-void encode_s16j ();
-
-void decode_8m ();
-void decode_8s ();
-void decode_8j ();
-void decode_16m ();
-void decode_16s ();
-void decode_16j ();
+void parse_ratios ();
+
+void write_output (agress_writer *to, const gchar *name,
+                   const void *data, gsize size);
+void write_group (agress_group *group, agress_writer *to,
+                  const gchar *name);
+void close_output (agress_writer *to, const gchar *name);
+void write_frame (rung *r, gint coded, guint8 **data, gint *size,
+                  gint tail);
+void write_rung (rung *r, agress_encoder *encoder);
+void write_rungs (agress_encoder *encoder);
+void flush_rung (rung *r);
+void fill_wave_header (gint channels, gint bits, gint freq,
+                       guint32 length);
+void encode_stream ();
+void decode_stream ();
 
 void
 print_help ()
@@ -110,19 +140,6 @@ print_help ()
     exit (1);
 }
 
-gint
-file_size (FILE *f)
-{
-    gint save_pos, size_of_file;
-
-    save_pos = ftell (f);
-    fseek (f, 0, SEEK_END);
-    size_of_file = ftell (f);
-    fseek (f, save_pos, SEEK_SET);
-
-    return size_of_file;
-}
-
 void
 parse_options (int argc, char **argv)
 {
@@ -155,26 +172,109 @@ parse_options (int argc, char **argv)
             "frame", 'f', POPT_ARG_INT, &frame, 0,
             "Frame size (power of 2)", "NUMBER"
         },
+        {
+            "block", 'b', POPT_ARG_INT, &block, 0,
+            "Split frames with attacks into blocks this long", "NUMBER"
+        },
+        {
+            "perceptual", 'P', POPT_ARG_VAL, &perceptual, 1,
+            "Weight the wavelet bands by a masking model", NULL
+        },
+        {
+            "levels", 'k', POPT_ARG_INT, &levels, 0,
+            "Decompose frames this many levels deep", "NUMBER"
+        },
+        {
+            "packets", 'p', POPT_ARG_VAL, &packets, 1,
+            "Split bands into wavelet packets where it saves bits", NULL
+        },
+        {
+            "lapped", 'O', POPT_ARG_VAL, &lapped, 1,
+            "Lap frames into each other instead of smoothing edges", NULL
+        },
         {
             "smooth", 'h', POPT_ARG_INT, &smooth, 0,
             "Smooth factor", "NUMBER"
         },
         {
-            "mono", 'm', POPT_ARG_VAL, &mode, MONO,
+            "mono", 'm', POPT_ARG_VAL, &mode, MODE_MONO,
             "Downsample to mono", NULL
         },
         {
-            "stereo", 's', POPT_ARG_VAL, &mode, STEREO,
+            "stereo", 's', POPT_ARG_VAL, &mode, MODE_STEREO,
             "Full stereo", NULL
         },
         {
-            "jstereo", 'j', POPT_ARG_VAL, &mode, JSTEREO,
+            "jstereo", 'j', POPT_ARG_VAL, &mode, MODE_JSTEREO,
             "Joint stereo", NULL
         },
+        {
+            "adaptive-stereo", 'J', POPT_ARG_VAL, &adaptive, 1,
+            "Joint stereo, left/right in frames where it codes better",
+            NULL
+        },
         {
             "mid-side-ratio", 'R', POPT_ARG_DOUBLE, &ms_ratio, 0,
             "Mid-side percent ratio", "NUMBER"
         },
+        {
+            "threads", 't', POPT_ARG_INT, &threads, 0,
+            "Channels coded in parallel", "NUMBER"
+        },
+        {
+            "direct", 'D', POPT_ARG_VAL, &direct, WRITER_DIRECT,
+            "Bypass page cache when writing output", NULL
+        },
+        {
+            "raw", 'w', POPT_ARG_VAL, &raw, 1,
+            "Decode to raw PCM without a wav header", NULL
+        },
+        {
+            "stats", 'S', POPT_ARG_VAL, &stats, 1,
+            "Print per-stage timing and counters at exit", NULL
+        },
+        {
+            "layer-table", 'l', POPT_ARG_VAL, &flags, AG_LAYERS,
+            "Store a quality layer table in every record", NULL
+        },
+        {
+            "layers", 'L', POPT_ARG_INT, &layers, 0,
+            "Decode only the first quality layers", "NUMBER"
+        },
+        {
+            "arithmetic", 'a', POPT_ARG_VAL, &arith, 1,
+            "Range code the SPIHT decisions", NULL
+        },
+        {
+            "no-lists", 'n', POPT_ARG_VAL, &nls, 1,
+            "Code with state markers instead of SPIHT lists", NULL
+        },
+        {
+            "group", 'g', POPT_ARG_INT, &group_frames, 0,
+            "Frames per layer-major group", "NUMBER"
+        },
+        {
+            "ratios", 'M', POPT_ARG_STRING, &ratio_list, 0,
+            "Encode once to several ratios, %r in the output name",
+            "LIST"
+        },
+        {
+            "target-snr", 'Q', POPT_ARG_DOUBLE, &target_snr, 0,
+            "Stop every frame at this SNR in dB to full scale", "NUMBER"
+        },
+        {
+            "max-bitplane", 'B', POPT_ARG_INT, &max_planes, 0,
+            "Stop every frame after this many bitplanes", "NUMBER"
+        },
+        {
+            "window", 'W', POPT_ARG_INT, &window, 0,
+            "Share the bytes of this many frames by their distortion",
+            "NUMBER"
+        },
+        {
+            "reservoir", 'V', POPT_ARG_DOUBLE, &reservoir, 0,
+            "Bit reservoir size in average frames", "NUMBER"
+        },
         POPT_AUTOHELP POPT_TABLEEND
     };
 
@@ -200,1393 +300,618 @@ parse_options (int argc, char **argv)
     if ((frame < 2) || (msf != lsf))
         print_help ();
 
+    /* Blocks halve the frame, down to MAX_BLOCKS of them */
+    if (block != 0)
+    {
+        msf = g_bit_nth_msf (block, -1);
+        lsf = g_bit_nth_lsf (block, -1);
+
+        if ((block < 2) || (block >= frame) || (msf != lsf)
+                || (frame / block > MAX_BLOCKS))
+            print_help ();
+
+        flags |= AG_BLOCKS;
+    }
+
+    /* Down to the whole frame, as far as the header holds */
+    if (levels != 0)
+    {
+        if ((levels < 1) || (levels > g_bit_nth_msf (frame, -1))
+                || (levels > AG_LEVELS >> LEVELS_SHIFT))
+            print_help ();
+
+        flags |= levels << LEVELS_SHIFT;
+    }
+
+    /* With a quality to reach the ratio only caps the frames */
+    if (ratio == 0.0)
+        ratio = ((target_snr > 0.0) || (max_planes > 0)) ? 1.0 : 4.0;
+
     if (ratio < 1.0)
         print_help ();
 
+    if ((target_snr < 0.0) || (max_planes < 0))
+        print_help ();
+
+    /* By default the reservoir holds a window */
+    if (reservoir == -1.0)
+        reservoir = window;
+
+    if ((window < 0) || (reservoir < 0.0))
+        print_help ();
+
+    /* The reservoir spends the whole budget, a quality target does not */
+    if ((window > 0) && (target_snr > 0.0))
+        print_help ();
+
+    if ((threads < 1) || (threads > MAX_CHANNELS))
+        print_help ();
+
+    if ((layers < 0) || (layers > MAX_LAYERS))
+        print_help ();
+
+    if ((group_frames < 0) || (group_frames > MAX_GROUP))
+        print_help ();
+
+    if (group_frames > 0)
+        flags |= AG_LAYERS | AG_GROUPS;
+
+    if (arith)
+        flags |= AG_ARITH;
+
+    if (nls)
+        flags |= AG_NLS;
+
+    if (perceptual)
+        flags |= AG_WEIGHTS;
+
+    if (packets)
+        flags |= AG_PACKETS;
+
+    if (lapped)
+        flags |= AG_LAPPED;
+
+    if (adaptive)
+    {
+        mode = MODE_JSTEREO;
+        flags |= AG_STEREO;
+    }
+
     if ((input == NULL) || (output == NULL))
         print_help ();
 
     if (encode == -1)
         print_help ();
+
+    if (encode == ENCODE)
+        parse_ratios ();
 }
 
+/*
+ * Every ratio gets its own output, %r in the output name is replaced
+ * by the ratio. Without a list the single ratio is written to output.
+ */
 void
-encode_m8 ()
+parse_ratios ()
 {
-    guint8 *in_buf;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint out_frame_size;
-    gint bytes_read;
-    guint16 real_size;
+    gchar **items, **parts;
+    gchar *end, *value;
     gint i;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = MONO;
-    a_hdr.bits = 8;
-    a_hdr.frame = frame;
-
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
+    if (ratio_list == NULL)
     {
-        fprintf (stderr, "%s: i/o error\n", output);
-        exit (1);
+        rung_count = 1;
+        rungs = g_new0 (rung, 1);
+        rungs[0].ratio = ratio;
+        rungs[0].output = output;
+        return;
     }
 
-    in_frame_size = frame * sizeof (guint8);
-    out_frame_size = CLAMP (frame / ratio - 2, 2, G_MAXUINT16);
+    items = g_strsplit (ratio_list, ",", -1);
+
+    for (rung_count = 0; items[rung_count] != NULL; rung_count++)
+        ;
 
-    in_buf = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf = (guint8 *) g_malloc (out_frame_size * sizeof (guint8));
+    if ((rung_count == 0)
+            || ((rung_count > 1) && (strstr (output, "%r") == NULL)))
+        print_help ();
+
+    rungs = g_new0 (rung, rung_count);
+    parts = g_strsplit (output, "%r", -1);
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
+    for (i = 0; i < rung_count; i++)
     {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
+        rungs[i].ratio = strtod (items[i], &end);
 
-        real_size = encode_frame (in_buf, in_frame_size,
-                                  out_buf, out_frame_size,
-                                  FMT_8, FMT_LE, FMT_U);
+        if ((end == items[i]) || (*end != '\0') || (rungs[i].ratio < 1.0))
+            print_help ();
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+        value = g_strdup_printf ("%g", rungs[i].ratio);
+        rungs[i].output = g_strjoinv (value, parts);
+        g_free (value);
     }
+
+    g_strfreev (parts);
+    g_strfreev (items);
 }
 
 void
-encode_m16 ()
+write_output (agress_writer *to, const gchar *name,
+              const void *data, gsize size)
 {
-    gint16 *in_buf;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint out_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    gint64 start;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = MONO;
-    a_hdr.bits = 16;
-    a_hdr.frame = frame;
+    start = agress_stats_clock ();
 
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
+    if (!agress_writer_put (to, data, size))
     {
-        fprintf (stderr, "%s: i/o error\n", output);
+        fprintf (stderr, "%s: i/o error\n", name);
         exit (1);
     }
 
-    in_frame_size = frame * sizeof (gint16);
-    out_frame_size = CLAMP (2.0 * frame / ratio - 2, 2, G_MAXUINT16);
-
-    in_buf = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf = (guint8 *) g_malloc (out_frame_size * sizeof (guint8));
+    agress_stats_stage (NULL, STAGE_WRITE, start);
+}
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
+void
+write_group (agress_group *group, agress_writer *to, const gchar *name)
+{
+    if (!agress_group_write (group, to))
     {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
-
-        real_size = encode_frame (in_buf, in_frame_size,
-                                  out_buf, out_frame_size,
-                                  FMT_16, FMT_LE, FMT_S);
-
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+        fprintf (stderr, "%s: i/o error\n", name);
+        exit (1);
     }
 }
 
 void
-encode_s8m ()
+close_output (agress_writer *to, const gchar *name)
 {
-    guint8 *in_buf;
-    guint8 *in_left;
-    guint8 *in_right;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint out_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    gint64 start;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = MONO;
-    a_hdr.bits = 8;
-    a_hdr.frame = frame;
+    start = agress_stats_clock ();
 
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
+    if (!agress_writer_close (to))
     {
-        fprintf (stderr, "%s: i/o error\n", output);
+        fprintf (stderr, "%s: i/o error\n", name);
         exit (1);
     }
 
-    in_frame_size = 2 * frame * sizeof (guint8);
-    out_frame_size = CLAMP (2.0 * frame / ratio - 2, 2, G_MAXUINT16);
-
-    in_buf = (guint8 *) g_malloc (2 * frame * sizeof (guint8));
-    in_left = (guint8 *) g_malloc (frame * sizeof (guint8));
-    in_right = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf = (guint8 *) g_malloc (out_frame_size * sizeof (guint8));
+    agress_stats_stage (NULL, STAGE_WRITE, start);
+}
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
+/*
+ * Writes the frame just encoded to the output of r, first cut to the
+ * budgets of its ratio when it was encoded at a lower one.
+ */
+void
+write_frame (rung *r, gint coded, guint8 **data, gint *size, gint tail)
+{
+    /* The marker goes between groups, right before the last frame */
+    if (tail > 0)
     {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
+        if (r->group != NULL)
+            write_group (r->group, r->writer, r->output);
 
-        for (i = 0; i < frame; i++)
+        if (!agress_writer_tail (r->writer, tail))
         {
-            in_left[i] = in_buf[2 * i];
-            in_right[i] = in_buf[2 * i + 1];
+            fprintf (stderr, "%s: i/o error\n", r->output);
+            exit (1);
         }
+    }
 
-        for (i = 0; i < frame; i++)
-            in_buf[i] = (in_left[i] + in_right[i]) / 2;
-
-        real_size = encode_frame (in_buf, in_frame_size / 2,
-                                  out_buf, out_frame_size,
-                                  FMT_8, FMT_LE, FMT_U);
-
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+    if (r->group != NULL)
+    {
+        if (agress_group_add (r->group, data, size))
+            write_group (r->group, r->writer, r->output);
+    }
+    else if (!agress_writer_frame (r->writer, coded, data, size))
+    {
+        fprintf (stderr, "%s: i/o error\n", r->output);
+        exit (1);
     }
-    g_free(in_buf);
-    g_free(in_left);
-    g_free(in_right);
-    g_free(out_buf);
 }
 
 void
-encode_s8s ()
+write_rung (rung *r, agress_encoder *encoder)
 {
-    guint8 *in_buf;
-    guint8 *in_left;
-    guint8 *in_right;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint out_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    guint8 **data = encoder->data;
+    gint *size = encoder->size;
+    gint c;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = STEREO;
-    a_hdr.bits = 8;
-    a_hdr.frame = frame;
-
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
+    if (r->rate != NULL)
     {
-        fprintf (stderr, "%s: i/o error\n", output);
-        exit (1);
-    }
+        r->tail = encoder->tail;
 
-    in_frame_size = 2 * frame * sizeof (guint8);
-    out_frame_size = CLAMP (frame / ratio - 2, 2, G_MAXUINT16);
+        if (agress_rate_add (r->rate, data, size, encoder->curve))
+            flush_rung (r);
 
-    in_buf = (guint8 *) g_malloc (2 * frame * sizeof (guint8));
-    in_left = (guint8 *) g_malloc (frame * sizeof (guint8));
-    in_right = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf = (guint8 *) g_malloc (out_frame_size * sizeof (guint8));
+        return;
+    }
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
+    if (r->budget != NULL)
     {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
+        if (encoder->flags & AG_STEREO)
+            agress_encoder_budget (encoder, r->ratio, encoder->split,
+                                   r->budget);
 
-        for (i = 0; i < frame; i++)
-        {
-            in_left[i] = in_buf[2 * i];
-            in_right[i] = in_buf[2 * i + 1];
-        }
+        for (c = 0; c < encoder->coded; c++)
+            r->size[c] = agress_record_cut (encoder->data[c],
+                                            encoder->size[c], r->budget[c],
+                                            encoder->flags, r->data[c]);
+        data = r->data;
+        size = r->size;
+    }
+
+    write_frame (r, encoder->coded, data, size, encoder->tail);
+}
 
-        real_size = encode_frame (in_left, in_frame_size / 2,
-                                  out_buf, out_frame_size,
-                                  FMT_8, FMT_LE, FMT_U);
+/*
+ * Writes the frame the encoder has just coded to every rung.
+ */
+void
+write_rungs (agress_encoder *encoder)
+{
+    gint64 start;
+    gint i;
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+    start = agress_stats_clock ();
 
-        real_size = encode_frame (in_right, in_frame_size / 2,
-                                  out_buf, out_frame_size,
-                                  FMT_8, FMT_LE, FMT_U);
+    for (i = 0; i < rung_count; i++)
+        write_rung (&rungs[i], encoder);
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
-    }
-    g_free(in_buf);
-    g_free(in_left);
-    g_free(in_right);
-    g_free(out_buf);
+    agress_stats_stage (NULL, STAGE_WRITE, start);
 }
 
+/*
+ * Writes the frames the rate allocator of a rung holds. The last
+ * frame of the stream comes out last of its window.
+ */
 void
-encode_s8j ()
+flush_rung (rung *r)
 {
-    guint8 *in_buf;
-    guint8 *in_left;
-    guint8 *in_right;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint mid_frame_size;
-    gint side_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    guint8 **data;
+    gint *size;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = JSTEREO;
-    a_hdr.bits = 8;
-    a_hdr.frame = frame;
+    while (agress_rate_next (r->rate, &data, &size))
+        write_frame (r, r->rate->coded, data, size,
+                     r->rate->count == 0 ? r->tail : 0);
+}
 
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
-    {
-        fprintf (stderr, "%s: i/o error\n", output);
-        exit (1);
-    }
+/*
+ * A length of STREAM_LENGTH marks a header written before the
+ * data length is known, as players do for streamed wav.
+ */
+void
+fill_wave_header (gint channels, gint bits, gint freq, guint32 length)
+{
+    w_hdr.id_riff = RIFF;
+    w_hdr.len_riff = (length == STREAM_LENGTH)
+                     ? STREAM_LENGTH : length + sizeof (w_hdr) - 8;
+    w_hdr.id_chuck = WAVE;
+    w_hdr.fmt = FMT;
+    w_hdr.len_chuck = 16;
+    w_hdr.type = 1;
+    w_hdr.channels = channels;
+    w_hdr.freq = freq;
+    w_hdr.bytes = freq * channels * bits / 8;
+    w_hdr.align = channels * bits / 8;
+    w_hdr.bits = bits;
+    w_hdr.id_data = DATA;
+    w_hdr.len_data = length;
+}
 
-    in_frame_size = 2 * frame * sizeof (guint8);
-    mid_frame_size = CLAMP (2.0 * frame / ratio * ms_ratio / 100.0 - 2,
-                            2, G_MAXUINT16);
-    side_frame_size = CLAMP (2.0 * frame / ratio - mid_frame_size - 2,
-                             2, G_MAXUINT16);
+/*
+ * The stream is embedded, so it is encoded once at the lowest ratio
+ * and every other ratio is a cut of the same records.
+ */
+void
+encode_stream ()
+{
+    agress_encoder *encoder;
+    guint8 *in_buf;
+    gdouble lowest, cap;
+    gint in_frame_size, sample_size;
+    gint bytes_read, samples, taken;
+    gint budget, size;
+    gint64 start;
+    gint i, c;
 
-    in_buf = (guint8 *) g_malloc (2 * frame * sizeof (guint8));
-    in_left = (guint8 *) g_malloc (frame * sizeof (guint8));
-    in_right = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf = (guint8 *) g_malloc (MAX (mid_frame_size, side_frame_size)
-                                   * sizeof (guint8));
+    lowest = rungs[0].ratio;
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
-    {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
+    for (i = 1; i < rung_count; i++)
+        lowest = MIN (lowest, rungs[i].ratio);
 
-        for (i = 0; i < frame; i++)
-        {
-            in_left[i]  = CLAMP ((in_buf[2 * i] + in_buf[2 * i + 1]) / 2,
-                                 0, G_MAXUINT8);
-            in_right[i] = CLAMP ((in_buf[2 * i] - in_buf[2 * i + 1]) / 2,
-                                 0, G_MAXUINT8);
-        }
+    /* Across frames one may take its share and all of the reservoir */
+    cap = window > 0 ? MAX (lowest / (1.0 + reservoir), 1.0) : lowest;
 
-        real_size = encode_frame (in_left, in_frame_size / 2,
-                                  out_buf, mid_frame_size,
-                                  FMT_8, FMT_LE, FMT_U);
+    sample_size = w_fmt.channels * w_fmt.bits / 8;
+    in_frame_size = frame * sample_size;
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+    /* Decoders cut a short last frame to the length of the input */
+    if ((w_fmt.length == G_MAXUINT64) || (w_fmt.length % in_frame_size))
+        flags |= AG_TAIL;
 
-        real_size = encode_frame (in_right, in_frame_size / 2,
-                                  out_buf, side_frame_size,
-                                  FMT_8, FMT_LE, FMT_U);
+    encoder = agress_encoder_new (w_fmt.freq, w_fmt.bits, w_fmt.channels,
+                                  frame, mode, cap, ms_ratio, threads,
+                                  flags);
+    a_hdr = encoder->header;
+    encoder->measure = window > 0;
+    encoder->block = block > 0 ? block : frame;
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
-    }
-    g_free(in_buf);
-    g_free(in_left);
-    g_free(in_right);
-    g_free(out_buf);
-}
+    encoder->quality.max_planes = max_planes;
 
-void
-encode_s16m ()
-{
-    gint16 *in_buf;
-    gint16 *in_left;
-    gint16 *in_right;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint out_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    /* Noise target_snr dB below a full scale sine */
+    if (target_snr > 0.0)
+    {
+        gdouble full = (w_fmt.bits == 8) ? G_MAXINT8 : G_MAXINT16;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = MONO;
-    a_hdr.bits = 16;
-    a_hdr.frame = frame;
+        encoder->quality.noise = full * full / 2.0
+                                 * pow (10.0, -target_snr / 10.0);
+    }
 
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
+    for (i = 0; i < rung_count; i++)
     {
-        fprintf (stderr, "%s: i/o error\n", output);
-        exit (1);
-    }
+        write_output (rungs[i].writer, rungs[i].output,
+                      &a_hdr, agress_header_size (&a_hdr));
+
+        if (group_frames > 0)
+            rungs[i].group = agress_group_new (group_frames, encoder->coded);
 
-    in_frame_size = 2 * frame * sizeof (gint16);
-    out_frame_size = CLAMP (4.0 * frame / ratio - 2, 2, G_MAXUINT16);
+        if ((rungs[i].ratio == lowest) && (window == 0))
+            continue;
 
-    in_buf = (gint16 *) g_malloc (2 * frame * sizeof (gint16));
-    in_left = (gint16 *) g_malloc (frame * sizeof (gint16));
-    in_right = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf = (guint8 *) g_malloc (out_frame_size * sizeof (guint8));
+        rungs[i].budget = g_new (gint, encoder->coded);
+        rungs[i].data = g_new (guint8 *, encoder->coded);
+        rungs[i].size = g_new (gint, encoder->coded);
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
-    {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
+        agress_encoder_budget (encoder, rungs[i].ratio, ms_ratio,
+                               rungs[i].budget);
 
-        for (i = 0; i < frame; i++)
+        if (window > 0)
         {
-            in_left[i] = in_buf[2 * i];
-            in_right[i] = in_buf[2 * i + 1];
+            for (budget = 0, c = 0; c < encoder->coded; c++)
+                budget += rungs[i].budget[c];
+
+            rungs[i].rate = agress_rate_new (window, encoder->coded, flags,
+                                             budget, reservoir * budget);
         }
 
-        for (i = 0; i < frame; i++)
-            in_buf[i] = (in_left[i] + in_right[i]) / 2;
+        for (c = 0; c < encoder->coded; c++)
+        {
+            size = rungs[i].budget[c];
 
-        real_size = encode_frame (in_buf, in_frame_size / 2,
-                                  out_buf, out_frame_size,
-                                  FMT_16, FMT_LE, FMT_S);
+            /* The split of a switching pair changes from frame to frame */
+            if ((encoder->flags & AG_STEREO) && (c < 2))
+                size = rungs[i].budget[0] + rungs[i].budget[1];
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+            rungs[i].data[c] = g_malloc (size + LAYER_TABLE);
+        }
     }
-    g_free(in_buf);
-    g_free(in_left);
-    g_free(in_right);
-    g_free(out_buf);
-}
 
-void
-encode_s16s ()
-{
-    gint16 *in_buf;
-    gint16 *in_left;
-    gint16 *in_right;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint out_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    /* Whole frames are encoded in place, only a short last one is copied */
+    while (w_fmt.length > 0)
+    {
+        start = agress_stats_clock ();
+        bytes_read = agress_reader_fetch (reader,
+                                          MIN (in_frame_size, w_fmt.length),
+                                          &in_buf);
+        agress_stats_stage (NULL, STAGE_READ, start);
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = STEREO;
-    a_hdr.bits = 16;
-    a_hdr.frame = frame;
+        if (bytes_read == 0)
+            break;
 
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
-    {
-        fprintf (stderr, "%s: i/o error\n", output);
-        exit (1);
+        w_fmt.length -= bytes_read;
+
+        samples = bytes_read / sample_size;
+
+        while (samples > 0)
+        {
+            taken = agress_encoder_push (encoder, in_buf, samples);
+            in_buf += taken * sample_size;
+            samples -= taken;
+
+            while (agress_encoder_pull (encoder))
+                write_rungs (encoder);
+        }
     }
 
-    in_frame_size = 2 * frame * sizeof (gint16);
-    out_frame_size = CLAMP (2.0 * frame / ratio - 2, 2, G_MAXUINT16);
+    agress_encoder_finish (encoder);
 
-    in_buf = (gint16 *) g_malloc (2 * frame * sizeof (gint16));
-    in_left = (gint16 *) g_malloc (frame * sizeof (gint16));
-    in_right = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf = (guint8 *) g_malloc (out_frame_size * sizeof (guint8));
+    while (agress_encoder_pull (encoder))
+        write_rungs (encoder);
 
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
+    for (i = 0; i < rung_count; i++)
     {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
-
-        for (i = 0; i < frame; i++)
+        if (rungs[i].rate != NULL)
         {
-            in_left[i] = in_buf[2 * i];
-            in_right[i] = in_buf[2 * i + 1];
+            start = agress_stats_clock ();
+            agress_rate_finish (rungs[i].rate);
+            flush_rung (&rungs[i]);
+            agress_stats_stage (NULL, STAGE_WRITE, start);
+            agress_rate_free (rungs[i].rate);
         }
 
-        real_size = encode_frame (in_left, in_frame_size / 2,
-                                  out_buf, out_frame_size,
-                                  FMT_16, FMT_LE, FMT_S);
-
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+        if (rungs[i].group != NULL)
+        {
+            start = agress_stats_clock ();
+            write_group (rungs[i].group, rungs[i].writer, rungs[i].output);
+            agress_stats_stage (NULL, STAGE_WRITE, start);
+            agress_group_free (rungs[i].group);
+        }
 
-        real_size = encode_frame (in_right, in_frame_size / 2,
-                                  out_buf, out_frame_size,
-                                  FMT_16, FMT_LE, FMT_S);
+        if (rungs[i].budget != NULL)
+        {
+            for (c = 0; c < encoder->coded; c++)
+                g_free (rungs[i].data[c]);
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+            g_free (rungs[i].budget);
+            g_free (rungs[i].data);
+            g_free (rungs[i].size);
+        }
     }
-    g_free(in_buf);
-    g_free(in_left);
-    g_free(in_right);
-    g_free(out_buf);
+
+    agress_encoder_free (encoder);
 }
 
 void
-encode_s16j ()
+decode_stream ()
 {
-    gint16 *in_buf;
-    gint16 *in_left;
-    gint16 *in_right;
-    guint8 *out_buf;
-    gint in_frame_size;
-    gint mid_frame_size;
-    gint side_frame_size;
-    gint bytes_read;
-    guint16 real_size;
-    gint i;
+    agress_decoder *decoder;
+    agress_group *group = NULL;
+    guint8 **in_buf;
+    gint *in_size;
+    gint64 start;
+    gint tail, rc;
 
-    a_hdr.magic = MAGIC;
-    a_hdr.freq = w_hdr.freq;
-    a_hdr.channels = JSTEREO;
-    a_hdr.bits = 16;
-    a_hdr.frame = frame;
+    decoder = agress_decoder_new (&a_hdr, smooth, threads);
 
-    if (fwrite (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
+    if (decoder == NULL)
     {
-        fprintf (stderr, "%s: i/o error\n", output);
+        fprintf (stderr, "%s: not an agress file\n", input);
         exit (1);
     }
 
-    in_frame_size = 2 * frame * sizeof (gint16);
-    mid_frame_size = CLAMP (4.0 * frame / ratio * ms_ratio / 100.0 - 2,
-                            2, G_MAXUINT16);
-    side_frame_size = CLAMP (4.0 * frame / ratio - mid_frame_size - 2,
-                             2, G_MAXUINT16);
-
-    in_buf = (gint16 *) g_malloc (2 * frame * sizeof (gint16));
-    in_left = (gint16 *) g_malloc (frame * sizeof (gint16));
-    in_right = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf = (guint8 *) g_malloc (MAX (mid_frame_size, side_frame_size)
-                                   * sizeof (guint8));
-
-    while ((bytes_read = fread (in_buf, 1, in_frame_size, wav)) > 0)
+    if ((layers > 0) && !(decoder->flags & AG_LAYERS))
     {
-        if (bytes_read < in_frame_size)
-            memset ((guint8 *) in_buf + bytes_read, 0, in_frame_size - bytes_read);
-
-        for (i = 0; i < frame; i++)
-        {
-            in_left[i]  = CLAMP ((in_buf[2 * i] + in_buf[2 * i + 1]) / 2,
-                                 G_MININT16, G_MAXINT16);
-            in_right[i] = CLAMP ((in_buf[2 * i] - in_buf[2 * i + 1]) / 2,
-                                 G_MININT16, G_MAXINT16);
-        }
-
-        real_size = encode_frame (in_left, in_frame_size / 2,
-                                  out_buf, mid_frame_size,
-                                  FMT_16, FMT_LE, FMT_S);
-
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+        fprintf (stderr, "%s: no layer table\n", input);
+        exit (1);
+    }
 
-        real_size = encode_frame (in_right, in_frame_size / 2,
-                                  out_buf, side_frame_size,
-                                  FMT_16, FMT_LE, FMT_S);
+    decoder->max_layers = layers;
 
-        fwrite (&real_size, 1, sizeof (real_size), agress);
-        fwrite (out_buf, 1, real_size, agress);
+    /* Files get the real length later, pipes cannot seek back */
+    if (!raw)
+    {
+        fill_wave_header (decoder->channels, decoder->width * 8, a_hdr.freq,
+                          writer->seekable ? 0 : STREAM_LENGTH);
+        write_output (writer, output, &w_hdr, sizeof (w_hdr));
     }
-    g_free(in_buf);
-    g_free(in_left);
-    g_free(in_right);
-    g_free(out_buf);
-}
-
-void
-decode_8m ()
-{
-    guint8 *in_buf;
-    guint8 *out_buf1;
-    guint8 *out_buf2;
-    guint8 *temp;
-    guint16 frame_size;
-    gint bytes_read;
-    gint first_frame = 1;
-    gint only_frame = 1;
-    gint f_size;
 
-    fseek (wav, sizeof (w_hdr), SEEK_SET);
+    in_buf = g_new (guint8 *, decoder->coded);
+    in_size = g_new (gint, decoder->coded);
 
-    in_buf = (guint8 *) g_malloc (G_MAXUINT16 * sizeof (guint8));
-    out_buf1 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf2 = (guint8 *) g_malloc (frame * sizeof (guint8));
+    if (decoder->flags & AG_GROUPS)
+        group = agress_group_new (0, decoder->coded);
 
     for (;;)
     {
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
+        /* Between groups, if any, a marker may give the last frame */
+        if ((decoder->flags & AG_TAIL)
+                && ((group == NULL) || (group->next >= group->count))
+                && ((tail = agress_reader_tail (reader)) > 0))
+            decoder->tail = tail;
 
-        if (!bytes_read)
-            break;
+        start = agress_stats_clock ();
 
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
+        if (group != NULL)
+            rc = agress_group_next (group, reader, in_buf, in_size);
+        else
+            rc = agress_reader_frame (reader, decoder->coded,
+                                      in_buf, in_size);
 
-        bytes_read = fread (in_buf, 1, frame_size, agress);
+        agress_stats_stage (NULL, STAGE_READ, start);
 
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
+        if (rc == 0)
             break;
-        }
 
-        if (first_frame)
+        if (rc != 1)
         {
-            decode_frame (in_buf, frame_size, out_buf1, frame,
-                          FMT_8, FMT_LE, FMT_U);
-            first_frame = 0;
-            continue;
+            fprintf (stderr, "%s: unexcpected end of file\n", input);
+            break;
         }
 
-        decode_frame (in_buf, frame_size, out_buf2, frame,
-                      FMT_8, FMT_LE, FMT_U);
-
-        smooth_edge (out_buf1, out_buf2, frame, smooth,
-                     FMT_8, FMT_LE, FMT_U);
-
-        fwrite (out_buf1, 1, frame, wav);
-
-        temp = out_buf1;
-        out_buf1 = out_buf2;
-        out_buf2 = temp;
-        only_frame = 0;
+        if (agress_decoder_frame (decoder, in_buf, in_size))
+            write_output (writer, output, decoder->pcm, decoder->pcm_size);
     }
 
-    if (!only_frame)
-        fwrite (out_buf2, 1, frame, wav);
+    if (agress_decoder_flush (decoder))
+        write_output (writer, output, decoder->pcm, decoder->pcm_size);
 
-    f_size = ftell (wav);
-    fseek (wav, 0, SEEK_SET);
+    if (!raw && writer->seekable)
+    {
+        fill_wave_header (decoder->channels, decoder->width * 8, a_hdr.freq,
+                          agress_writer_tell (writer) - sizeof (w_hdr));
 
-    w_hdr.id_riff = RIFF;
-    w_hdr.len_riff = f_size - 8;
-    w_hdr.id_chuck = WAVE;
-    w_hdr.fmt = FMT;
-    w_hdr.len_chuck = 16;
-    w_hdr.type = 1;
-    w_hdr.channels = 1;
-    w_hdr.freq = a_hdr.freq;
-    w_hdr.bytes = a_hdr.freq;
-    w_hdr.align = 1;
-    w_hdr.bits = 8;
-    w_hdr.id_data = DATA;
-    w_hdr.len_data = f_size - 44;
+        if (!agress_writer_patch (writer, 0, &w_hdr, sizeof (w_hdr)))
+        {
+            fprintf (stderr, "%s: i/o error\n", output);
+            exit (1);
+        }
+    }
 
-    fwrite (&w_hdr, 1, sizeof (w_hdr), wav);
+    if (group != NULL)
+        agress_group_free (group);
 
-    g_free(in_buf);
-    g_free(out_buf1);
-    g_free(out_buf2);
+    g_free (in_buf);
+    g_free (in_size);
+    agress_decoder_free (decoder);
 }
 
 void
-decode_8s ()
+encode_file ()
 {
-    guint8 *in_buf;
-    guint8 *out_buf;
-    guint8 *out_buf1;
-    guint8 *out_buf2;
-    guint8 *out_buf3;
-    guint8 *out_buf4;
-    guint8 *temp;
-    guint16 frame_size;
-    gint bytes_read;
-    gint first_frame = 1;
-    gint only_frame = 1;
-    gint f_size;
-    gint i;
+    gint rc, i;
 
-    fseek (wav, sizeof (w_hdr), SEEK_SET);
+    reader = agress_reader_open (input);
 
-    in_buf = (guint8 *) g_malloc (G_MAXUINT16 * sizeof (guint8));
-    out_buf = (guint8 *) g_malloc (2 * frame * sizeof (guint8));
-    out_buf1 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf2 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf3 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf4 = (guint8 *) g_malloc (frame * sizeof (guint8));
-
-    for (;;)
+    if (!reader)
     {
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
+        fprintf (stderr, "Cannot open file: %s: %m\n", input);
+        exit (1);
+    }
 
-        if (!bytes_read)
-            break;
+    for (i = 0; i < rung_count; i++)
+    {
+        rungs[i].writer = agress_writer_open (rungs[i].output, direct);
 
-        if (bytes_read != sizeof (guint16))
+        if (!rungs[i].writer)
         {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
+            fprintf (stderr, "Cannot create file: %s: %m\n",
+                     rungs[i].output);
+            exit (1);
         }
+    }
 
-        bytes_read = fread (in_buf, 1, frame_size, agress);
+    rc = agress_reader_wave (reader, &w_fmt);
 
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
+    if (rc == 0)
+    {
+        fprintf (stderr, "%s: not a wav file\n", input);
+        exit (1);
+    }
 
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf1, frame,
-                          FMT_8, FMT_LE, FMT_U);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf2, frame,
-                          FMT_8, FMT_LE, FMT_U);
-
-            smooth_edge (out_buf1, out_buf2, frame, smooth,
-                         FMT_8, FMT_LE, FMT_U);
-        }
-
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf3, frame,
-                          FMT_8, FMT_LE, FMT_U);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf4, frame,
-                          FMT_8, FMT_LE, FMT_U);
-
-            smooth_edge (out_buf3, out_buf4, frame, smooth,
-                         FMT_8, FMT_LE, FMT_U);
-        }
-
-        if (first_frame)
-        {
-            first_frame = 0;
-            continue;
-        }
-
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = out_buf1[i];
-            out_buf[2 * i + 1] = out_buf3[i];
-        }
-
-        fwrite (out_buf, 1, frame * 2, wav);
-
-        temp = out_buf1;
-        out_buf1 = out_buf2;
-        out_buf2 = temp;
-
-        temp = out_buf3;
-        out_buf3 = out_buf4;
-        out_buf4 = temp;
-
-        only_frame = 0;
-    }
-
-    if (!only_frame)
-    {
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = out_buf2[i];
-            out_buf[2 * i + 1] = out_buf4[i];
-        }
-
-        fwrite (out_buf, 1, frame * 2, wav);
-    }
-
-    f_size = ftell (wav);
-    fseek (wav, 0, SEEK_SET);
-
-    w_hdr.id_riff = RIFF;
-    w_hdr.len_riff = f_size - 8;
-    w_hdr.id_chuck = WAVE;
-    w_hdr.fmt = FMT;
-    w_hdr.len_chuck = 16;
-    w_hdr.type = 1;
-    w_hdr.channels = 2;
-    w_hdr.freq = a_hdr.freq;
-    w_hdr.bytes = a_hdr.freq * 2;
-    w_hdr.align = 2;
-    w_hdr.bits = 8;
-    w_hdr.id_data = DATA;
-    w_hdr.len_data = f_size - 44;
-
-    fwrite (&w_hdr, 1, sizeof (w_hdr), wav);
-
-    g_free(in_buf);
-    g_free(out_buf);
-    g_free(out_buf1);
-    g_free(out_buf2);
-    g_free(out_buf3);
-    g_free(out_buf4);
-}
-
-void
-decode_8j ()
-{
-    guint8 *in_buf;
-    guint8 *out_buf;
-    guint8 *out_buf1;
-    guint8 *out_buf2;
-    guint8 *out_buf3;
-    guint8 *out_buf4;
-    guint8 *temp;
-    guint16 frame_size;
-    gint bytes_read;
-    gint first_frame = 1;
-    gint only_frame = 1;
-    gint f_size;
-    gint i;
-
-    fseek (wav, sizeof (w_hdr), SEEK_SET);
-
-    in_buf = (guint8 *) g_malloc (G_MAXUINT16 * sizeof (guint8));
-    out_buf = (guint8 *) g_malloc (2 * frame * sizeof (guint8));
-    out_buf1 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf2 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf3 = (guint8 *) g_malloc (frame * sizeof (guint8));
-    out_buf4 = (guint8 *) g_malloc (frame * sizeof (guint8));
-
-    for (;;)
+    if ((rc != 1) || (w_fmt.channels > MAX_CHANNELS))
     {
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (!bytes_read)
-            break;
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf1, frame,
-                          FMT_8, FMT_LE, FMT_U);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf2, frame,
-                          FMT_8, FMT_LE, FMT_U);
-
-            smooth_edge (out_buf1, out_buf2, frame, smooth,
-                         FMT_8, FMT_LE, FMT_U);
-        }
-
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf3, frame,
-                          FMT_8, FMT_LE, FMT_U);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf4, frame,
-                          FMT_8, FMT_LE, FMT_U);
-
-            smooth_edge (out_buf3, out_buf4, frame, smooth,
-                         FMT_8, FMT_LE, FMT_U);
-        }
-
-        if (first_frame)
-        {
-            first_frame = 0;
-            continue;
-        }
-
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = CLAMP (out_buf1[i] + out_buf3[i], 0, G_MAXUINT8);
-            out_buf[2 * i + 1] = CLAMP (out_buf1[i] - out_buf3[i], 0, G_MAXUINT8);
-        }
-
-        fwrite (out_buf, 1, frame * 2, wav);
-
-        temp = out_buf1;
-        out_buf1 = out_buf2;
-        out_buf2 = temp;
-
-        temp = out_buf3;
-        out_buf3 = out_buf4;
-        out_buf4 = temp;
-
-        only_frame = 0;
-    }
-
-    if (!only_frame)
-    {
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = CLAMP (out_buf2[i] + out_buf4[i], 0, G_MAXUINT8);
-            out_buf[2 * i + 1] = CLAMP (out_buf2[i] - out_buf4[i], 0, G_MAXUINT8);
-        }
-
-        fwrite (out_buf, 1, frame * 2, wav);
-    }
-
-    f_size = ftell (wav);
-    fseek (wav, 0, SEEK_SET);
-
-    w_hdr.id_riff = RIFF;
-    w_hdr.len_riff = f_size - 8;
-    w_hdr.id_chuck = WAVE;
-    w_hdr.fmt = FMT;
-    w_hdr.len_chuck = 16;
-    w_hdr.type = 1;
-    w_hdr.channels = 2;
-    w_hdr.freq = a_hdr.freq;
-    w_hdr.bytes = a_hdr.freq * 2;
-    w_hdr.align = 2;
-    w_hdr.bits = 8;
-    w_hdr.id_data = DATA;
-    w_hdr.len_data = f_size - 44;
-
-    fwrite (&w_hdr, 1, sizeof (w_hdr), wav);
-
-    g_free(in_buf);
-    g_free(out_buf);
-    g_free(out_buf1);
-    g_free(out_buf2);
-    g_free(out_buf3);
-    g_free(out_buf4);
-}
-
-void
-decode_16m ()
-{
-    guint8 *in_buf;
-    gint16 *out_buf1;
-    gint16 *out_buf2;
-    gint16 *temp;
-    guint16 frame_size;
-    gint bytes_read;
-    gint first_frame = 1;
-    gint only_frame = 1;
-    gint f_size;
-
-    fseek (wav, sizeof (w_hdr), SEEK_SET);
-
-    in_buf = (guint8 *) g_malloc (G_MAXUINT16 * sizeof (guint8));
-    out_buf1 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf2 = (gint16 *) g_malloc (frame * sizeof (gint16));
-
-    for (;;)
-    {
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (!bytes_read)
-            break;
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf1, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-            first_frame = 0;
-            continue;
-        }
-
-        decode_frame (in_buf, frame_size, out_buf2, frame * 2,
-                      FMT_16, FMT_LE, FMT_S);
-
-        smooth_edge (out_buf1, out_buf2, frame, smooth,
-                     FMT_16, FMT_LE, FMT_S);
-
-        fwrite (out_buf1, 1, frame * 2, wav);
-
-        temp = out_buf1;
-        out_buf1 = out_buf2;
-        out_buf2 = temp;
-        only_frame = 0;
-    }
-
-    if (!only_frame)
-        fwrite (out_buf2, 1, frame * 2, wav);
-
-    f_size = ftell (wav);
-    fseek (wav, 0, SEEK_SET);
-
-    w_hdr.id_riff = RIFF;
-    w_hdr.len_riff = f_size - 8;
-    w_hdr.id_chuck = WAVE;
-    w_hdr.fmt = FMT;
-    w_hdr.len_chuck = 16;
-    w_hdr.type = 1;
-    w_hdr.channels = 1;
-    w_hdr.freq = a_hdr.freq;
-    w_hdr.bytes = a_hdr.freq * 2;
-    w_hdr.align = 2;
-    w_hdr.bits = 16;
-    w_hdr.id_data = DATA;
-    w_hdr.len_data = f_size - 44;
-
-    fwrite (&w_hdr, 1, sizeof (w_hdr), wav);
-
-    g_free(in_buf);
-    g_free(out_buf1);
-    g_free(out_buf2);
-}
-
-void
-decode_16s ()
-{
-    guint8 *in_buf;
-    gint16 *out_buf;
-    gint16 *out_buf1;
-    gint16 *out_buf2;
-    gint16 *out_buf3;
-    gint16 *out_buf4;
-    gint16 *temp;
-    guint16 frame_size;
-    gint bytes_read;
-    gint first_frame = 1;
-    gint only_frame = 1;
-    gint f_size;
-    gint i;
-
-    fseek (wav, sizeof (w_hdr), SEEK_SET);
-
-    in_buf = (guint8 *) g_malloc (G_MAXUINT16 * sizeof (guint8));
-    out_buf = (gint16 *) g_malloc (2 * frame * sizeof (gint16));
-    out_buf1 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf2 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf3 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf4 = (gint16 *) g_malloc (frame * sizeof (gint16));
-
-    for (;;)
-    {
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (!bytes_read)
-            break;
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf1, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf2, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-
-            smooth_edge (out_buf1, out_buf2, frame, smooth,
-                         FMT_16, FMT_LE, FMT_S);
-        }
-
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf3, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf4, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-
-            smooth_edge (out_buf3, out_buf4, frame, smooth,
-                         FMT_16, FMT_LE, FMT_S);
-        }
-
-        if (first_frame)
-        {
-            first_frame = 0;
-            continue;
-        }
-
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = out_buf1[i];
-            out_buf[2 * i + 1] = out_buf3[i];
-        }
-
-        fwrite (out_buf, 1, frame * 4, wav);
-
-        temp = out_buf1;
-        out_buf1 = out_buf2;
-        out_buf2 = temp;
-
-        temp = out_buf3;
-        out_buf3 = out_buf4;
-        out_buf4 = temp;
-
-        only_frame = 0;
-    }
-
-    if (!only_frame)
-    {
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = out_buf2[i];
-            out_buf[2 * i + 1] = out_buf4[i];
-        }
-
-        fwrite (out_buf, 1, frame * 4, wav);
-    }
-
-    f_size = ftell (wav);
-    fseek (wav, 0, SEEK_SET);
-
-    w_hdr.id_riff = RIFF;
-    w_hdr.len_riff = f_size - 8;
-    w_hdr.id_chuck = WAVE;
-    w_hdr.fmt = FMT;
-    w_hdr.len_chuck = 16;
-    w_hdr.type = 1;
-    w_hdr.channels = 2;
-    w_hdr.freq = a_hdr.freq;
-    w_hdr.bytes = a_hdr.freq * 4;
-    w_hdr.align = 4;
-    w_hdr.bits = 16;
-    w_hdr.id_data = DATA;
-    w_hdr.len_data = f_size - 44;
-
-    fwrite (&w_hdr, 1, sizeof (w_hdr), wav);
-
-    g_free(in_buf);
-    g_free(out_buf);
-    g_free(out_buf1);
-    g_free(out_buf2);
-    g_free(out_buf3);
-    g_free(out_buf4);
-}
-
-void
-decode_16j ()
-{
-    guint8 *in_buf;
-    gint16 *out_buf;
-    gint16 *out_buf1;
-    gint16 *out_buf2;
-    gint16 *out_buf3;
-    gint16 *out_buf4;
-    gint16 *temp;
-    guint16 frame_size;
-    gint bytes_read;
-    gint first_frame = 1;
-    gint only_frame = 1;
-    gint f_size;
-    gint i;
-
-    fseek (wav, sizeof (w_hdr), SEEK_SET);
-
-    in_buf = (guint8 *) g_malloc (G_MAXUINT16 * sizeof (guint8));
-    out_buf = (gint16 *) g_malloc (2 * frame * sizeof (gint16));
-    out_buf1 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf2 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf3 = (gint16 *) g_malloc (frame * sizeof (gint16));
-    out_buf4 = (gint16 *) g_malloc (frame * sizeof (gint16));
-
-    for (;;)
-    {
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (!bytes_read)
-            break;
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf1, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf2, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-
-            smooth_edge (out_buf1, out_buf2, frame, smooth,
-                         FMT_16, FMT_LE, FMT_S);
-        }
-
-        bytes_read = fread (&frame_size, 1, sizeof (frame_size), agress);
-
-        if (bytes_read != sizeof (guint16))
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        bytes_read = fread (in_buf, 1, frame_size, agress);
-
-        if (bytes_read != frame_size)
-        {
-            fprintf (stderr, "%s: unexcpected end of file\n", input);
-            break;
-        }
-
-        if (first_frame)
-        {
-            decode_frame (in_buf, frame_size, out_buf3, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-        }
-        else
-        {
-            decode_frame (in_buf, frame_size, out_buf4, frame * 2,
-                          FMT_16, FMT_LE, FMT_S);
-
-            smooth_edge (out_buf3, out_buf4, frame, smooth,
-                         FMT_16, FMT_LE, FMT_S);
-        }
-
-        if (first_frame)
-        {
-            first_frame = 0;
-            continue;
-        }
-
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = CLAMP (out_buf1[i] + out_buf3[i],
-                                    G_MININT16, G_MAXINT16);
-            out_buf[2 * i + 1] = CLAMP (out_buf1[i] - out_buf3[i],
-                                        G_MININT16, G_MAXINT16);
-        }
-
-        fwrite (out_buf, 1, frame * 4, wav);
-
-        temp = out_buf1;
-        out_buf1 = out_buf2;
-        out_buf2 = temp;
-
-        temp = out_buf3;
-        out_buf3 = out_buf4;
-        out_buf4 = temp;
-
-        only_frame = 0;
-    }
-
-    if (!only_frame)
-    {
-        for (i = 0; i < frame; i++)
-        {
-            out_buf[2 * i] = CLAMP (out_buf2[i] + out_buf4[i],
-                                    G_MININT16, G_MAXINT16);
-            out_buf[2 * i + 1] = CLAMP (out_buf2[i] - out_buf4[i],
-                                        G_MININT16, G_MAXINT16);
-        }
-
-        fwrite (out_buf, 1, frame * 4, wav);
-    }
-
-    f_size = ftell (wav);
-    fseek (wav, 0, SEEK_SET);
-
-    w_hdr.id_riff = RIFF;
-    w_hdr.len_riff = f_size - 8;
-    w_hdr.id_chuck = WAVE;
-    w_hdr.fmt = FMT;
-    w_hdr.len_chuck = 16;
-    w_hdr.type = 1;
-    w_hdr.channels = 2;
-    w_hdr.freq = a_hdr.freq;
-    w_hdr.bytes = a_hdr.freq * 4;
-    w_hdr.align = 4;
-    w_hdr.bits = 16;
-    w_hdr.id_data = DATA;
-    w_hdr.len_data = f_size - 44;
-
-    fwrite (&w_hdr, 1, sizeof (w_hdr), wav);
-
-    g_free(in_buf);
-    g_free(out_buf);
-    g_free(out_buf1);
-    g_free(out_buf2);
-    g_free(out_buf3);
-    g_free(out_buf4);
-}
-
-void
-encode_file ()
-{
-    wav = fopen (input, "rb");
-
-    if (!wav)
-    {
-        fprintf (stderr, "Cannot open file: %s: %m\n", input);
-        exit (1);
-    }
-
-    agress = fopen (output, "wb");
-
-    if (!agress)
-    {
-        fprintf (stderr, "Cannot create file: %s: %m\n", output);
-        exit (1);
-    }
-
-    if (fread (&w_hdr, 1, sizeof (w_hdr), wav) != sizeof (w_hdr))
-    {
-        fprintf (stderr, "%s: not a wav file\n", input);
+        fprintf (stderr, "%s: unsupported wav format\n", input);
         exit (1);
     }
 
-    if ((w_hdr.id_riff != RIFF)
-            || (w_hdr.id_chuck != WAVE)
-            || (w_hdr.fmt != FMT)
-            || (w_hdr.id_data != DATA)
-            || (w_hdr.type != 1))
-    {
-        fprintf (stderr, "%s: not a wav file\n", input);
-        exit (1);
-    }
+    encode_stream ();
+    agress_reader_close (reader);
 
-    if (w_hdr.bits == 8)
-    {
-        if (w_hdr.channels == 1)
-        {
-            encode_m8 (&w_hdr);
-        }
-        else if (w_hdr.channels == 2)
-        {
-            if (mode == MONO)
-                encode_s8m ();
-            else if (mode == STEREO)
-                encode_s8s ();
-            else if (mode == JSTEREO)
-                encode_s8j ();
-            else
-                g_assert_not_reached ();
-        }
-    }
-    else if (w_hdr.bits == 16)
-    {
-        if (w_hdr.channels == 1)
-        {
-            encode_m16 ();
-        }
-        else if (w_hdr.channels == 2)
-        {
-            if (mode == MONO)
-                encode_s16m ();
-            else if (mode == STEREO)
-                encode_s16s ();
-            else if (mode == JSTEREO)
-                encode_s16j ();
-            else
-                g_assert_not_reached ();
-        }
-        else
-            g_assert_not_reached ();
-    }
-    else
-        g_assert_not_reached ();
+    for (i = 0; i < rung_count; i++)
+        close_output (rungs[i].writer, rungs[i].output);
 }
 
 void
 decode_file ()
 {
-    agress = fopen (input, "rb");
+    reader = agress_reader_open (input);
 
-    if (!agress)
+    if (!reader)
     {
         fprintf (stderr, "Cannot open file: %s: %m\n", input);
         exit (1);
     }
 
-    wav = fopen (output, "wb");
+    writer = agress_writer_open (output, direct);
 
-    if (!wav)
+    if (!writer)
     {
         fprintf (stderr, "Cannot create file: %s: %m\n", output);
         exit (1);
     }
 
-    if (fread (&a_hdr, 1, sizeof (a_hdr), agress) != sizeof (a_hdr))
-    {
-        fprintf (stderr, "%s: not an agress file\n", input);
-        exit (1);
-    }
-
-    if (a_hdr.magic != MAGIC)
+    if (!agress_header_read (reader, &a_hdr))
     {
         fprintf (stderr, "%s: not an agress file\n", input);
         exit (1);
@@ -1594,41 +919,29 @@ decode_file ()
 
     frame = a_hdr.frame;
 
-    if (a_hdr.bits == 8)
-    {
-        if (a_hdr.channels == MONO)
-            decode_8m ();
-        else if (a_hdr.channels == STEREO)
-            decode_8s ();
-        else if (a_hdr.channels == JSTEREO)
-            decode_8j ();
-        else
-            g_assert_not_reached ();
-    }
-    else if (a_hdr.bits == 16)
-    {
-        if (a_hdr.channels == MONO)
-            decode_16m ();
-        else if (a_hdr.channels == STEREO)
-            decode_16s ();
-        else if (a_hdr.channels == JSTEREO)
-            decode_16j ();
-        else
-            g_assert_not_reached ();
-    }
-    else
-        g_assert_not_reached ();
+    decode_stream ();
+    agress_reader_close (reader);
+    close_output (writer, output);
 }
 
 int
 main (int argc, char **argv)
 {
+    gint64 start;
+
     parse_options (argc, argv);
 
+    agress_stats_enable (stats);
+    start = g_get_monotonic_time ();
+
     if (encode == ENCODE)
         encode_file ();
     else
         decode_file ();
 
+    if (stats)
+        agress_stats_print (stderr, (g_get_monotonic_time () - start)
+                            / (gdouble) G_USEC_PER_SEC);
+
     return 0;
 }
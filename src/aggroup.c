@@ -0,0 +1,422 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <aggroup.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+/*
+ * Bytes of the largest group after its size field: a full head and
+ * MAX_GROUP frames of records with the longest table and payload.
+ */
+#define GROUP_MOST(coded) \
+    (GROUP_FIXED - 4 + 4 * 256 \
+     + (gsize) MAX_GROUP * (coded) * (2 + 1 + 2 * 255 + G_MAXUINT16))
+
+static guint8 *
+reserve (agress_group *group, gint index, gint size);
+
+static void
+put16 (GByteArray *buffer, guint16 value);
+
+static void
+put32 (GByteArray *buffer, guint32 value);
+
+static void
+set32 (guint8 *data, guint32 value);
+
+static guint
+get16 (const guint8 *data);
+
+static guint32
+get32 (const guint8 *data);
+
+static gint
+slice (const guint8 *record, gint payload, gint section, gint *start);
+
+static gint
+read_group (agress_group *group, agress_reader *reader);
+
+/*
+ * Makes room for size bytes in a record buffer.
+ */
+static guint8 *
+reserve (agress_group *group, gint index, gint size)
+{
+    if (group->alloc[index] < size)
+    {
+        group->record[index] = g_realloc (group->record[index], size);
+        group->alloc[index] = size;
+    }
+
+    return group->record[index];
+}
+
+static void
+put16 (GByteArray *buffer, guint16 value)
+{
+    value = GUINT16_TO_LE (value);
+    g_byte_array_append (buffer, (guint8 *) &value, sizeof (value));
+}
+
+static void
+put32 (GByteArray *buffer, guint32 value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (buffer, (guint8 *) &value, sizeof (value));
+}
+
+static void
+set32 (guint8 *data, guint32 value)
+{
+    value = GUINT32_TO_LE (value);
+    memcpy (data, &value, sizeof (value));
+}
+
+static guint
+get16 (const guint8 *data)
+{
+    guint16 value;
+
+    memcpy (&value, data, sizeof (value));
+
+    return GUINT16_FROM_LE (value);
+}
+
+static guint32
+get32 (const guint8 *data)
+{
+    guint32 value;
+
+    memcpy (&value, data, sizeof (value));
+
+    return GUINT32_FROM_LE (value);
+}
+
+/*
+ * Bytes of a payload of payload bytes in the given section, the
+ * layer table of the record is at record. Section count holds what
+ * follows the last complete layer, later sections are empty.
+ */
+static gint
+slice (const guint8 *record, gint payload, gint section, gint *start)
+{
+    gint count, end;
+
+    count = record[0];
+    *start = 0;
+
+    if (section > count)
+        return 0;
+
+    if (section > 0)
+        *start = get16 (record + 1 + 2 * (section - 1));
+
+    if (section < count)
+        end = MIN (get16 (record + 1 + 2 * section), payload);
+    else
+        end = payload;
+
+    return MAX (end - *start, 0);
+}
+
+agress_group *
+agress_group_new (gint frames, gint coded)
+{
+    agress_group *group;
+
+    g_assert ((frames >= 0) && (frames <= MAX_GROUP));
+
+    group = g_new0 (agress_group, 1);
+    group->frames = frames;
+    group->coded = coded;
+    group->record = g_new0 (guint8 *, MAX_GROUP * coded);
+    group->size = g_new0 (gint, MAX_GROUP * coded);
+    group->alloc = g_new0 (gint, MAX_GROUP * coded);
+    group->buffer = g_byte_array_new ();
+
+    return group;
+}
+
+void
+agress_group_free (agress_group *group)
+{
+    gint i;
+
+    for (i = 0; i < MAX_GROUP * group->coded; i++)
+        g_free (group->record[i]);
+
+    g_free (group->record);
+    g_free (group->size);
+    g_free (group->alloc);
+    g_byte_array_free (group->buffer, TRUE);
+    g_free (group);
+}
+
+/*
+ * Copies the records of one frame into the group.
+ * Returns TRUE when the group is full and has to be written.
+ */
+gboolean
+agress_group_add (agress_group *group, guint8 **data, gint *size)
+{
+    gint c, index;
+
+    g_assert (group->count < group->frames);
+
+    for (c = 0; c < group->coded; c++)
+    {
+        index = group->count * group->coded + c;
+        memcpy (reserve (group, index, size[c]), data[c], size[c]);
+        group->size[index] = size[c];
+    }
+
+    group->count++;
+
+    return (group->count == group->frames);
+}
+
+/*
+ * Writes the frames held, if any, as one group and empties it.
+ */
+gboolean
+agress_group_write (agress_group *group, agress_writer *writer)
+{
+    GByteArray *buffer = group->buffer;
+    gint records, sections;
+    gint table, start, len;
+    guint32 total;
+    guint8 *record;
+    guint8 byte;
+    gint r, s;
+
+    if (group->count == 0)
+        return TRUE;
+
+    records = group->count * group->coded;
+    sections = 0;
+
+    for (r = 0; r < records; r++)
+        sections = MAX (sections, group->record[r][0] + 1);
+
+    g_byte_array_set_size (buffer, 0);
+    put32 (buffer, 0);
+    put32 (buffer, 0);
+    byte = group->count;
+    g_byte_array_append (buffer, &byte, 1);
+    byte = sections;
+    g_byte_array_append (buffer, &byte, 1);
+
+    total = 0;
+
+    for (s = 0; s < sections; s++)
+    {
+        for (r = 0; r < records; r++)
+        {
+            record = group->record[r];
+            table = 1 + 2 * record[0];
+            total += slice (record, group->size[r] - table, s, &start);
+        }
+
+        put32 (buffer, total);
+    }
+
+    for (r = 0; r < records; r++)
+    {
+        record = group->record[r];
+        table = 1 + 2 * record[0];
+
+        put16 (buffer, group->size[r] - table);
+        g_byte_array_append (buffer, record, table);
+    }
+
+    set32 (buffer->data + 4, buffer->len);
+
+    for (s = 0; s < sections; s++)
+    {
+        for (r = 0; r < records; r++)
+        {
+            record = group->record[r];
+            table = 1 + 2 * record[0];
+            len = slice (record, group->size[r] - table, s, &start);
+
+            if (len > 0)
+                g_byte_array_append (buffer, record + table + start, len);
+        }
+    }
+
+    set32 (buffer->data, buffer->len - 4);
+    group->count = 0;
+
+    return agress_writer_put (writer, buffer->data, buffer->len);
+}
+
+/*
+ * Reads the next group and rebuilds its records.
+ * Returns 1 on success, 0 at the end of input and -1 if the
+ * group head is incomplete or broken.
+ */
+static gint
+read_group (agress_group *group, agress_reader *reader)
+{
+    guint8 *data, *head, *record;
+    gint records, sections, count;
+    gint table, start, len;
+    gsize length, available, pos;
+    gint *payload;
+    gint r, s;
+
+    length = agress_reader_fetch (reader, 4, &data);
+
+    if (length == 0)
+        return 0;
+
+    if (length < 4)
+        return -1;
+
+    /* A broken size must not make the reader take the whole input */
+    if (get32 (data) > GROUP_MOST (group->coded))
+        return -1;
+
+    length = agress_reader_fetch (reader, get32 (data), &data);
+
+    if (length < GROUP_FIXED - 4)
+        return -1;
+
+    /* Offsets below are relative to data, past the size field */
+    pos = get32 (data) - 4;
+    count = data[4];
+    sections = data[5];
+    records = count * group->coded;
+
+    if ((count < 1) || (count > MAX_GROUP) || (pos > length)
+            || (pos < GROUP_FIXED - 4 + 4 * sections))
+        return -1;
+
+    head = data + pos;
+    available = length - pos;
+    payload = g_new (gint, records);
+
+    /* Layer tables */
+    pos = GROUP_FIXED - 4 + 4 * sections;
+
+    for (r = 0; r < records; r++)
+    {
+        if ((data + pos + 3 > head)
+                || (data + pos + 3 + 2 * data[pos + 2] > head))
+        {
+            g_free (payload);
+            return -1;
+        }
+
+        payload[r] = get16 (data + pos);
+        table = 1 + 2 * data[pos + 2];
+
+        record = reserve (group, r, table + payload[r]);
+        memcpy (record, data + pos + 2, table);
+        group->size[r] = table;
+        pos += 2 + table;
+    }
+
+    /* Sections, the records end where the input does */
+    pos = 0;
+
+    for (s = 0; s < sections; s++)
+    {
+        for (r = 0; r < records; r++)
+        {
+            record = group->record[r];
+            table = 1 + 2 * record[0];
+            len = slice (record, payload[r], s, &start);
+
+            if ((len <= 0) || (pos >= available))
+                continue;
+
+            len = MIN (len, available - pos);
+            memcpy (record + table + start, head + pos, len);
+            group->size[r] = table + start + len;
+            pos += len;
+        }
+    }
+
+    g_free (payload);
+
+    group->count = count;
+    group->next = 0;
+
+    return 1;
+}
+
+/*
+ * Hands out the records of the next frame, reading a new group
+ * when the current one is used up. Returns 1, or 0 at the end of
+ * input and -1 on a broken group like agress_reader_frame.
+ */
+gint
+agress_group_next (agress_group *group, agress_reader *reader,
+                   guint8 **data, gint *size)
+{
+    gint c, rc;
+
+    if (group->next >= group->count)
+    {
+        group->count = 0;
+
+        if ((rc = read_group (group, reader)) != 1)
+            return rc;
+    }
+
+    for (c = 0; c < group->coded; c++)
+    {
+        data[c] = group->record[group->next * group->coded + c];
+        size[c] = group->size[group->next * group->coded + c];
+    }
+
+    group->next++;
+
+    return 1;
+}
+
+/*
+ * Cuts a group in place to its head and first layers sections, for
+ * serving low bandwidth clients. data holds at least the first
+ * length bytes of the group, GROUP_FIXED plus the end table are
+ * enough. Returns the size of the cut group, 0 if data is too short.
+ */
+gsize
+agress_group_cut (guint8 *data, gsize length, gint layers)
+{
+    gsize size;
+
+    if (length < GROUP_FIXED)
+        return 0;
+
+    if ((layers < 1) || (layers > data[9]))
+        return get32 (data) + 4;
+
+    if (length < GROUP_FIXED + 4 * layers)
+        return 0;
+
+    size = get32 (data + 4) + get32 (data + GROUP_FIXED + 4 * (layers - 1));
+    set32 (data, size - 4);
+
+    return size;
+}
@@ -0,0 +1,74 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifndef __AGGROUP_H__
+#define __AGGROUP_H__
+
+#include <agio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Layer-major groups of frames (AG_GROUPS streams). The records of
+ * up to MAX_GROUP frames, each with a layer table, are cut at their
+ * quality layer boundaries and stored section by section: the first
+ * layer of every record, then the second one and so on, the rest of
+ * every record last. Reading only the top layers of a group is one
+ * contiguous prefix of it.
+ *
+ *   guint32 size            bytes of the group after this field
+ *   guint32 head            bytes of the group head, size included
+ *   guint8  frames
+ *   guint8  sections
+ *   guint32 end[sections]   section bytes up to the end of section i
+ *   per record:             guint16 payload size, layer table
+ *   sections
+ *
+ * Multibyte fields are little endian. A group cut short after its
+ * head decodes whatever its sections still hold.
+ */
+#define MAX_GROUP     255
+#define GROUP_FIXED   10
+
+typedef struct agress_group_tag
+{
+    gint frames;            /* frames per group when writing */
+    gint coded;             /* records per frame */
+    gint count;             /* frames held */
+    gint next;              /* next frame handed out when reading */
+    guint8 **record;        /* MAX_GROUP * coded records */
+    gint *size;
+    gint *alloc;
+    GByteArray *buffer;     /* assembled group */
+} agress_group;
+
+agress_group *
+agress_group_new (gint frames, gint coded);
+void
+agress_group_free (agress_group *group);
+gboolean
+agress_group_add (agress_group *group, guint8 **data, gint *size);
+gboolean
+agress_group_write (agress_group *group, agress_writer *writer);
+gint
+agress_group_next (agress_group *group, agress_reader *reader,
+                   guint8 **data, gint *size);
+gsize
+agress_group_cut (guint8 *data, gsize length, gint layers);
+
+G_END_DECLS
+
+#endif /* __AGGROUP_H__ */
@@ -0,0 +1,724 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <agio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define READ_CHUNK (1 << 16)
+#define WRITE_BLOCK (1 << 20)
+#define WRITE_ALIGN 4096
+
+#define ID_RIFF 0x46464952
+#define ID_RF64 0x34364652
+#define ID_WAVE 0x45564157
+#define ID_FMT  0x20746d66
+#define ID_DS64 0x34367364
+#define ID_DATA 0x61746164
+
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+#define UNKNOWN_LENGTH 0xffffffff
+
+#define PACKED __attribute__ ((packed))
+
+typedef struct riff_chunk_tag
+{
+    guint32 id PACKED;
+    guint32 len PACKED;
+} riff_chunk;
+
+typedef struct wave_format_tag
+{
+    guint16 type PACKED;
+    guint16 channels PACKED;
+    guint32 freq PACKED;
+    guint32 bytes PACKED;
+    guint16 align PACKED;
+    guint16 bits PACKED;
+    guint16 ext_size PACKED;        /* WAVE_FORMAT_EXTENSIBLE only */
+    guint16 valid_bits PACKED;
+    guint32 channel_mask PACKED;
+    guint16 sub_type PACKED;        /* first two bytes of the GUID */
+    guint8 guid[14];
+} wave_format;
+
+typedef struct ds64_chunk_tag
+{
+    guint64 len_riff PACKED;
+    guint64 len_data PACKED;
+    guint64 samples PACKED;
+    guint32 table PACKED;
+} ds64_chunk;
+
+static gboolean
+fill_window (agress_reader *reader, gsize size);
+
+static gsize
+peek (agress_reader *reader, gsize size);
+
+static gboolean
+read_chunk (agress_reader *reader, void *data, gsize size, guint32 len);
+
+static gboolean
+write_all (gint fd, const guint8 *data, gsize size);
+
+static void
+direct_off (agress_writer *writer);
+
+agress_reader *
+agress_reader_open (const gchar *filename)
+{
+    agress_reader *reader;
+    struct stat st;
+    off_t start = 0;
+    gint fd;
+
+    if (strcmp (filename, "-") == 0)
+    {
+        fd = STDIN_FILENO;
+
+        /* Standard input may already be partly consumed */
+        start = lseek (fd, 0, SEEK_CUR);
+    }
+    else
+        fd = open (filename, O_RDONLY);
+
+    if (fd == -1)
+        return NULL;
+
+    reader = g_new0 (agress_reader, 1);
+    reader->fd = fd;
+
+    if ((fstat (fd, &st) == 0) && S_ISREG (st.st_mode)
+            && (start >= 0) && (st.st_size > start))
+        reader->map = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+
+    if (reader->map != NULL)
+    {
+        reader->buffer = (guint8 *) g_mapped_file_get_contents (reader->map);
+        reader->length = g_mapped_file_get_length (reader->map);
+        reader->offset = start;
+        reader->eof = TRUE;
+
+#ifdef HAVE_POSIX_MADVISE
+        posix_madvise (reader->buffer, reader->length,
+                       POSIX_MADV_SEQUENTIAL);
+#endif
+    }
+    else
+    {
+        reader->size = READ_CHUNK;
+        reader->buffer = (guint8 *) g_malloc (reader->size);
+    }
+
+    return reader;
+}
+
+void
+agress_reader_close (agress_reader *reader)
+{
+    if (reader->map != NULL)
+        g_mapped_file_unref (reader->map);
+    else
+        g_free (reader->buffer);
+
+    close (reader->fd);
+    g_free (reader);
+}
+
+static gboolean
+fill_window (agress_reader *reader, gsize size)
+{
+    gssize bytes_read;
+
+    if (reader->offset > 0)
+    {
+        g_memmove (reader->buffer, reader->buffer + reader->offset,
+                   reader->length - reader->offset);
+        reader->length -= reader->offset;
+        reader->offset = 0;
+    }
+
+    if (size > reader->size)
+    {
+        reader->size = MAX (size, 2 * reader->size);
+        reader->buffer = (guint8 *) g_realloc (reader->buffer, reader->size);
+    }
+
+    while ((reader->length < size) && !reader->eof)
+    {
+        bytes_read = read (reader->fd, reader->buffer + reader->length,
+                           reader->size - reader->length);
+
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return FALSE;
+        }
+
+        if (bytes_read == 0)
+            reader->eof = TRUE;
+
+        reader->length += bytes_read;
+    }
+
+    return TRUE;
+}
+
+static gsize
+peek (agress_reader *reader, gsize size)
+{
+    if ((reader->length - reader->offset < size) && !reader->eof)
+        fill_window (reader, size);
+
+    return MIN (size, reader->length - reader->offset);
+}
+
+/*
+ * Makes up to size bytes available at *data and consumes them.
+ * Returns the number of bytes actually available, which is less
+ * than size only at the end of input.
+ */
+gsize
+agress_reader_fetch (agress_reader *reader, gsize size, guint8 **data)
+{
+    gsize available;
+
+    available = peek (reader, size);
+
+    *data = reader->buffer + reader->offset;
+    reader->offset += available;
+
+    return available;
+}
+
+/*
+ * Discards size bytes of input. Seekable inputs are not read at all,
+ * a seek past the end of a file counts as the input ending first.
+ * Returns FALSE if the input ends first.
+ */
+gboolean
+agress_reader_skip (agress_reader *reader, guint64 size)
+{
+    struct stat st;
+    gsize available;
+    off_t pos;
+
+    available = MIN (size, reader->length - reader->offset);
+    reader->offset += available;
+    size -= available;
+
+    if ((size == 0) || reader->eof)
+        return (size == 0);
+
+    if ((pos = lseek (reader->fd, size, SEEK_CUR)) != -1)
+    {
+        if ((fstat (reader->fd, &st) == 0) && S_ISREG (st.st_mode))
+            return (pos <= st.st_size);
+
+        return TRUE;
+    }
+
+    while (size > 0)
+    {
+        available = peek (reader, MIN (size, reader->size));
+
+        if (available == 0)
+            return FALSE;
+
+        reader->offset += available;
+        size -= available;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Reads the records of one frame, count channels of a 16-bit size
+ * followed by the payload. All count payloads stay valid until the
+ * next call. Returns 1 on success, 0 at the end of input and -1 if
+ * the frame is truncated.
+ */
+gint
+agress_reader_frame (agress_reader *reader, gint count,
+                     guint8 **data, gint *size)
+{
+    guint16 frame_size;
+    gsize pos = 0;
+    gint c;
+
+    for (c = 0; c < count; c++)
+    {
+        if (peek (reader, pos + sizeof (frame_size))
+                < pos + sizeof (frame_size))
+        {
+            if ((c == 0) && (peek (reader, 1) == 0))
+                return 0;
+
+            return -1;
+        }
+
+        memcpy (&frame_size, reader->buffer + reader->offset + pos,
+                sizeof (frame_size));
+
+        size[c] = frame_size;
+        pos += sizeof (frame_size) + frame_size;
+
+        if (peek (reader, pos) < pos)
+            return -1;
+    }
+
+    /* The window may have moved while filling, take pointers last */
+    pos = 0;
+
+    for (c = 0; c < count; c++)
+    {
+        pos += sizeof (frame_size);
+        data[c] = reader->buffer + reader->offset + pos;
+        pos += size[c];
+    }
+
+    reader->offset += pos;
+
+    return 1;
+}
+
+/*
+ * Consumes a tail marker if one is next: TAIL_SIZE where a frame or
+ * group would start with its size, and the guint16 samples per
+ * channel of the last frame. Records of streams with markers stay
+ * below G_MAXUINT16 bytes and groups far below TAIL_SIZE, so a
+ * marker cannot be mistaken for either, empty records included.
+ * Returns the samples, or 0 and consumes nothing if no marker is next.
+ */
+gint
+agress_reader_tail (agress_reader *reader)
+{
+    guint32 size;
+    guint16 samples;
+
+    if (peek (reader, TAIL_MARKER) < TAIL_MARKER)
+        return 0;
+
+    memcpy (&size, reader->buffer + reader->offset, sizeof (size));
+    memcpy (&samples, reader->buffer + reader->offset + sizeof (size),
+            sizeof (samples));
+
+    if ((size != TAIL_SIZE) || (samples == 0))
+        return 0;
+
+    reader->offset += TAIL_MARKER;
+
+    return GUINT16_FROM_LE (samples);
+}
+
+/*
+ * Reads the first size bytes of a chunk of len bytes into data,
+ * zero filling a short chunk, and skips the rest with its pad byte.
+ */
+static gboolean
+read_chunk (agress_reader *reader, void *data, gsize size, guint32 len)
+{
+    guint8 *buf;
+    gsize count;
+
+    count = MIN (size, len);
+    memset (data, 0, size);
+
+    if (agress_reader_fetch (reader, count, &buf) != count)
+        return FALSE;
+
+    memcpy (data, buf, count);
+
+    return agress_reader_skip (reader, len - count + (len & 1));
+}
+
+/*
+ * Walks the RIFF chunks up to the sample data, skipping the ones
+ * it does not know, and leaves the reader at the first sample.
+ * Returns 1 for 8 or 16 bit PCM, 0 if the input is not a wav file
+ * and -1 if the format is not supported.
+ */
+gint
+agress_reader_wave (agress_reader *reader, agress_wave *wave)
+{
+    riff_chunk chunk;
+    wave_format fmt;
+    ds64_chunk ds64;
+    guint32 form = 0;
+    gboolean have_fmt = FALSE;
+    gboolean have_ds64 = FALSE;
+    gboolean rf64;
+    gint type;
+
+    memset (&ds64, 0, sizeof (ds64));
+
+    if (!read_chunk (reader, &chunk, sizeof (chunk), sizeof (chunk))
+            || ((chunk.id != ID_RIFF) && (chunk.id != ID_RF64))
+            || !read_chunk (reader, &form, sizeof (form), sizeof (form))
+            || (form != ID_WAVE))
+        return 0;
+
+    rf64 = (chunk.id == ID_RF64);
+
+    for (;;)
+    {
+        if (!read_chunk (reader, &chunk, sizeof (chunk), sizeof (chunk)))
+            return 0;
+
+        if (chunk.id == ID_DATA)
+            break;
+
+        switch (chunk.id)
+        {
+        case ID_FMT:
+            have_fmt = read_chunk (reader, &fmt, sizeof (fmt), chunk.len);
+            break;
+
+        case ID_DS64:
+            have_ds64 = read_chunk (reader, &ds64, sizeof (ds64), chunk.len)
+                        && (chunk.len >= 2 * sizeof (guint64));
+            break;
+
+        default:
+            if (!agress_reader_skip (reader,
+                                     (guint64) chunk.len + (chunk.len & 1)))
+                return 0;
+            break;
+        }
+    }
+
+    /* RF64 keeps the real lengths in ds64 only */
+    if (!have_fmt || (rf64 && !have_ds64))
+        return 0;
+
+    /* Streaming writers leave the length unset */
+    if (rf64 && (chunk.len == UNKNOWN_LENGTH))
+        wave->length = ds64.len_data;
+    else if (chunk.len == UNKNOWN_LENGTH)
+        wave->length = G_MAXUINT64;
+    else
+        wave->length = chunk.len;
+
+    type = fmt.type;
+
+    if ((type == WAVE_FORMAT_EXTENSIBLE) && (fmt.ext_size >= 22))
+        type = fmt.sub_type;
+
+    if ((type != WAVE_FORMAT_PCM)
+            || ((fmt.bits != 8) && (fmt.bits != 16))
+            || (fmt.channels < 1)
+            || (fmt.align != fmt.channels * fmt.bits / 8))
+        return -1;
+
+    wave->channels = fmt.channels;
+    wave->freq = fmt.freq;
+    wave->bits = fmt.bits;
+
+    return 1;
+}
+
+/*
+ * Reads a stream header, the more field included when the magic
+ * says it follows. Returns FALSE if the input is too short, the
+ * header is not checked otherwise.
+ */
+gboolean
+agress_header_read (agress_reader *reader, agress_header *header)
+{
+    guint8 *buf;
+    gsize more;
+
+    if (agress_reader_fetch (reader, AG_HEADER, &buf) != AG_HEADER)
+        return FALSE;
+
+    memcpy (header, buf, AG_HEADER);
+    more = agress_header_size (header) - AG_HEADER;
+
+    if (more == 0)
+        return TRUE;
+
+    if (agress_reader_fetch (reader, more, &buf) != more)
+        return FALSE;
+
+    memcpy ((guint8 *) header + AG_HEADER, buf, more);
+
+    return TRUE;
+}
+
+agress_writer *
+agress_writer_open (const gchar *filename, gint flags)
+{
+    agress_writer *writer;
+    gint open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    gint fd = -1;
+
+    if (strcmp (filename, "-") == 0)
+    {
+        fd = STDOUT_FILENO;
+        flags &= ~WRITER_DIRECT;
+    }
+
+#ifndef O_DIRECT
+    flags &= ~WRITER_DIRECT;
+#endif
+#ifndef HAVE_POSIX_MEMALIGN
+    flags &= ~WRITER_DIRECT;
+#endif
+
+#ifdef O_DIRECT
+    if ((fd == -1) && (flags & WRITER_DIRECT))
+    {
+        fd = open (filename, open_flags | O_DIRECT, 0666);
+
+        /* Not every filesystem supports it, fall back to buffered i/o */
+        if (fd == -1)
+            flags &= ~WRITER_DIRECT;
+    }
+#endif
+
+    if (fd == -1)
+        fd = open (filename, open_flags, 0666);
+
+    if (fd == -1)
+        return NULL;
+
+    writer = g_new0 (agress_writer, 1);
+    writer->fd = fd;
+    writer->flags = flags;
+    writer->size = WRITE_BLOCK;
+    writer->seekable = (lseek (fd, 0, SEEK_CUR) != -1);
+
+#ifdef HAVE_POSIX_MEMALIGN
+    if (posix_memalign ((void **) &writer->block, WRITE_ALIGN,
+                        writer->size) != 0)
+    {
+        close (fd);
+        g_free (writer);
+        return NULL;
+    }
+#else
+    writer->block = (guint8 *) g_malloc (writer->size);
+#endif
+
+    return writer;
+}
+
+/*
+ * Flushes the staged data and closes the file. Returns FALSE if
+ * any write failed.
+ */
+gboolean
+agress_writer_close (agress_writer *writer)
+{
+    gboolean ok;
+
+    ok = agress_writer_flush (writer);
+
+    if (close (writer->fd) != 0)
+        ok = FALSE;
+
+#ifdef HAVE_POSIX_MEMALIGN
+    free (writer->block);
+#else
+    g_free (writer->block);
+#endif
+    g_free (writer);
+
+    return ok;
+}
+
+static gboolean
+write_all (gint fd, const guint8 *data, gsize size)
+{
+    gssize bytes_written;
+
+    while (size > 0)
+    {
+        bytes_written = write (fd, data, size);
+
+        if (bytes_written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return FALSE;
+        }
+
+        data += bytes_written;
+        size -= bytes_written;
+    }
+
+    return TRUE;
+}
+
+static void
+direct_off (agress_writer *writer)
+{
+#ifdef O_DIRECT
+    gint fl;
+
+    if (!(writer->flags & WRITER_DIRECT))
+        return;
+
+    fl = fcntl (writer->fd, F_GETFL);
+
+    if (fl != -1)
+        fcntl (writer->fd, F_SETFL, fl & ~O_DIRECT);
+#endif
+
+    writer->flags &= ~WRITER_DIRECT;
+}
+
+/*
+ * Writes out everything staged so far. Full blocks keep the file
+ * offset aligned, a partial tail is written with O_DIRECT turned
+ * off since it would be rejected otherwise.
+ */
+gboolean
+agress_writer_flush (agress_writer *writer)
+{
+    if (writer->length == 0)
+        return TRUE;
+
+    if (writer->length % WRITE_ALIGN)
+        direct_off (writer);
+
+    if (!write_all (writer->fd, writer->block, writer->length))
+        return FALSE;
+
+    writer->written += writer->length;
+    writer->length = 0;
+
+    return TRUE;
+}
+
+gboolean
+agress_writer_put (agress_writer *writer, const void *data, gsize size)
+{
+    const guint8 *p = (const guint8 *) data;
+    gsize chunk;
+
+    while (size > 0)
+    {
+        chunk = MIN (size, writer->size - writer->length);
+
+        memcpy (writer->block + writer->length, p, chunk);
+        writer->length += chunk;
+        p += chunk;
+        size -= chunk;
+
+        if ((writer->length == writer->size)
+                && !agress_writer_flush (writer))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Stages the records of one frame, count channels of a 16-bit size
+ * followed by the payload.
+ */
+gboolean
+agress_writer_frame (agress_writer *writer, gint count,
+                     guint8 **data, gint *size)
+{
+    guint16 frame_size;
+    gint c;
+
+    for (c = 0; c < count; c++)
+    {
+        frame_size = size[c];
+
+        if (!agress_writer_put (writer, &frame_size, sizeof (frame_size))
+                || !agress_writer_put (writer, data[c], frame_size))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Writes a tail marker, see agress_reader_tail.
+ */
+gboolean
+agress_writer_tail (agress_writer *writer, gint samples)
+{
+    guint8 marker[TAIL_MARKER] = { 0xff, 0xff, 0xff, 0xff };
+
+    marker[4] = samples & 0xff;
+    marker[5] = samples >> 8;
+
+    return agress_writer_put (writer, marker, sizeof (marker));
+}
+
+gint64
+agress_writer_tell (agress_writer *writer)
+{
+    return writer->written + writer->length;
+}
+
+/*
+ * Overwrites size bytes at offset, used to fill in headers once
+ * the stream length is known.
+ */
+gboolean
+agress_writer_patch (agress_writer *writer, gint64 offset,
+                     const void *data, gsize size)
+{
+    const guint8 *p = (const guint8 *) data;
+    gssize bytes_written;
+
+    if (!agress_writer_flush (writer))
+        return FALSE;
+
+    direct_off (writer);
+
+    while (size > 0)
+    {
+        bytes_written = pwrite (writer->fd, p, size, offset);
+
+        if (bytes_written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return FALSE;
+        }
+
+        p += bytes_written;
+        offset += bytes_written;
+        size -= bytes_written;
+    }
+
+    return TRUE;
+}
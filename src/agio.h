@@ -0,0 +1,115 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifndef __AGIO_H__
+#define __AGIO_H__
+
+#include <agstream.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Input is mapped into memory whenever possible, so frames are
+ * handed out as pointers into the file. Inputs that cannot be
+ * mapped are read in large chunks into a sliding window. The
+ * filename "-" stands for the standard input.
+ */
+typedef struct agress_reader_tag
+{
+    GMappedFile *map;
+    gint fd;
+    guint8 *buffer;         /* mapping or read window */
+    gsize length;           /* valid bytes in buffer */
+    gsize offset;           /* consumed bytes */
+    gsize size;             /* allocated window */
+    gboolean eof;
+} agress_reader;
+
+/*
+ * Format of a wav input, length is the size of the sample data in
+ * bytes or G_MAXUINT64 when it is not known in advance.
+ */
+typedef struct agress_wave_tag
+{
+    gint channels;
+    gint bits;
+    gint freq;
+    guint64 length;
+} agress_wave;
+
+#define WRITER_DIRECT 1     /* bypass the page cache with O_DIRECT */
+
+/* Bytes of a tail marker, and the size it starts with */
+#define TAIL_MARKER   6
+#define TAIL_SIZE     0xffffffff
+
+/*
+ * Output is staged in a large aligned block and written out with
+ * a single write call once the block fills up, so small frame
+ * records do not cost a system call each. The filename "-" stands
+ * for the standard output.
+ */
+typedef struct agress_writer_tag
+{
+    gint fd;
+    gint flags;
+    guint8 *block;
+    gsize length;           /* staged bytes */
+    gsize size;             /* block size */
+    gint64 written;         /* bytes already written to fd */
+    gboolean seekable;      /* FALSE for pipes, headers cannot be patched */
+} agress_writer;
+
+agress_reader *
+agress_reader_open (const gchar *filename);
+void
+agress_reader_close (agress_reader *reader);
+gsize
+agress_reader_fetch (agress_reader *reader, gsize size, guint8 **data);
+gboolean
+agress_reader_skip (agress_reader *reader, guint64 size);
+gint
+agress_reader_frame (agress_reader *reader, gint count,
+                     guint8 **data, gint *size);
+gint
+agress_reader_tail (agress_reader *reader);
+gint
+agress_reader_wave (agress_reader *reader, agress_wave *wave);
+gboolean
+agress_header_read (agress_reader *reader, agress_header *header);
+
+agress_writer *
+agress_writer_open (const gchar *filename, gint flags);
+gboolean
+agress_writer_close (agress_writer *writer);
+gboolean
+agress_writer_put (agress_writer *writer, const void *data, gsize size);
+gboolean
+agress_writer_frame (agress_writer *writer, gint count,
+                     guint8 **data, gint *size);
+gboolean
+agress_writer_tail (agress_writer *writer, gint samples);
+gboolean
+agress_writer_flush (agress_writer *writer);
+gint64
+agress_writer_tell (agress_writer *writer);
+gboolean
+agress_writer_patch (agress_writer *writer, gint64 offset,
+                     const void *data, gsize size);
+
+G_END_DECLS
+
+#endif /* __AGIO_H__ */
@@ -0,0 +1,396 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <agrate.h>
+#include <agstream.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+typedef struct segment_tag
+{
+    gdouble slope;          /* error removed per bit */
+    gint record;
+    gint point;             /* the segment ends at this hull point */
+} segment;
+
+static gint
+payload_size (agress_rate *rate, gint index);
+
+static void
+make_hull (agress_curve *curve, agress_curve *points, gint payload);
+
+static gint
+compare_segments (const void *a, const void *b);
+
+static gint
+allocate (agress_rate *rate, gint first, gint last, gint total,
+          gint least, gdouble *slope);
+
+static void
+cut_window (agress_rate *rate);
+
+/*
+ * Bytes of a record after its layer table.
+ */
+static gint
+payload_size (agress_rate *rate, gint index)
+{
+    gint size, table;
+
+    size = rate->size[index];
+
+    if (!(rate->flags & AG_LAYERS) || (size < 1))
+        return size;
+
+    table = 1 + 2 * rate->record[index][0];
+
+    return MAX (size - table, 0);
+}
+
+/*
+ * Lower convex hull of the points that fit in payload bytes, so the
+ * error removed per bit falls from one segment to the next. A record
+ * cut in the middle of a pass gets one more point at its end, on the
+ * slope of its last pass.
+ */
+static void
+make_hull (agress_curve *curve, agress_curve *points, gint payload)
+{
+    gdouble slope, end_dist;
+    guint32 bits, end;
+    gdouble dist;
+    gint n, i;
+
+    end = (guint32) payload * 8;
+    n = 0;
+
+    for (i = 0; i <= points->count; i++)
+    {
+        if (i < points->count)
+        {
+            bits = points->bits[i];
+            dist = points->dist[i];
+
+            if (bits > end)
+                break;
+        }
+        else
+        {
+            /* Past the last pass that fit */
+            if ((n < 2) || (end < curve->bits[n - 1] + 8))
+                break;
+
+            slope = (curve->dist[n - 2] - curve->dist[n - 1])
+                    / (curve->bits[n - 1] - curve->bits[n - 2]);
+            end_dist = curve->dist[n - 1]
+                       - slope * (end - curve->bits[n - 1]);
+
+            bits = end;
+            dist = MAX (end_dist, 0.0);
+        }
+
+        if ((n > 0) && ((bits <= curve->bits[n - 1])
+                        || (dist >= curve->dist[n - 1])))
+            continue;
+
+        while ((n >= 2)
+                && ((curve->dist[n - 2] - curve->dist[n - 1])
+                    * (bits - curve->bits[n - 1])
+                    <= (curve->dist[n - 1] - dist)
+                    * (curve->bits[n - 1] - curve->bits[n - 2])))
+            n--;
+
+        curve->bits[n] = bits;
+        curve->dist[n] = dist;
+        n++;
+    }
+
+    curve->count = n;
+}
+
+static gint
+compare_segments (const void *a, const void *b)
+{
+    const segment *x = a;
+    const segment *y = b;
+
+    if (x->slope != y->slope)
+        return x->slope > y->slope ? -1 : 1;
+
+    if (x->record != y->record)
+        return x->record - y->record;
+
+    return x->point - y->point;
+}
+
+/*
+ * Gives the records first..last - 1 the payload bytes that remove
+ * the most error for total bytes, the steepest segments of all their
+ * hulls first. A segment that does not fit whole is cut, the error
+ * falls about linearly within it. With slope given, segments flatter
+ * than *slope only get what it takes to spend least bytes, and
+ * *slope is set to the last segment taken. Returns the bytes given.
+ */
+static gint
+allocate (agress_rate *rate, gint first, gint last, gint total,
+          gint least, gdouble *slope)
+{
+    agress_curve *curve;
+    segment *seg;
+    gint64 left, bits;
+    gdouble floor;
+    gboolean flat = FALSE;
+    gint count = 0;
+    gint used = 0;
+    gint r, i;
+
+    seg = g_new (segment, (last - first) * MAX_POINTS);
+    left = (gint64) total * 8;
+    floor = slope != NULL ? *slope : 0.0;
+
+    for (r = first; r < last; r++)
+    {
+        curve = &rate->curve[r];
+        left -= curve->count > 0 ? curve->bits[0] : 8;
+
+        for (i = 1; i < curve->count; i++)
+        {
+            seg[count].slope = (curve->dist[i - 1] - curve->dist[i])
+                               / (curve->bits[i] - curve->bits[i - 1]);
+            seg[count].record = r;
+            seg[count].point = i;
+            count++;
+        }
+    }
+
+    qsort (seg, count, sizeof (segment), compare_segments);
+
+    for (r = first; r < last; r++)
+        rate->cut[r] = rate->curve[r].count > 0 ? rate->curve[r].bits[0] : 8;
+
+    for (i = 0; (i < count) && (left > 0); i++)
+    {
+        if (!flat && (seg[i].slope < floor))
+        {
+            left -= (gint64) (total - least) * 8;
+            flat = TRUE;
+
+            if (left <= 0)
+                break;
+        }
+
+        if (slope != NULL)
+            *slope = seg[i].slope;
+
+        curve = &rate->curve[seg[i].record];
+        bits = curve->bits[seg[i].point] - curve->bits[seg[i].point - 1];
+        bits = MIN (bits, left);
+
+        rate->cut[seg[i].record] += bits;
+        left -= bits;
+    }
+
+    /* Bits to whole bytes of payload */
+    for (r = first; r < last; r++)
+    {
+        rate->cut[r] = CLAMP (rate->cut[r] / 8, 1,
+                              MAX (payload_size (rate, r), 1));
+        used += rate->cut[r];
+    }
+
+    g_free (seg);
+
+    return used;
+}
+
+/*
+ * Shares the window and what the reservoir holds between the held
+ * frames, then walks them in order so no frame takes more than the
+ * reservoir has for it or leaves more than it can keep.
+ */
+static void
+cut_window (agress_rate *rate)
+{
+    gint first, spent, high, low;
+    gint total;
+    gint f, c;
+
+    total = rate->count * rate->budget + rate->fullness;
+
+    allocate (rate, 0, rate->count * rate->coded, total,
+              rate->last ? total : MAX (total - rate->reservoir, 0),
+              &rate->slope);
+
+    for (f = 0; f < rate->count; f++)
+    {
+        first = f * rate->coded;
+        spent = 0;
+
+        for (c = 0; c < rate->coded; c++)
+            spent += rate->cut[first + c];
+
+        high = rate->budget + rate->fullness;
+        low = high - rate->reservoir;
+
+        if ((spent > high) || (spent < low))
+            spent = allocate (rate, first, first + rate->coded,
+                              CLAMP (spent, low, high), 0, NULL);
+
+        rate->fullness = CLAMP (high - spent, 0, rate->reservoir);
+    }
+}
+
+agress_rate *
+agress_rate_new (gint window, gint coded, gint flags, gint budget,
+                 gint reservoir)
+{
+    agress_rate *rate;
+    gint n;
+
+    g_assert (window > 0);
+    g_assert ((coded > 0) && (budget > 0) && (reservoir >= 0));
+
+    n = window * coded;
+
+    rate = g_new0 (agress_rate, 1);
+    rate->window = window;
+    rate->coded = coded;
+    rate->flags = flags;
+    rate->budget = budget;
+    rate->reservoir = reservoir;
+    rate->next = -1;
+
+    rate->record = g_new0 (guint8 *, n);
+    rate->size = g_new0 (gint, n);
+    rate->alloc = g_new0 (gint, n);
+    rate->curve = g_new0 (agress_curve, n);
+    rate->cut = g_new0 (gint, n);
+    rate->out = g_new0 (guint8 *, coded);
+    rate->out_size = g_new0 (gint, coded);
+
+    return rate;
+}
+
+void
+agress_rate_free (agress_rate *rate)
+{
+    gint i;
+
+    for (i = 0; i < rate->window * rate->coded; i++)
+        g_free (rate->record[i]);
+
+    for (i = 0; i < rate->coded; i++)
+        g_free (rate->out[i]);
+
+    g_free (rate->record);
+    g_free (rate->size);
+    g_free (rate->alloc);
+    g_free (rate->curve);
+    g_free (rate->cut);
+    g_free (rate->out);
+    g_free (rate->out_size);
+    g_free (rate);
+}
+
+/*
+ * Holds the records of one frame and their curves. Returns TRUE when
+ * the window is full, its frames are then taken with agress_rate_next.
+ */
+gboolean
+agress_rate_add (agress_rate *rate, guint8 **data, gint *size,
+                 agress_curve *curve)
+{
+    gint c, index;
+
+    g_assert ((rate->count < rate->window) && (rate->next < 0));
+
+    for (c = 0; c < rate->coded; c++)
+    {
+        index = rate->count * rate->coded + c;
+
+        if (rate->alloc[index] < size[c])
+        {
+            rate->record[index] = g_realloc (rate->record[index], size[c]);
+            rate->alloc[index] = size[c];
+        }
+
+        memcpy (rate->record[index], data[c], size[c]);
+        rate->size[index] = size[c];
+
+        make_hull (&rate->curve[index], &curve[c],
+                   payload_size (rate, index));
+    }
+
+    rate->count++;
+
+    return (rate->count == rate->window);
+}
+
+/*
+ * Marks the end of the input: the frames held, however few, are the
+ * last window and may spend all of the reservoir.
+ */
+void
+agress_rate_finish (agress_rate *rate)
+{
+    rate->last = TRUE;
+}
+
+/*
+ * Hands out the held frames in order, cut to their share, the first
+ * call cuts the window. Returns FALSE once no frame is left; data and
+ * size stay valid until the next call.
+ */
+gboolean
+agress_rate_next (agress_rate *rate, guint8 ***data, gint **size)
+{
+    gint c, index;
+
+    if (rate->count == 0)
+        return FALSE;
+
+    if (rate->next < 0)
+    {
+        cut_window (rate);
+        rate->next = 0;
+    }
+
+    for (c = 0; c < rate->coded; c++)
+    {
+        index = rate->next * rate->coded + c;
+
+        rate->out[c] = g_realloc (rate->out[c], MAX (rate->size[index], 1));
+        rate->out_size[c] = agress_record_cut (rate->record[index],
+                                               rate->size[index],
+                                               rate->cut[index],
+                                               rate->flags, rate->out[c]);
+    }
+
+    *data = rate->out;
+    *size = rate->out_size;
+
+    if (++rate->next == rate->count)
+    {
+        rate->count = 0;
+        rate->next = -1;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,73 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifndef __AGRATE_H__
+#define __AGRATE_H__
+
+#include <agress.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Cross-frame rate allocation with a bit reservoir. Records encoded
+ * with room to spare are held for a window of frames together with
+ * their rate-distortion curves, then cut so that the window spends
+ * its bytes where they lower the squared error the most. Bytes that
+ * would buy less than they did in the previous window are saved for
+ * the next one as far as the reservoir can hold them.
+ *
+ * A frame may use its share of budget plus what earlier frames left
+ * in the reservoir, and the reservoir never holds more than reservoir
+ * bytes: sent at a constant budget bytes per frame the stream needs a
+ * decoder buffer of that size, as with the MP3 reservoir.
+ */
+typedef struct agress_rate_tag
+{
+    gint window;            /* frames allocated together */
+    gint coded;             /* records per frame */
+    gint flags;             /* stream flags of the records */
+    gint budget;            /* average payload bytes per frame */
+    gint reservoir;         /* most bytes carried between frames */
+    gint fullness;          /* bytes carried now */
+    gdouble slope;          /* where the last window stopped spending */
+    gboolean last;          /* no more frames, spend the reservoir */
+    gint count;             /* frames held */
+    gint next;              /* next frame handed out, -1 before cutting */
+    guint8 **record;        /* window * coded records */
+    gint *size;
+    gint *alloc;
+    agress_curve *curve;    /* convex hull of every record's points */
+    gint *cut;              /* payload bytes given to every record */
+    guint8 **out;           /* cut records of the frame handed out */
+    gint *out_size;
+} agress_rate;
+
+agress_rate *
+agress_rate_new (gint window, gint coded, gint flags, gint budget,
+                 gint reservoir);
+void
+agress_rate_free (agress_rate *rate);
+gboolean
+agress_rate_add (agress_rate *rate, guint8 **data, gint *size,
+                 agress_curve *curve);
+void
+agress_rate_finish (agress_rate *rate);
+gboolean
+agress_rate_next (agress_rate *rate, guint8 ***data, gint **size);
+
+G_END_DECLS
+
+#endif /* __AGRATE_H__ */
@@ -18,9 +18,11 @@
 #endif
 
 #include <agress.h>
+#include <agstats.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <glib.h>
 
 #define ALPHA   -1.58615986717275
@@ -29,14 +31,73 @@
 #define DELTA    0.44350482244527
 #define EPSILON  1.14960430535816
 
-#define TYPE_S 0
-#define TYPE_A 1
-#define TYPE_B 2
-
 #define MIN_FRAME_SIZE 1
 
+/* Masking model of the perceptual weights, levels in dB */
+#define FULL_SCALE    96.0      /* SPL of a full scale sine */
+#define MASK_OFFSET   12.0      /* of the mask under its masker */
+#define SPREAD_UP     20.0      /* per octave towards higher bands */
+#define SPREAD_DOWN   40.0      /* per octave towards lower ones */
+#define MIN_HEARING   20.0      /* Hz */
+#define HEARING_STEPS 8
+
+/* Lapping scales the difference across an edge up to this */
+#define LAP_GAIN      3.0
+
+#define SILENCE_BYTES 8         /* one guint64 of samples */
+#define SILENCE_BLOCK 64
+
 #define ROUND(x) ((x) < 0.0 ? ((gint) ((x) - 0.5)) : ((gint) ((x) + 0.5)))
 #define SIGN(x) ((x) >= 0 ? 0 : 1)
+#define MAGNITUDE(x) ((x) < 0 ? 0u - (guint32) (x) : (guint32) (x))
+
+/* Set in the bitplane count byte of arithmetic coded frames */
+#define PLANES_ARITH 0x80
+/* Set in the bitplane count byte of frames coded without lists */
+#define PLANES_NLS   0x40
+/* FRAME_USER, 0x20, is left to the caller */
+#define PLANES_MASK  0x1f
+
+/*
+ * State markers of the no-list engine, two bits per coefficient.
+ * MARK_SET: inside a set that has not been split off yet.
+ * MARK_OPEN: child of an insignificant descendant set D(parent),
+ * the set is tested on its own.
+ * MARK_IP, MARK_SP: insignificant and significant pixels.
+ * A node whose children are pixels has its grandchildren set L(node)
+ * still to split while the first grandchild is MARK_SET.
+ */
+#define MARK_SET     0
+#define MARK_IP      1
+#define MARK_SP      2
+#define MARK_OPEN    3
+
+#define MARK_BYTES(length) (((length) + 3) / 4)
+#define MARK_GET(marks, i) (((marks)[(i) >> 2] >> (((i) & 3) * 2)) & 3)
+#define MARK_PUT(marks, i, mark) \
+    ((marks)[(i) >> 2] = ((marks)[(i) >> 2] & ~(3 << (((i) & 3) * 2))) \
+                         | ((mark) << (((i) & 3) * 2)))
+
+/*
+ * Contexts of the arithmetic coder: the kind of decision and the
+ * tree depth of the coefficient or set it is about.
+ */
+#define CTX_PIXEL   0       /* LIP coefficient significance */
+#define CTX_SIGN    1
+#define CTX_SET_A   2       /* LIS entry descendants */
+#define CTX_CHILD   3       /* offspring of a significant set */
+#define CTX_SET_B   4       /* LIS entry grand descendants */
+#define CTX_REFINE  5
+#define CTX_DEPTHS  32
+#define CTX_COUNT   (6 * CTX_DEPTHS)
+
+#define CONTEXT(type, index) ((type) * CTX_DEPTHS + g_bit_storage (index))
+
+#define PROB_BITS   12
+#define PROB_ONE    (1 << PROB_BITS)
+#define PROB_SHIFT  4
+#define RANGE_TOP   (1 << 24)
+#define CODE_BYTES  4
 
 typedef struct bit_stream_tag
 {
@@ -45,8 +106,30 @@ typedef struct bit_stream_tag
     guint8 *last_byte;
     guint8 bits;
     guint8 mask;
+    gboolean arith;         /* binary range coder instead of raw bits */
+    guint64 low;
+    guint32 range;
+    guint32 code;
+    guint8 cache;           /* last byte, held back for a carry */
+    gboolean held;
+    gint64 pending;         /* 0xff bytes held back for a carry */
+    gint64 shifts;          /* bytes shifted out of low or into code */
+    gint64 decisions;
+    guint16 prob[CTX_COUNT];
 } bit_stream;
 
+/*
+ * Largest magnitudes below the nodes of the tree: desc[j] over the
+ * descendants D(j) of 0 < j < length / 2, grand[j] over the grand
+ * descendants L(j) of 0 < j < length / 4. With them every SPIHT
+ * significance test is one load and one compare.
+ */
+typedef struct zeromap_tag
+{
+    guint32 *desc;
+    guint32 *grand;
+} zeromap;
+
 static gint
 power_of_two (gint num);
 
@@ -70,11 +153,46 @@ synthesis_filter (gdouble *signal, gint signal_length);
 
 static void
 fdwt (gdouble *input_signal, gdouble *output_signal,
-      gint signal_length);
+      gint signal_length, gint levels);
 
 static void
 idwt (gdouble *input_signal, gdouble *output_signal,
-      gint signal_length);
+      gint signal_length, gint levels);
+
+static gint *
+block_map (const agress_blocks *blocks, gint signal_length, gint levels);
+
+static void
+fdwt_blocks (gdouble *input_signal, gdouble *output_signal,
+             gint signal_length, gint levels, const agress_blocks *blocks);
+
+static void
+idwt_blocks (gdouble *input_signal, gdouble *output_signal,
+             gint signal_length, gint levels, const agress_blocks *blocks);
+
+static gdouble
+packet_cost (const gdouble *signal, gint signal_length);
+
+static void
+packet_split (gdouble *signal, gint signal_length, agress_basis *basis);
+
+static void
+packet_join (gdouble *signal, gint signal_length,
+             const agress_basis *basis);
+
+static void
+lap_edge (gdouble *tail, gdouble *head, gint lap, gboolean inverse);
+
+static gdouble
+hearing_threshold (gdouble freq);
+
+static void
+perceptual_weights (gdouble *signal, gint signal_length, gint approx,
+                    gdouble full, agress_weights *weights);
+
+static void
+weight_signal (gdouble *signal, gint signal_length, gint approx,
+               const agress_weights *weights, gboolean inverse);
 
 static void
 init_write_bits (bit_stream *stream, gint8 *buffer,
@@ -84,21 +202,42 @@ static void
 init_read_bits (bit_stream *stream, gint8 *buffer,
                 gint buffer_size);
 
+static void
+init_arith (bit_stream *stream, gboolean reading);
+
+static void
+put_byte (bit_stream *stream, guint8 byte);
+
+static guint8
+get_byte (bit_stream *stream);
+
+static void
+shift_low (bit_stream *stream);
+
 static gint
-write_bit (bit_stream *stream, gint bit);
+encode_bit (bit_stream *stream, gint context, gint bit);
 
 static gint
-read_bit (bit_stream *stream, gint *bit);
+decode_bit (bit_stream *stream, gint context, gint *bit);
+
+static gint
+write_bit (bit_stream *stream, gint context, gint bit);
+
+static gint
+read_bit (bit_stream *stream, gint context, gint *bit);
 
 static gint
 flush_bits (bit_stream *stream);
 
+static gint64
+stream_bits (bit_stream *stream, gboolean reading);
+
 static void
-make_zeromap (gint *dwt, gint *map, gint length);
+list_stats (agress_stats *stats, GList *LIP, GList *LSP, GList *LIS,
+            gboolean last);
 
-static gint
-is_significant (gint *dwt, gint *map, gint index,
-                gint type, gint threshold);
+static guint32
+make_zeromap (gint *dwt, zeromap *map, gint length, gint approx);
 
 static gint
 is_type_a (gint index, gint length);
@@ -107,16 +246,16 @@ static gint
 is_type_b (gint index, gint length);
 
 static gint
-initial_threshold (gint *dwt, gint length);
+initial_threshold (guint32 max);
 
 static void
 coeff_init (gint *dwt, gint threshold, gint sign, gint index);
 
 static void
-spiht_init (GList **LIP, GList **LIS, gint length);
+spiht_init (GList **LIP, GList **LIS, gint length, gint approx);
 
 static gint
-significance_encode (gint *dwt, gint *map, gint length, gint threshold,
+significance_encode (gint *dwt, zeromap *map, gint length, gint threshold,
                      GList **LIP, GList **LSP, GList **LIS,
                      bit_stream *stream);
 
@@ -133,13 +272,69 @@ static gint
 refinement_decode (gint *dwt, gint threshold,
                    GList **LSP, bit_stream *stream);
 
+static void
+nls_init (guint8 *marks, gint length, gint approx);
+
+static gint
+nls_pixel_encode (gint *dwt, gint threshold, guint8 *marks,
+                  gint index, gint type, bit_stream *stream);
+
+static gint
+nls_node_encode (gint *dwt, zeromap *map, gint length, gint threshold,
+                 guint8 *marks, gint index, bit_stream *stream);
+
+static gint
+nls_significance_encode (gint *dwt, zeromap *map, gint length,
+                         gint approx, gint threshold, guint8 *marks,
+                         bit_stream *stream);
+
+static gint
+nls_refinement_encode (gint *dwt, gint length, gint threshold,
+                       guint8 *marks, bit_stream *stream);
+
+static gint
+nls_pixel_decode (gint *dwt, gint threshold, guint8 *marks,
+                  gint index, gint type, bit_stream *stream);
+
+static gint
+nls_node_decode (gint *dwt, gint length, gint threshold,
+                 guint8 *marks, gint index, bit_stream *stream);
+
+static gint
+nls_significance_decode (gint *dwt, gint length, gint approx,
+                         gint threshold, guint8 *marks,
+                         bit_stream *stream);
+
+static gint
+nls_refinement_decode (gint *dwt, gint length, gint threshold,
+                       guint8 *marks, bit_stream *stream);
+
+static gdouble
+distortion (gint *dwt, gint length, gint threshold, gboolean refined);
+
+static gboolean
+quality_stop (gdouble target, gdouble *dist, gdouble next,
+              gint64 from, gint64 to, gint64 *stop);
+
+static void
+curve_point (agress_curve *curve, gint64 bits, gdouble dist);
+
 static gint
-spiht_encode (gint *dwt, gint length, guint8 *buffer,
-              gint buffer_size);
+spiht_encode (gint *dwt, gint length, gint approx, guint8 *buffer,
+              gint buffer_size, gint coder, agress_quality *quality,
+              agress_stats *stats, agress_layers *layers,
+              agress_curve *curve);
 
 static void
-spiht_decode (gint *dwt, gint length, guint8 *buffer,
-              gint buffer_size);
+spiht_decode (gint *dwt, gint length, gint approx, guint8 *buffer,
+              gint buffer_size, agress_stats *stats);
+
+static void
+silence_pattern (guint8 *pattern, gint bits, gint endian, gint sign);
+
+static gboolean
+is_silent (const guint8 *buffer, gint size, gint bits, gint endian,
+           gint sign);
 
 static void
 smooth_edge_s8 (gint8 *signal_1, gint8 *signal_2,
@@ -283,19 +478,23 @@ synthesis_filter (gdouble *signal, gint signal_length)
         2.0 * ALPHA * signal[signal_length - 2];
 }
 
+/*
+ * Decomposes levels levels deep, leaving signal_length >> levels
+ * lowpass coefficients in front.
+ */
 static void
 fdwt (gdouble *input_signal, gdouble *output_signal,
-      gint signal_length)
+      gint signal_length, gint levels)
 {
-    gint scale, scales;
+    gint scale;
     gdouble *temp;
 
-    scales = power_of_two (signal_length);
+    g_assert ((levels >= 1) && (levels <= power_of_two (signal_length)));
 
     temp = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
     g_memmove (temp, input_signal, signal_length * sizeof (gdouble));
 
-    for (scale = 0; scale < scales; scale++)
+    for (scale = 0; scale < levels; scale++)
     {
         analysis_filter (temp, signal_length);
         deinterlace (temp, output_signal, signal_length);
@@ -308,18 +507,18 @@ fdwt (gdouble *input_signal, gdouble *output_signal,
 
 static void
 idwt (gdouble *input_signal, gdouble *output_signal,
-      gint signal_length)
+      gint signal_length, gint levels)
 {
-    gint scale, scales;
+    gint scale;
     gdouble *temp;
 
-    scales = power_of_two (signal_length);
+    g_assert ((levels >= 1) && (levels <= power_of_two (signal_length)));
 
     temp = g_malloc (signal_length * sizeof (gdouble));
     g_memmove (temp, input_signal, signal_length * sizeof (gdouble));
-    signal_length = 2;
+    signal_length >>= levels - 1;
 
-    for (scale = 0; scale < scales; scale++)
+    for (scale = 0; scale < levels; scale++)
     {
         interlace (temp, output_signal, signal_length);
         synthesis_filter (output_signal, signal_length);
@@ -330,236 +529,778 @@ idwt (gdouble *input_signal, gdouble *output_signal,
     g_free (temp);
 }
 
-static void
-init_write_bits (bit_stream *stream, gint8 *buffer,
-                 gint buffer_size)
+/*
+ * Places in the frame of the coefficients of its blocks, transformed
+ * one after another. A block of length m at the p-th multiple of m
+ * puts its subband of t coefficients where the frame has its subband
+ * of t * length / m, at the p-th multiple of t: the block takes the
+ * coefficients of the frame that cover the same time, and children of
+ * the coefficient at i stay at 2i and 2i + 1. A block decomposed all
+ * levels deep puts its lowpass coefficients where the frame has its
+ * own, the single lowpass coefficient of a shorter block fills a place
+ * left over, in time order.
+ */
+static gint *
+block_map (const agress_blocks *blocks, gint signal_length, gint levels)
 {
-    stream->first_byte = buffer;
-    stream->next_byte = buffer;
-    stream->last_byte = buffer + buffer_size;
-    stream->bits = 0;
-    stream->mask = 0x80;
-}
+    gint start, length, approx, band, index;
+    gint b, i, slot;
+    gboolean *used;
+    gint *map;
 
-static void
-init_read_bits (bit_stream *stream, gint8 *buffer,
-                gint buffer_size)
-{
-    stream->first_byte = buffer;
-    stream->next_byte = buffer;
-    stream->last_byte = buffer + buffer_size;
-    stream->bits = 0;
-    stream->mask = 0x00;
+    map = (gint *) g_malloc (signal_length * sizeof (gint));
+    used = (gboolean *) g_malloc0 (signal_length * sizeof (gboolean));
+
+    for (start = 0, b = 0; b < blocks->count; b++)
+    {
+        length = 1 << blocks->size[b];
+        approx = length >> MIN (levels, blocks->size[b]);
+
+        for (i = 0; (blocks->size[b] >= levels) && (i < approx); i++)
+        {
+            map[start + i] = (start >> levels) + i;
+            used[(start >> levels) + i] = TRUE;
+        }
+
+        for (i = approx; i < length; i++)
+        {
+            band = 1 << g_bit_nth_msf (i, -1);
+            index = (signal_length / length + start / length) * band
+                    + i - band;
+
+            map[start + i] = index;
+            used[index] = TRUE;
+        }
+
+        start += length;
+    }
+
+    g_assert (start == signal_length);
+
+    for (start = 0, slot = 0, b = 0; b < blocks->count; b++)
+    {
+        if (blocks->size[b] < levels)
+        {
+            while (used[slot])
+                slot++;
+
+            map[start] = slot++;
+        }
+
+        start += 1 << blocks->size[b];
+    }
+
+    g_free (used);
+
+    return map;
 }
 
-static gint
-write_bit (bit_stream *stream, gint bit)
+static void
+fdwt_blocks (gdouble *input_signal, gdouble *output_signal,
+             gint signal_length, gint levels, const agress_blocks *blocks)
 {
-    if (stream->next_byte >= stream->last_byte)
-        return FALSE;
+    gint start, b, i;
+    gdouble *temp;
+    gint *map;
 
-    if (bit)
-        stream->bits |= stream->mask;
+    if ((blocks == NULL) || (blocks->count < 2))
+    {
+        fdwt (input_signal, output_signal, signal_length, levels);
+        return;
+    }
 
-    stream->mask >>= 1;
+    temp = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
 
-    if (!stream->mask)
+    for (start = 0, b = 0; b < blocks->count; b++)
     {
-        *stream->next_byte++ = stream->bits;
-        stream->bits = 0;
-        stream->mask = 0x80;
+        fdwt (input_signal + start, temp + start, 1 << blocks->size[b],
+              MIN (levels, blocks->size[b]));
+        start += 1 << blocks->size[b];
     }
 
-    return TRUE;
+    map = block_map (blocks, signal_length, levels);
+
+    for (i = 0; i < signal_length; i++)
+        output_signal[map[i]] = temp[i];
+
+    g_free (map);
+    g_free (temp);
 }
 
-static gint
-read_bit (bit_stream *stream, gint *bit)
+static void
+idwt_blocks (gdouble *input_signal, gdouble *output_signal,
+             gint signal_length, gint levels, const agress_blocks *blocks)
 {
-    *bit = 0;
+    gint start, b, i;
+    gdouble *temp;
+    gint *map;
 
-    if (!stream->mask)
+    if ((blocks == NULL) || (blocks->count < 2))
     {
-        if (stream->next_byte >= stream->last_byte)
-            return FALSE;
-
-        stream->bits = *stream->next_byte++;
-        stream->mask = 0x80;
+        idwt (input_signal, output_signal, signal_length, levels);
+        return;
     }
 
-    if (stream->bits & stream->mask)
-        *bit = 1;
+    temp = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
+    map = block_map (blocks, signal_length, levels);
 
-    stream->mask >>= 1;
+    for (i = 0; i < signal_length; i++)
+        temp[i] = input_signal[map[i]];
 
-    return TRUE;
+    for (start = 0, b = 0; b < blocks->count; b++)
+    {
+        idwt (temp + start, output_signal + start, 1 << blocks->size[b],
+              MIN (levels, blocks->size[b]));
+        start += 1 << blocks->size[b];
+    }
+
+    g_free (map);
+    g_free (temp);
 }
 
-static gint
-flush_bits (bit_stream *stream)
+/*
+ * Bits the coefficients of a band roughly take: one per bitplane
+ * each of them needs. The best basis is the one that takes the least.
+ */
+static gdouble
+packet_cost (const gdouble *signal, gint signal_length)
 {
-    if (stream->next_byte >= stream->last_byte)
-        return FALSE;
+    gdouble cost = 0.0;
+    gint i;
 
-    if (stream->mask != 0x80)
-        *stream->next_byte++ = stream->bits;
+    for (i = 0; i < signal_length; i++)
+        cost += log2 (1.0 + fabs (signal[i]));
 
-    return TRUE;
+    return cost;
 }
 
+/*
+ * Splits the detail bands of signal, transformed basis->levels levels
+ * deep, that basis->split selects in two once more, bit k for the
+ * band of (signal_length >> levels) << k coefficients. The halves stay
+ * interleaved, lowpass at the even places, so the pair of children of
+ * a coefficient covers the time it does and the trees keep their
+ * shape. With basis->packets the bands are chosen first, each one is
+ * split where its packet_cost goes down.
+ */
 static void
-make_zeromap (gint *dwt, gint *map, gint length)
+packet_split (gdouble *signal, gint signal_length, agress_basis *basis)
 {
-    gint cur_start, cur_length;
-    gint levels;
-    gint i, j;
-
-    levels = power_of_two (length) - 1;
+    gdouble *band;
+    gint size, k;
 
-    for (i = length / 2; i < length; i++)
-        map[i] = ABS (dwt[i]);
+    if (basis->packets)
+        basis->split = 0;
+    else if (basis->split == 0)
+        return;
 
-    cur_start = length / 4;
-    cur_length = length / 2;
+    band = (gdouble *) g_malloc (signal_length / 2 * sizeof (gdouble));
 
-    for (i = 0; i < levels; i++)
+    for (k = 0; k < basis->levels; k++)
     {
-        for (j = cur_start; j < cur_length; j++)
+        size = (signal_length >> basis->levels) << k;
+
+        if (size < 2)
+            continue;
+
+        if (basis->packets)
         {
-            map[j] = MAX (map[2 * j], map[2 * j + 1]);
-            map[j] = MAX (map[j], ABS (dwt[2 * j]));
-            map[j] = MAX (map[j], ABS (dwt[2 * j + 1]));
+            memcpy (band, signal + size, size * sizeof (gdouble));
+            analysis_filter (band, size);
+
+            if (packet_cost (band, size) < packet_cost (signal + size, size))
+                basis->split |= 1 << k;
         }
 
-        cur_start /= 2;
-        cur_length /= 2;
+        if (basis->split & (1 << k))
+            analysis_filter (signal + size, size);
     }
 
-    map[0] = MAX (map[1], ABS (dwt[1]));
+    g_free (band);
 }
 
-static gint
-is_significant (gint *dwt, gint *map, gint index,
-                gint type, gint threshold)
+static void
+packet_join (gdouble *signal, gint signal_length,
+             const agress_basis *basis)
 {
-    switch (type)
-    {
-    case TYPE_S:
-    {
-        if (ABS (dwt[index]) >= threshold)
-            return TRUE;
-        else
-            return FALSE;
-    }
-
-    case TYPE_A:
-    {
-        if (map[index] >= threshold)
-            return TRUE;
-        else
-            return FALSE;
-    }
+    gint size, k;
 
-    case TYPE_B:
+    for (k = 0; k < basis->levels; k++)
     {
-        if (map[2 * index] >= threshold)
-            return TRUE;
-        if (map[2 * index + 1] >= threshold)
-            return TRUE;
-        return FALSE;
-    }
+        size = (signal_length >> basis->levels) << k;
 
-    default:
-        g_assert_not_reached ();
+        if ((size >= 2) && (basis->split & (1 << k)))
+            synthesis_filter (signal + size, size);
     }
 }
 
-static gint
-is_type_a (gint index, gint length)
+/*
+ * Laps the edge between tail, the last lap samples of a frame, and
+ * head, the first lap of the next one. Samples as far from the edge
+ * are butterflied into their mean and difference and the difference
+ * is scaled from 1 up to LAP_GAIN towards the edge. Inverse undoes it,
+ * which scales down the difference of the noise the two frames got:
+ * the edge stays continuous without smoothing it afterwards.
+ */
+static void
+lap_edge (gdouble *tail, gdouble *head, gint lap, gboolean inverse)
 {
-    if (!index)
-        return FALSE;
+    gdouble mean, diff, gain;
+    gint i;
 
-    if (index >= length / 2)
-        return FALSE;
+    for (i = 0; i < lap; i++)
+    {
+        gain = 1.0 + (LAP_GAIN - 1.0) * (lap - i) / lap;
+        mean = (tail[lap - 1 - i] + head[i]) / 2.0;
+        diff = (head[i] - tail[lap - 1 - i]) / 2.0;
+        diff = inverse ? diff / gain : diff * gain;
 
-    return TRUE;
+        tail[lap - 1 - i] = mean - diff;
+        head[i] = mean + diff;
+    }
 }
 
-static gint
-is_type_b (gint index, gint length)
+/*
+ * Threshold of hearing at freq Hz in dB SPL, as approximated by
+ * Terhardt.
+ */
+static gdouble
+hearing_threshold (gdouble freq)
 {
-    if (!index)
-        return FALSE;
-
-    if (index >= length / 4)
-        return FALSE;
+    gdouble khz = freq / 1000.0;
 
-    return TRUE;
+    return 3.64 * pow (khz, -0.8)
+           - 6.5 * exp (-0.6 * (khz - 3.3) * (khz - 3.3))
+           + 1e-3 * khz * khz * khz * khz;
 }
 
-static gint
-initial_threshold (gint *dwt, gint length)
+/*
+ * Weights of signal, a transformed frame of samples up to full with
+ * approx lowpass coefficients. Band 0 holds them and the coarsest
+ * details, band k > 0 the details from approx << k up.
+ * Noise in a band is masked up to MASK_OFFSET below the energy of
+ * the bands around it, spread over it by SPREAD_UP and SPREAD_DOWN
+ * per octave, and inaudible up to the threshold of hearing at its
+ * most sensitive frequency. The band that takes the least noise per
+ * coefficient gets WEIGHT_MAX, one that takes four times as much one
+ * less: the noise only goes halfway from white to the shape of the
+ * mask, at the usual ratios it lies above the mask and following it
+ * all the way starves the loud bands.
+ */
+static void
+perceptual_weights (gdouble *signal, gint signal_length, gint approx,
+                    gdouble full, agress_weights *weights)
 {
-    gint threshold, max = 0;
-    gint i;
+    gdouble energy[MAX_BANDS], noise[MAX_BANDS];
+    gdouble nyquist, low, high, hearing, mask, spread, least;
+    gint bands, start, end, gain;
+    gint i, j, k;
 
-    for (i = 0; i < length; i++)
+    bands = power_of_two (signal_length / approx);
+    nyquist = weights->freq / 2.0;
+
+    g_assert (bands <= MAX_BANDS);
+
+    for (k = 0; k < bands; k++)
     {
-        if (ABS (dwt[i]) > max)
-            max = ABS (dwt[i]);
+        energy[k] = 0.0;
+
+        for (i = k > 0 ? approx << k : 0; i < approx << (k + 1); i++)
+            energy[k] += signal[i] * signal[i];
     }
 
-    if (!max)
-        return 0;
+    least = G_MAXDOUBLE;
 
-    threshold = 1 << g_bit_nth_msf (max, -1);
+    for (k = 0; k < bands; k++)
+    {
+        start = k > 0 ? approx << k : 0;
+        end = approx << (k + 1);
+        low = MAX (nyquist * start / signal_length, MIN_HEARING);
+        high = MAX (nyquist * end / signal_length, MIN_HEARING);
+        hearing = G_MAXDOUBLE;
 
-    return threshold;
-}
+        for (i = 0; i <= HEARING_STEPS; i++)
+            hearing = MIN (hearing, hearing_threshold (
+                               low * pow (high / low,
+                                          (gdouble) i / HEARING_STEPS)));
 
-static void
-coeff_init (gint *dwt, gint threshold, gint sign, gint index)
-{
-    dwt[index] = threshold + threshold / 2;
-    dwt[index] = sign ? -dwt[index] : dwt[index];
-}
+        mask = 0.0;
 
-static void
-spiht_init (GList **LIP, GList **LIS, gint length)
-{
-    *LIP = g_list_append (*LIP, GINT_TO_POINTER (0));
-    *LIP = g_list_append (*LIP, GINT_TO_POINTER (1));
+        for (j = 0; j < bands; j++)
+        {
+            spread = j < k ? (k - j) * SPREAD_UP : (j - k) * SPREAD_DOWN;
+            mask += energy[j] * pow (10.0, -(spread + MASK_OFFSET) / 10.0);
+        }
+
+        /* Power of the noise in the frame, then per coefficient */
+        noise[k] = MAX (mask / signal_length,
+                        full * full / 2.0
+                        * pow (10.0, (hearing - FULL_SCALE) / 10.0));
+        noise[k] *= (gdouble) signal_length / (end - start);
+        least = MIN (least, noise[k]);
+    }
 
-    if (is_type_a (1, length) == TRUE)
-        *LIS = g_list_append (*LIS, GINT_TO_POINTER (1));
+    weights->count = bands;
+
+    for (k = 0; k < bands; k++)
+    {
+        gain = WEIGHT_MAX
+               - (gint) floor (log2 (noise[k] / least) / 2.0 + 0.5);
+        weights->gain[k] = CLAMP (gain, 0, WEIGHT_MAX);
+    }
 }
 
-static gint
-significance_encode (gint *dwt, gint *map, gint length,
-                     gint threshold, GList **LIP, GList **LSP, GList **LIS,
-                     bit_stream *stream)
+/*
+ * Multiplies the bands of signal by their weights, or divides them
+ * by them when inverse.
+ */
+static void
+weight_signal (gdouble *signal, gint signal_length, gint approx,
+               const agress_weights *weights, gboolean inverse)
 {
-    GList *cur, *next;
-    gint index, sign;
-    gint rc;
+    gdouble scale;
+    gint k, i;
 
-    cur = *LIP;
+    g_assert (weights->count == power_of_two (signal_length / approx));
+
+    for (k = 0; k < weights->count; k++)
+    {
+        if (weights->gain[k] == 0)
+            continue;
+
+        scale = pow (2.0, weights->gain[k] / 2.0);
+
+        if (inverse)
+            scale = 1.0 / scale;
+
+        for (i = k > 0 ? approx << k : 0; i < approx << (k + 1); i++)
+            signal[i] *= scale;
+    }
+}
+
+static void
+init_write_bits (bit_stream *stream, gint8 *buffer,
+                 gint buffer_size)
+{
+    stream->first_byte = buffer;
+    stream->next_byte = buffer;
+    stream->last_byte = buffer + buffer_size;
+    stream->bits = 0;
+    stream->mask = 0x80;
+    stream->arith = FALSE;
+}
+
+static void
+init_read_bits (bit_stream *stream, gint8 *buffer,
+                gint buffer_size)
+{
+    stream->first_byte = buffer;
+    stream->next_byte = buffer;
+    stream->last_byte = buffer + buffer_size;
+    stream->bits = 0;
+    stream->mask = 0x00;
+    stream->arith = FALSE;
+}
+
+/*
+ * Switches a stream to the range coder. Each decision is made only
+ * while all the bytes it depends on are within the buffer, so the
+ * coder stops cleanly at any budget and a cut stream decodes the
+ * same decisions up to where it was cut.
+ */
+static void
+init_arith (bit_stream *stream, gboolean reading)
+{
+    gint i;
+
+    stream->arith = TRUE;
+    stream->low = 0;
+    stream->range = 0xffffffff;
+    stream->code = 0;
+    stream->cache = 0;
+    stream->held = FALSE;
+    stream->pending = 0;
+    stream->shifts = 0;
+    stream->decisions = 0;
+
+    for (i = 0; i < CTX_COUNT; i++)
+        stream->prob[i] = PROB_ONE / 2;
+
+    if (reading)
+    {
+        for (i = 0; i < CODE_BYTES; i++)
+            stream->code = (stream->code << 8) | get_byte (stream);
+    }
+}
+
+/*
+ * Bytes past the end of the buffer are dropped when writing and
+ * read as zeros.
+ */
+static void
+put_byte (bit_stream *stream, guint8 byte)
+{
+    if (stream->next_byte < stream->last_byte)
+        *stream->next_byte++ = byte;
+}
+
+static guint8
+get_byte (bit_stream *stream)
+{
+    if (stream->next_byte < stream->last_byte)
+        return *stream->next_byte++;
+
+    return 0;
+}
+
+static void
+shift_low (bit_stream *stream)
+{
+    guint carry;
+
+    if ((stream->low < 0xff000000) || (stream->low > 0xffffffff))
+    {
+        carry = stream->low >> 32;
+
+        if (stream->held)
+            put_byte (stream, stream->cache + carry);
+
+        for (; stream->pending > 0; stream->pending--)
+            put_byte (stream, 0xff + carry);
+
+        stream->cache = (stream->low >> 24) & 0xff;
+        stream->held = TRUE;
+    }
+    else
+        stream->pending++;
+
+    stream->low = (stream->low & 0x00ffffff) << 8;
+    stream->shifts++;
+}
+
+static gint
+encode_bit (bit_stream *stream, gint context, gint bit)
+{
+    guint16 *prob = &stream->prob[context];
+    guint32 bound;
+
+    if (stream->shifts + CODE_BYTES > stream->last_byte - stream->first_byte)
+        return FALSE;
+
+    bound = (stream->range >> PROB_BITS) * *prob;
+    stream->decisions++;
+
+    if (!bit)
+    {
+        stream->range = bound;
+        *prob += (PROB_ONE - *prob) >> PROB_SHIFT;
+    }
+    else
+    {
+        stream->low += bound;
+        stream->range -= bound;
+        *prob -= *prob >> PROB_SHIFT;
+    }
+
+    while (stream->range < RANGE_TOP)
+    {
+        stream->range <<= 8;
+        shift_low (stream);
+    }
+
+    return TRUE;
+}
+
+static gint
+decode_bit (bit_stream *stream, gint context, gint *bit)
+{
+    guint16 *prob = &stream->prob[context];
+    guint32 bound;
+
+    *bit = 0;
+
+    if (stream->shifts + CODE_BYTES > stream->last_byte - stream->first_byte)
+        return FALSE;
+
+    bound = (stream->range >> PROB_BITS) * *prob;
+
+    if (stream->code < bound)
+    {
+        stream->range = bound;
+        *prob += (PROB_ONE - *prob) >> PROB_SHIFT;
+    }
+    else
+    {
+        stream->code -= bound;
+        stream->range -= bound;
+        *prob -= *prob >> PROB_SHIFT;
+        *bit = 1;
+    }
+
+    while (stream->range < RANGE_TOP)
+    {
+        stream->range <<= 8;
+        stream->code = (stream->code << 8) | get_byte (stream);
+        stream->shifts++;
+    }
+
+    return TRUE;
+}
+
+static gint
+write_bit (bit_stream *stream, gint context, gint bit)
+{
+    if (stream->arith)
+        return encode_bit (stream, context, bit);
+
+    if (stream->next_byte >= stream->last_byte)
+        return FALSE;
+
+    if (bit)
+        stream->bits |= stream->mask;
+
+    stream->mask >>= 1;
+
+    if (!stream->mask)
+    {
+        *stream->next_byte++ = stream->bits;
+        stream->bits = 0;
+        stream->mask = 0x80;
+    }
+
+    return TRUE;
+}
+
+static gint
+read_bit (bit_stream *stream, gint context, gint *bit)
+{
+    if (stream->arith)
+        return decode_bit (stream, context, bit);
+
+    *bit = 0;
+
+    if (!stream->mask)
+    {
+        if (stream->next_byte >= stream->last_byte)
+            return FALSE;
+
+        stream->bits = *stream->next_byte++;
+        stream->mask = 0x80;
+    }
+
+    if (stream->bits & stream->mask)
+        *bit = 1;
+
+    stream->mask >>= 1;
+
+    return TRUE;
+}
+
+static gint
+flush_bits (bit_stream *stream)
+{
+    gint i;
+
+    /* Out with the held bytes and all of low, the buffer cuts it */
+    if (stream->arith)
+    {
+        for (i = 0; i < CODE_BYTES + 1; i++)
+            shift_low (stream);
+
+        return TRUE;
+    }
+
+    if (stream->next_byte >= stream->last_byte)
+        return FALSE;
+
+    if (stream->mask != 0x80)
+        *stream->next_byte++ = stream->bits;
+
+    return TRUE;
+}
+
+/*
+ * Bits written or consumed so far.
+ */
+static gint64
+stream_bits (bit_stream *stream, gboolean reading)
+{
+    gint64 bits;
+
+    /* Bytes a decoder needs to repeat the decisions so far */
+    if (stream->arith)
+        return (stream->shifts + CODE_BYTES) * 8;
+
+    bits = (gint64) (stream->next_byte - stream->first_byte) * 8;
+
+    if (reading)
+        return stream->mask ? bits - g_bit_nth_msf (stream->mask, -1) - 1
+               : bits;
+
+    return bits + 7 - g_bit_nth_msf (stream->mask, -1);
+}
+
+/*
+ * Records list sizes after a bitplane, the last call of a frame also
+ * adds them to the per frame sums.
+ */
+static void
+list_stats (agress_stats *stats, GList *LIP, GList *LSP, GList *LIS,
+            gboolean last)
+{
+    guint64 lip, lsp, lis;
+
+    lip = g_list_length (LIP);
+    lsp = g_list_length (LSP);
+    lis = g_list_length (LIS);
+
+    stats->max_lip = MAX (stats->max_lip, lip);
+    stats->max_lsp = MAX (stats->max_lsp, lsp);
+    stats->max_lis = MAX (stats->max_lis, lis);
+
+    if (last)
+    {
+        stats->lip += lip;
+        stats->lsp += lsp;
+        stats->lis += lis;
+    }
+}
+
+/*
+ * Children of the lowest level are read straight from the
+ * coefficients, grand descendants come for free on the levels above,
+ * up to the coarsest details, which follow the approx lowpass
+ * coefficients. The loops are branch free so compilers can vectorize
+ * them. Returns the largest magnitude of the whole frame.
+ */
+static guint32
+make_zeromap (gint *dwt, zeromap *map, gint length, gint approx)
+{
+    guint32 *desc, *grand;
+    guint32 children, below, max;
+    gint start, end;
+    gint j;
+
+    desc = map->desc;
+    grand = map->grand;
+
+    for (j = MAX (length / 4, approx); j < length / 2; j++)
+        desc[j] = MAX (MAGNITUDE (dwt[2 * j]), MAGNITUDE (dwt[2 * j + 1]));
+
+    for (end = length / 4; end > approx; end = start)
+    {
+        start = end / 2;
+
+        for (j = start; j < end; j++)
+        {
+            children = MAX (MAGNITUDE (dwt[2 * j]),
+                            MAGNITUDE (dwt[2 * j + 1]));
+            below = MAX (desc[2 * j], desc[2 * j + 1]);
+            desc[j] = MAX (children, below);
+            grand[j] = below;
+        }
+    }
+
+    max = 0;
+
+    for (j = 0; j < 2 * approx; j++)
+        max = MAX (max, MAGNITUDE (dwt[j]));
+
+    for (j = approx; j < MIN (2 * approx, length / 2); j++)
+        max = MAX (max, desc[j]);
+
+    return max;
+}
+
+/*
+ * Whether the node at index has descendants, or grand descendants
+ * below. Only the coarsest details and the levels below them are
+ * asked, the lowpass coefficients in front have neither.
+ */
+static gint
+is_type_a (gint index, gint length)
+{
+    if (!index)
+        return FALSE;
+
+    if (index >= length / 2)
+        return FALSE;
+
+    return TRUE;
+}
+
+static gint
+is_type_b (gint index, gint length)
+{
+    if (!index)
+        return FALSE;
+
+    if (index >= length / 4)
+        return FALSE;
+
+    return TRUE;
+}
+
+static gint
+initial_threshold (guint32 max)
+{
+    if (!max)
+        return 0;
+
+    return 1 << g_bit_nth_msf (max, -1);
+}
+
+static void
+coeff_init (gint *dwt, gint threshold, gint sign, gint index)
+{
+    dwt[index] = threshold + threshold / 2;
+    dwt[index] = sign ? -dwt[index] : dwt[index];
+}
+
+/*
+ * The approx lowpass coefficients and the coarsest details are the
+ * roots, the details head the trees.
+ */
+static void
+spiht_init (GList **LIP, GList **LIS, gint length, gint approx)
+{
+    gint index;
+
+    for (index = 0; index < 2 * approx; index++)
+        *LIP = g_list_append (*LIP, GINT_TO_POINTER (index));
+
+    for (index = approx; index < 2 * approx; index++)
+    {
+        if (is_type_a (index, length) == TRUE)
+            *LIS = g_list_append (*LIS, GINT_TO_POINTER (index));
+    }
+}
+
+static gint
+significance_encode (gint *dwt, zeromap *map, gint length,
+                     gint threshold, GList **LIP, GList **LSP, GList **LIS,
+                     bit_stream *stream)
+{
+    GList *cur, *next;
+    gint index, sign;
+    gint rc, ctx;
+
+    cur = *LIP;
 
     while (cur != NULL)
     {
         next = g_list_next (cur);
         index = GPOINTER_TO_INT (cur->data);
-        rc = is_significant (dwt, map, index, TYPE_S, threshold);
+        rc = MAGNITUDE (dwt[index]) >= (guint32) threshold;
 
         if (rc == TRUE)
         {
-            if (write_bit (stream, 1) != TRUE)
+            if (write_bit (stream, CONTEXT (CTX_PIXEL, index), 1) != TRUE)
                 return FALSE;
 
             sign = SIGN (dwt[index]);
 
-            if (write_bit (stream, sign) != TRUE)
+            if (write_bit (stream, CONTEXT (CTX_SIGN, index), sign) != TRUE)
                 return FALSE;
 
             *LSP = g_list_append (*LSP, GINT_TO_POINTER (index));
@@ -567,7 +1308,7 @@ significance_encode (gint *dwt, gint *map, gint length,
         }
         else
         {
-            if (write_bit (stream, 0) != TRUE)
+            if (write_bit (stream, CONTEXT (CTX_PIXEL, index), 0) != TRUE)
                 return FALSE;
         }
 
@@ -583,52 +1324,58 @@ significance_encode (gint *dwt, gint *map, gint length,
 
         if (index > 0)
         {
-            rc = is_significant (dwt, map, index, TYPE_A, threshold);
+            rc = map->desc[index] >= (guint32) threshold;
 
             if (rc == TRUE)
             {
-                if (write_bit (stream, 1) != TRUE)
+                if (write_bit (stream, CONTEXT (CTX_SET_A, index), 1) != TRUE)
                     return FALSE;
 
-                rc = is_significant (dwt, map, 2 * index, TYPE_S, threshold);
+                ctx = CONTEXT (CTX_CHILD, 2 * index);
+                rc = MAGNITUDE (dwt[2 * index]) >= (guint32) threshold;
 
                 if (rc == TRUE)
                 {
-                    if (write_bit (stream, 1) != TRUE)
+                    if (write_bit (stream, ctx, 1) != TRUE)
                         return FALSE;
 
                     sign = SIGN (dwt[2 * index]);
 
-                    if (write_bit (stream, sign) != TRUE)
+                    ctx = CONTEXT (CTX_SIGN, 2 * index);
+
+                    if (write_bit (stream, ctx, sign) != TRUE)
                         return FALSE;
 
                     *LSP = g_list_append (*LSP, GINT_TO_POINTER (2 * index));
                 }
                 else
                 {
-                    if (write_bit (stream, 0) != TRUE)
+                    if (write_bit (stream, ctx, 0) != TRUE)
                         return FALSE;
 
                     *LIP = g_list_append (*LIP, GINT_TO_POINTER (2 * index));
                 }
 
-                rc = is_significant (dwt, map, 2 * index + 1, TYPE_S, threshold);
+                ctx = CONTEXT (CTX_CHILD, 2 * index + 1);
+                rc = MAGNITUDE (dwt[2 * index + 1]) >= (guint32) threshold;
 
                 if (rc == TRUE)
                 {
-                    if (write_bit (stream, 1) != TRUE)
+                    if (write_bit (stream, ctx, 1) != TRUE)
                         return FALSE;
 
                     sign = SIGN (dwt[2 * index + 1]);
 
-                    if (write_bit (stream, sign) != TRUE)
+                    ctx = CONTEXT (CTX_SIGN, 2 * index + 1);
+
+                    if (write_bit (stream, ctx, sign) != TRUE)
                         return FALSE;
 
                     *LSP = g_list_append (*LSP, GINT_TO_POINTER (2 * index + 1));
                 }
                 else
                 {
-                    if (write_bit (stream, 0) != TRUE)
+                    if (write_bit (stream, ctx, 0) != TRUE)
                         return FALSE;
 
                     *LIP = g_list_append (*LIP, GINT_TO_POINTER (2 * index + 1));
@@ -647,7 +1394,7 @@ significance_encode (gint *dwt, gint *map, gint length,
             }
             else
             {
-                if (write_bit (stream, 0) != TRUE)
+                if (write_bit (stream, CONTEXT (CTX_SET_A, index), 0) != TRUE)
                     return FALSE;
             }
         }
@@ -655,11 +1402,11 @@ significance_encode (gint *dwt, gint *map, gint length,
         {
             index = ABS (index);
 
-            rc = is_significant (dwt, map, index, TYPE_B, threshold);
+            rc = map->grand[index] >= (guint32) threshold;
 
             if (rc == TRUE)
             {
-                if (write_bit (stream, 1) != TRUE)
+                if (write_bit (stream, CONTEXT (CTX_SET_B, index), 1) != TRUE)
                     return FALSE;
 
                 *LIS = g_list_append (*LIS, GINT_TO_POINTER (2 * index));
@@ -669,7 +1416,7 @@ significance_encode (gint *dwt, gint *map, gint length,
             }
             else
             {
-                if (write_bit (stream, 0) != TRUE)
+                if (write_bit (stream, CONTEXT (CTX_SET_B, index), 0) != TRUE)
                     return FALSE;
             }
         }
@@ -685,7 +1432,7 @@ refinement_encode (gint *dwt, gint threshold,
                    GList **LSP, bit_stream *stream)
 {
     GList *cur;
-    gint bit;
+    gint index, bit;
 
     threshold /= 2;
 
@@ -696,10 +1443,10 @@ refinement_encode (gint *dwt, gint threshold,
 
     while (cur != NULL)
     {
-        bit = ABS (dwt[GPOINTER_TO_INT (cur->data)]);
-        bit = bit & threshold ? 1 : 0;
+        index = GPOINTER_TO_INT (cur->data);
+        bit = ABS (dwt[index]) & threshold ? 1 : 0;
 
-        if (write_bit (stream, bit) != TRUE)
+        if (write_bit (stream, CONTEXT (CTX_REFINE, index), bit) != TRUE)
             return FALSE;
 
         cur = cur->next;
@@ -715,7 +1462,7 @@ significance_decode (gint *dwt, gint length, gint threshold,
 {
     GList *cur, *next;
     gint index, sign;
-    gint bit;
+    gint bit, ctx;
 
     cur = *LIP;
 
@@ -724,12 +1471,12 @@ significance_decode (gint *dwt, gint length, gint threshold,
         next = g_list_next (cur);
         index = GPOINTER_TO_INT (cur->data);
 
-        if (read_bit (stream, &bit) != TRUE)
+        if (read_bit (stream, CONTEXT (CTX_PIXEL, index), &bit) != TRUE)
             return FALSE;
 
         if (bit == 1)
         {
-            if (read_bit (stream, &sign) != TRUE)
+            if (read_bit (stream, CONTEXT (CTX_SIGN, index), &sign) != TRUE)
                 return FALSE;
 
             coeff_init (dwt, threshold, sign, index);
@@ -750,17 +1497,21 @@ significance_decode (gint *dwt, gint length, gint threshold,
 
         if (index > 0)
         {
-            if (read_bit (stream, &bit) != TRUE)
+            if (read_bit (stream, CONTEXT (CTX_SET_A, index), &bit) != TRUE)
                 return FALSE;
 
             if (bit == 1)
             {
-                if (read_bit (stream, &bit) != TRUE)
+                ctx = CONTEXT (CTX_CHILD, 2 * index);
+
+                if (read_bit (stream, ctx, &bit) != TRUE)
                     return FALSE;
 
                 if (bit == 1)
                 {
-                    if (read_bit (stream, &sign) != TRUE)
+                    ctx = CONTEXT (CTX_SIGN, 2 * index);
+
+                    if (read_bit (stream, ctx, &sign) != TRUE)
                         return FALSE;
 
                     coeff_init (dwt, threshold, sign, 2 *index);
@@ -772,12 +1523,16 @@ significance_decode (gint *dwt, gint length, gint threshold,
                     *LIP = g_list_append (*LIP, GINT_TO_POINTER (2 * index));
                 }
 
-                if (read_bit (stream, &bit) != TRUE)
+                ctx = CONTEXT (CTX_CHILD, 2 * index + 1);
+
+                if (read_bit (stream, ctx, &bit) != TRUE)
                     return FALSE;
 
                 if (bit == 1)
                 {
-                    if (read_bit (stream, &sign) != TRUE)
+                    ctx = CONTEXT (CTX_SIGN, 2 * index + 1);
+
+                    if (read_bit (stream, ctx, &sign) != TRUE)
                         return FALSE;
 
                     coeff_init (dwt, threshold, sign, 2 *index + 1);
@@ -805,44 +1560,393 @@ significance_decode (gint *dwt, gint length, gint threshold,
         {
             index = ABS (index);
 
-            if (read_bit (stream, &bit) != TRUE)
-                return FALSE;
+            if (read_bit (stream, CONTEXT (CTX_SET_B, index), &bit) != TRUE)
+                return FALSE;
+
+            if (bit == TRUE)
+            {
+                *LIS = g_list_append (*LIS, GINT_TO_POINTER (2 * index));
+                *LIS = g_list_append (*LIS, GINT_TO_POINTER (2 * index + 1));
+                next = g_list_next (cur);
+                *LIS = g_list_delete_link (*LIS, cur);
+            }
+        }
+
+        cur = next;
+    }
+
+    return TRUE;
+}
+
+static gint
+refinement_decode (gint *dwt, gint threshold,
+                   GList **LSP, bit_stream *stream)
+{
+    GList *cur;
+    gint index, bit, coeff;
+
+    threshold /= 2;
+
+    if (!threshold)
+        return TRUE;
+
+    cur = *LSP;
+
+    while (cur != NULL)
+    {
+        index = GPOINTER_TO_INT (cur->data);
+
+        if (read_bit (stream, CONTEXT (CTX_REFINE, index), &bit) != TRUE)
+            return FALSE;
+
+        coeff = dwt[index];
+
+        if (coeff > 0)
+        {
+            coeff -= (threshold - threshold / 2);
+            if (bit == 1)
+                coeff += threshold;
+        }
+        else
+        {
+            coeff += (threshold - threshold / 2);
+            if (bit == 1)
+                coeff -= threshold;
+        }
+
+        dwt[index] = coeff;
+
+        cur = cur->next;
+    }
+
+    return TRUE;
+}
+
+/*
+ * The no-list engine codes the same set partitions as the lists
+ * above, but keeps the state of every coefficient in a two bit marker
+ * and visits the tree depth-first, so its memory is MARK_BYTES (length)
+ * plus a recursion as deep as the tree, whatever the signal.
+ */
+static void
+nls_init (guint8 *marks, gint length, gint approx)
+{
+    gint index;
+
+    memset (marks, 0, MARK_BYTES (length));
+
+    for (index = 0; index < 2 * approx; index++)
+        MARK_PUT (marks, index, MARK_IP);
+
+    for (index = approx; index < 2 * approx; index++)
+    {
+        if (is_type_a (index, length) == TRUE)
+        {
+            MARK_PUT (marks, 2 * index, MARK_OPEN);
+            MARK_PUT (marks, 2 * index + 1, MARK_OPEN);
+        }
+    }
+}
+
+static gint
+nls_pixel_encode (gint *dwt, gint threshold, guint8 *marks,
+                  gint index, gint type, bit_stream *stream)
+{
+    gint rc, sign;
+
+    rc = MAGNITUDE (dwt[index]) >= (guint32) threshold;
+
+    if (write_bit (stream, CONTEXT (type, index), rc) != TRUE)
+        return FALSE;
+
+    if (rc != TRUE)
+    {
+        MARK_PUT (marks, index, MARK_IP);
+        return TRUE;
+    }
+
+    sign = SIGN (dwt[index]);
+
+    if (write_bit (stream, CONTEXT (CTX_SIGN, index), sign) != TRUE)
+        return FALSE;
+
+    MARK_PUT (marks, index, MARK_SP);
+
+    return TRUE;
+}
+
+static gint
+nls_node_encode (gint *dwt, zeromap *map, gint length, gint threshold,
+                 guint8 *marks, gint index, bit_stream *stream)
+{
+    gint child, mark, rc, i;
+
+    if (is_type_a (index, length) != TRUE)
+        return TRUE;
+
+    child = 2 * index;
+    mark = MARK_GET (marks, child);
+
+    if (mark == MARK_SET)
+        return TRUE;
+
+    if (mark == MARK_OPEN)
+    {
+        rc = map->desc[index] >= (guint32) threshold;
+
+        if (write_bit (stream, CONTEXT (CTX_SET_A, index), rc) != TRUE)
+            return FALSE;
+
+        if (rc != TRUE)
+            return TRUE;
+
+        for (i = child; i < child + 2; i++)
+        {
+            if (nls_pixel_encode (dwt, threshold, marks, i,
+                                  CTX_CHILD, stream) != TRUE)
+                return FALSE;
+        }
+    }
+    else
+    {
+        for (i = child; i < child + 2; i++)
+        {
+            if (MARK_GET (marks, i) != MARK_IP)
+                continue;
+
+            if (nls_pixel_encode (dwt, threshold, marks, i,
+                                  CTX_PIXEL, stream) != TRUE)
+                return FALSE;
+        }
+    }
+
+    if (is_type_b (index, length) != TRUE)
+        return TRUE;
+
+    if (MARK_GET (marks, 2 * child) == MARK_SET)
+    {
+        rc = map->grand[index] >= (guint32) threshold;
+
+        if (write_bit (stream, CONTEXT (CTX_SET_B, index), rc) != TRUE)
+            return FALSE;
+
+        if (rc != TRUE)
+            return TRUE;
+
+        for (i = 2 * child; i < 2 * child + 4; i++)
+            MARK_PUT (marks, i, MARK_OPEN);
+    }
+
+    if (nls_node_encode (dwt, map, length, threshold,
+                         marks, child, stream) != TRUE)
+        return FALSE;
+
+    return nls_node_encode (dwt, map, length, threshold,
+                            marks, child + 1, stream);
+}
+
+static gint
+nls_significance_encode (gint *dwt, zeromap *map, gint length,
+                         gint approx, gint threshold, guint8 *marks,
+                         bit_stream *stream)
+{
+    gint index;
+
+    for (index = 0; index < 2 * approx; index++)
+    {
+        if (MARK_GET (marks, index) != MARK_IP)
+            continue;
+
+        if (nls_pixel_encode (dwt, threshold, marks, index,
+                              CTX_PIXEL, stream) != TRUE)
+            return FALSE;
+    }
+
+    for (index = approx; index < 2 * approx; index++)
+    {
+        if (nls_node_encode (dwt, map, length, threshold,
+                             marks, index, stream) != TRUE)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gint
+nls_refinement_encode (gint *dwt, gint length, gint threshold,
+                       guint8 *marks, bit_stream *stream)
+{
+    gint index, bit;
+
+    threshold /= 2;
+
+    if (!threshold)
+        return TRUE;
+
+    for (index = 0; index < length; index++)
+    {
+        /* Four coefficients still inside their sets */
+        if (!marks[index >> 2])
+        {
+            index |= 3;
+            continue;
+        }
+
+        if (MARK_GET (marks, index) != MARK_SP)
+            continue;
+
+        bit = ABS (dwt[index]) & threshold ? 1 : 0;
+
+        if (write_bit (stream, CONTEXT (CTX_REFINE, index), bit) != TRUE)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gint
+nls_pixel_decode (gint *dwt, gint threshold, guint8 *marks,
+                  gint index, gint type, bit_stream *stream)
+{
+    gint bit, sign;
+
+    if (read_bit (stream, CONTEXT (type, index), &bit) != TRUE)
+        return FALSE;
+
+    if (bit != 1)
+    {
+        MARK_PUT (marks, index, MARK_IP);
+        return TRUE;
+    }
+
+    if (read_bit (stream, CONTEXT (CTX_SIGN, index), &sign) != TRUE)
+        return FALSE;
+
+    coeff_init (dwt, threshold, sign, index);
+    MARK_PUT (marks, index, MARK_SP);
+
+    return TRUE;
+}
+
+static gint
+nls_node_decode (gint *dwt, gint length, gint threshold,
+                 guint8 *marks, gint index, bit_stream *stream)
+{
+    gint child, mark, bit, i;
+
+    if (is_type_a (index, length) != TRUE)
+        return TRUE;
+
+    child = 2 * index;
+    mark = MARK_GET (marks, child);
+
+    if (mark == MARK_SET)
+        return TRUE;
+
+    if (mark == MARK_OPEN)
+    {
+        if (read_bit (stream, CONTEXT (CTX_SET_A, index), &bit) != TRUE)
+            return FALSE;
+
+        if (bit != 1)
+            return TRUE;
+
+        for (i = child; i < child + 2; i++)
+        {
+            if (nls_pixel_decode (dwt, threshold, marks, i,
+                                  CTX_CHILD, stream) != TRUE)
+                return FALSE;
+        }
+    }
+    else
+    {
+        for (i = child; i < child + 2; i++)
+        {
+            if (MARK_GET (marks, i) != MARK_IP)
+                continue;
+
+            if (nls_pixel_decode (dwt, threshold, marks, i,
+                                  CTX_PIXEL, stream) != TRUE)
+                return FALSE;
+        }
+    }
+
+    if (is_type_b (index, length) != TRUE)
+        return TRUE;
 
-            if (bit == TRUE)
-            {
-                *LIS = g_list_append (*LIS, GINT_TO_POINTER (2 * index));
-                *LIS = g_list_append (*LIS, GINT_TO_POINTER (2 * index + 1));
-                next = g_list_next (cur);
-                *LIS = g_list_delete_link (*LIS, cur);
-            }
-        }
+    if (MARK_GET (marks, 2 * child) == MARK_SET)
+    {
+        if (read_bit (stream, CONTEXT (CTX_SET_B, index), &bit) != TRUE)
+            return FALSE;
 
-        cur = next;
+        if (bit != 1)
+            return TRUE;
+
+        for (i = 2 * child; i < 2 * child + 4; i++)
+            MARK_PUT (marks, i, MARK_OPEN);
+    }
+
+    if (nls_node_decode (dwt, length, threshold,
+                         marks, child, stream) != TRUE)
+        return FALSE;
+
+    return nls_node_decode (dwt, length, threshold,
+                            marks, child + 1, stream);
+}
+
+static gint
+nls_significance_decode (gint *dwt, gint length, gint approx,
+                         gint threshold, guint8 *marks,
+                         bit_stream *stream)
+{
+    gint index;
+
+    for (index = 0; index < 2 * approx; index++)
+    {
+        if (MARK_GET (marks, index) != MARK_IP)
+            continue;
+
+        if (nls_pixel_decode (dwt, threshold, marks, index,
+                              CTX_PIXEL, stream) != TRUE)
+            return FALSE;
+    }
+
+    for (index = approx; index < 2 * approx; index++)
+    {
+        if (nls_node_decode (dwt, length, threshold,
+                             marks, index, stream) != TRUE)
+            return FALSE;
     }
 
     return TRUE;
 }
 
 static gint
-refinement_decode (gint *dwt, gint threshold,
-                   GList **LSP, bit_stream *stream)
+nls_refinement_decode (gint *dwt, gint length, gint threshold,
+                       guint8 *marks, bit_stream *stream)
 {
-    GList *cur;
-    gint bit, coeff;
+    gint index, bit, coeff;
 
     threshold /= 2;
 
     if (!threshold)
         return TRUE;
 
-    cur = *LSP;
-
-    while (cur != NULL)
+    for (index = 0; index < length; index++)
     {
-        if (read_bit (stream, &bit) != TRUE)
+        if (!marks[index >> 2])
+        {
+            index |= 3;
+            continue;
+        }
+
+        if (MARK_GET (marks, index) != MARK_SP)
+            continue;
+
+        if (read_bit (stream, CONTEXT (CTX_REFINE, index), &bit) != TRUE)
             return FALSE;
 
-        coeff = dwt[GPOINTER_TO_INT (cur->data)];
+        coeff = dwt[index];
 
         if (coeff > 0)
         {
@@ -857,97 +1961,358 @@ refinement_decode (gint *dwt, gint threshold,
                 coeff -= threshold;
         }
 
-        dwt[GPOINTER_TO_INT (cur->data)] = coeff;
+        dwt[index] = coeff;
+    }
 
-        cur = cur->next;
+    return TRUE;
+}
+
+/*
+ * Squared error the decoder is left with once the significance pass
+ * at threshold, and with refined its refinement pass, is complete.
+ */
+static gdouble
+distortion (gint *dwt, gint length, gint threshold, gboolean refined)
+{
+    guint32 m, step;
+    gdouble error, sum = 0.0;
+    gint i;
+
+    step = refined ? MAX (threshold / 2, 1) : threshold;
+
+    for (i = 0; i < length; i++)
+    {
+        m = MAGNITUDE (dwt[i]);
+
+        if (m >= (guint32) threshold)
+            error = (gdouble) m - ((m & ~(step - 1)) + step / 2);
+        else
+            error = m;
+
+        sum += error * error;
+    }
+
+    return sum;
+}
+
+/*
+ * Called after a pass that took the stream from bit from to bit to
+ * and the distortion from *dist to next. Once the pass gets below
+ * target returns TRUE with *stop the bit where it is expected to, the
+ * error falls about linearly over a pass.
+ */
+static gboolean
+quality_stop (gdouble target, gdouble *dist, gdouble next,
+              gint64 from, gint64 to, gint64 *stop)
+{
+    if ((target <= 0.0) || (next > target))
+    {
+        *dist = next;
+        return FALSE;
     }
 
+    *stop = from + (gint64) ((to - from) * (*dist - target)
+                             / (*dist - next) + 0.999);
+
     return TRUE;
 }
 
+static void
+curve_point (agress_curve *curve, gint64 bits, gdouble dist)
+{
+    if ((curve == NULL) || (curve->count == MAX_POINTS))
+        return;
+
+    curve->bits[curve->count] = bits + 8;
+    curve->dist[curve->count] = dist;
+    curve->count++;
+}
+
 static gint
-spiht_encode (gint *dwt, gint length, guint8 *buffer,
-              gint buffer_size)
+spiht_encode (gint *dwt, gint length, gint approx, guint8 *buffer,
+              gint buffer_size, gint coder, agress_quality *quality,
+              agress_stats *stats, agress_layers *layers,
+              agress_curve *curve)
 {
     GList *LIP, *LSP, *LIS;
     bit_stream stream;
     gint threshold, rc;
-    gint *map;
+    gint size;
+    gboolean cut = FALSE;
+    zeromap map;
+    guint32 max;
+    guint8 *marks = NULL;
+    gboolean counting;
+    agress_stats saved;
+    gint64 start, bits;
+    guint64 planes = 0;
+    gint max_planes = 0;
+    gdouble target = 0.0, dist = 0.0, next;
+    gboolean measure;
+    gint64 stop = -1;
+    gint i;
 
     LIP = LSP = LIS = NULL;
+    counting = (stats != NULL) && agress_stats_enabled ();
+
+    /* A range coded pass may be thrown away, so may its statistics */
+    if (counting)
+        saved = *stats;
+
+    if (layers != NULL)
+        layers->count = 0;
+
+    if (curve != NULL)
+        curve->count = 0;
+
+    if (quality != NULL)
+    {
+        max_planes = quality->max_planes;
+        target = length * quality->noise;
+    }
+
+    measure = (target > 0.0) || (curve != NULL);
+
+    if (measure)
+    {
+        for (i = 0; i < length; i++)
+            dist += (gdouble) dwt[i] * dwt[i];
+
+        curve_point (curve, 0, dist);
+    }
+
+    map.desc = (guint32 *) g_malloc ((length / 2 + length / 4 + 1)
+                                     * sizeof (guint32));
+    map.grand = map.desc + length / 2;
+
+    if (coder & CODER_NLS)
+        marks = (guint8 *) g_malloc (MARK_BYTES (length));
 
-    map = (gint *) g_malloc (length * sizeof (gint));
-    make_zeromap (dwt, map, length);
+    start = agress_stats_clock ();
+    max = make_zeromap (dwt, &map, length, approx);
+    agress_stats_stage (stats, STAGE_ZEROMAP, start);
 
     init_write_bits (&stream, buffer + 1, buffer_size - 1);
 
-    threshold = initial_threshold (dwt, length);
+    threshold = initial_threshold (max);
 
     if (threshold > 0)
         buffer[0] = g_bit_storage (threshold);
     else
         buffer[0] = 0;
 
-    spiht_init (&LIP, &LIS, length);
+    if ((threshold > 0) && (coder & CODER_ARITH))
+    {
+        buffer[0] |= PLANES_ARITH;
+        init_arith (&stream, FALSE);
+    }
+
+    if ((threshold > 0) && (marks != NULL))
+        buffer[0] |= PLANES_NLS;
+
+    if (marks != NULL)
+        nls_init (marks, length, approx);
+    else
+        spiht_init (&LIP, &LIS, length, approx);
 
     while (threshold > 0)
     {
-        rc = significance_encode (dwt, map, length, threshold,
-                                  &LIP, &LSP, &LIS, &stream);
+        if ((max_planes > 0) && (planes == (guint64) max_planes))
+            break;
+
+        planes++;
+        bits = stream_bits (&stream, FALSE);
+        start = agress_stats_clock ();
+
+        if (marks != NULL)
+            rc = nls_significance_encode (dwt, &map, length, approx,
+                                          threshold, marks, &stream);
+        else
+            rc = significance_encode (dwt, &map, length, threshold,
+                                      &LIP, &LSP, &LIS, &stream);
+
+        agress_stats_stage (stats, STAGE_SIGNIFICANCE, start);
+
+        if (counting)
+        {
+            stats->significance_bits += stream_bits (&stream, FALSE) - bits;
+            list_stats (stats, LIP, LSP, LIS, FALSE);
+        }
 
         if (rc != TRUE)
+        {
+            cut = TRUE;
             break;
+        }
+
+        if (measure)
+        {
+            next = distortion (dwt, length, threshold, FALSE);
+            curve_point (curve, stream_bits (&stream, FALSE), next);
+
+            if (quality_stop (target, &dist, next, bits,
+                              stream_bits (&stream, FALSE), &stop))
+                break;
+        }
+
+        bits = stream_bits (&stream, FALSE);
+        start = agress_stats_clock ();
 
-        rc = refinement_encode (dwt, threshold, &LSP, &stream);
+        if (marks != NULL)
+            rc = nls_refinement_encode (dwt, length, threshold,
+                                        marks, &stream);
+        else
+            rc = refinement_encode (dwt, threshold, &LSP, &stream);
+
+        agress_stats_stage (stats, STAGE_REFINEMENT, start);
+
+        if (counting)
+            stats->refinement_bits += stream_bits (&stream, FALSE) - bits;
 
         if (rc != TRUE)
+        {
+            cut = TRUE;
             break;
+        }
+
+        if ((layers != NULL) && (layers->count < MAX_LAYERS))
+            layers->end[layers->count++] = stream_bits (&stream, FALSE) + 8;
+
+        if (measure)
+        {
+            next = distortion (dwt, length, threshold, TRUE);
+            curve_point (curve, stream_bits (&stream, FALSE), next);
+
+            if (quality_stop (target, &dist, next, bits,
+                              stream_bits (&stream, FALSE), &stop))
+                break;
+        }
 
         threshold >>= 1;
     }
 
+    if (counting)
+    {
+        stats->bitplanes += planes;
+        stats->max_bitplanes = MAX (stats->max_bitplanes, planes);
+        list_stats (stats, LIP, LSP, LIS, TRUE);
+    }
+
     flush_bits (&stream);
-    g_free (map);
+    g_free (map.desc);
+    g_free (marks);
 
     g_list_free (LIP);
     g_list_free (LSP);
     g_list_free (LIS);
 
-    return (stream.next_byte - stream.first_byte + 1);
+    /*
+     * The range coder needs a few bytes to settle, with small
+     * budgets raw bits get further into the same decisions.
+     */
+    if (stream.arith && cut && (stream.decisions < (buffer_size - 1) * 8))
+    {
+        if (counting)
+            *stats = saved;
+
+        return spiht_encode (dwt, length, approx, buffer, buffer_size,
+                             coder & ~CODER_ARITH, quality, stats, layers,
+                             curve);
+    }
+
+    size = stream.next_byte - stream.first_byte + 1;
+
+    /* The stream is embedded, a quality reached mid-pass cuts it there */
+    if (stop >= 0)
+        size = MIN (size, 1 + (stop + 7) / 8);
+
+    /* A last byte that did not fit cuts its pass short */
+    if (layers != NULL)
+    {
+        while ((layers->count > 0)
+                && ((layers->end[layers->count - 1] + 7) / 8 > size))
+            layers->count--;
+    }
+
+    return size;
 }
 
 static void
-spiht_decode (gint *dwt, gint length, guint8 *buffer,
-              gint buffer_size)
+spiht_decode (gint *dwt, gint length, gint approx, guint8 *buffer,
+              gint buffer_size, agress_stats *stats)
 {
     GList *LIP, *LSP, *LIS;
     bit_stream stream;
     gint threshold, rc;
     gint bits;
+    guint8 *marks = NULL;
+    gboolean counting;
+    gint64 start, pos;
+    guint64 planes = 0;
 
     LIP = LSP = LIS = NULL;
+    counting = (stats != NULL) && agress_stats_enabled ();
 
     init_read_bits (&stream, buffer + 1, buffer_size - 1);
     memset (dwt, 0, length * sizeof (gint));
 
-    bits = buffer[0];
+    bits = buffer[0] & PLANES_MASK;
+
+    if (buffer[0] & PLANES_ARITH)
+        init_arith (&stream, TRUE);
 
     if (bits > 0)
         threshold = 1 << (bits - 1);
     else
         threshold = 0;
 
-    spiht_init (&LIP, &LIS, length);
+    if (buffer[0] & PLANES_NLS)
+    {
+        marks = (guint8 *) g_malloc (MARK_BYTES (length));
+        nls_init (marks, length, approx);
+    }
+    else
+    {
+        spiht_init (&LIP, &LIS, length, approx);
+    }
 
     while (threshold > 0)
     {
-        rc = significance_decode (dwt, length, threshold,
-                                  &LIP, &LSP, &LIS, &stream);
+        planes++;
+        pos = stream_bits (&stream, TRUE);
+        start = agress_stats_clock ();
+
+        if (marks != NULL)
+            rc = nls_significance_decode (dwt, length, approx,
+                                          threshold, marks, &stream);
+        else
+            rc = significance_decode (dwt, length, threshold,
+                                      &LIP, &LSP, &LIS, &stream);
+
+        agress_stats_stage (stats, STAGE_SIGNIFICANCE, start);
+
+        if (counting)
+        {
+            stats->significance_bits += stream_bits (&stream, TRUE) - pos;
+            list_stats (stats, LIP, LSP, LIS, FALSE);
+        }
 
         if (rc != TRUE)
             break;
 
-        rc = refinement_decode (dwt, threshold, &LSP, &stream);
+        pos = stream_bits (&stream, TRUE);
+        start = agress_stats_clock ();
+
+        if (marks != NULL)
+            rc = nls_refinement_decode (dwt, length, threshold,
+                                        marks, &stream);
+        else
+            rc = refinement_decode (dwt, threshold, &LSP, &stream);
+
+        agress_stats_stage (stats, STAGE_REFINEMENT, start);
+
+        if (counting)
+            stats->refinement_bits += stream_bits (&stream, TRUE) - pos;
 
         if (rc != TRUE)
             break;
@@ -955,6 +2320,14 @@ spiht_decode (gint *dwt, gint length, guint8 *buffer,
         threshold >>= 1;
     }
 
+    if (counting)
+    {
+        stats->bitplanes += planes;
+        stats->max_bitplanes = MAX (stats->max_bitplanes, planes);
+        list_stats (stats, LIP, LSP, LIS, TRUE);
+    }
+
+    g_free (marks);
     g_list_free (LIP);
     g_list_free (LSP);
     g_list_free (LIS);
@@ -970,15 +2343,102 @@ round_signal (gdouble *input_signal, gint *output_signal,
         output_signal[i] = CLAMP (input_signal[i], G_MININT, G_MAXINT);
 }
 
+/*
+ * The bytes of SILENCE_BYTES / sample width zero samples in the given
+ * format. Frame sizes are powers of two, so a frame is a whole number
+ * of patterns or a prefix of one.
+ */
+static void
+silence_pattern (guint8 *pattern, gint bits, gint endian, gint sign)
+{
+    gint i;
+
+    memset (pattern, 0, SILENCE_BYTES);
+
+    if (sign == FMT_S)
+        return;
+
+    if (bits == FMT_8)
+    {
+        for (i = 0; i < SILENCE_BYTES; i++)
+            pattern[i] = 0x80;
+    }
+    else
+    {
+        for (i = (endian == FMT_LE) ? 1 : 0; i < SILENCE_BYTES; i += 2)
+            pattern[i] = 0x80;
+    }
+}
+
+/*
+ * OR of the differences from the silence pattern a word at a time,
+ * checked once per block so a frame with sound stops early.
+ */
+static gboolean
+is_silent (const guint8 *buffer, gint size, gint bits, gint endian,
+           gint sign)
+{
+    guint8 pattern[SILENCE_BYTES];
+    guint64 silence, word, diff = 0;
+    gint i, j;
+
+    silence_pattern (pattern, bits, endian, sign);
+    memcpy (&silence, pattern, sizeof (silence));
+
+    for (i = 0; i + SILENCE_BLOCK <= size; i += SILENCE_BLOCK)
+    {
+        for (j = 0; j < SILENCE_BLOCK; j += SILENCE_BYTES)
+        {
+            memcpy (&word, buffer + i + j, sizeof (word));
+            diff |= word ^ silence;
+        }
+
+        if (diff != 0)
+            return FALSE;
+    }
+
+    for (; i < size; i++)
+        diff |= buffer[i] ^ pattern[i % SILENCE_BYTES];
+
+    return diff == 0;
+}
+
 gint
 encode_frame (void *input_buffer, gint input_size,
               guint8 *output_buffer, gint output_size,
               gint input_bits, gint input_endian,
               gint input_sign)
+{
+    return encode_frame_layers (input_buffer, input_size,
+                                output_buffer, output_size,
+                                input_bits, input_endian,
+                                input_sign, CODER_BITS, NULL, NULL, NULL,
+                                NULL, NULL, NULL);
+}
+
+/*
+ * With a basis the frame is transformed in it, see agress_basis,
+ * without one all levels deep. A lapped frame comes with its lap
+ * samples on either side, input_size counts the frame alone. With
+ * blocks the frame is transformed block by block, see agress_blocks.
+ * With weights its bands are weighted by the masking model, which
+ * fills them in. The decoder has to be given the same basis, blocks
+ * and weights.
+ */
+gint
+encode_frame_layers (void *input_buffer, gint input_size,
+                     guint8 *output_buffer, gint output_size,
+                     gint input_bits, gint input_endian,
+                     gint input_sign, gint coder, agress_basis *basis,
+                     const agress_blocks *blocks, agress_weights *weights,
+                     agress_quality *quality, agress_layers *layers,
+                     agress_curve *curve)
 {
     gdouble *input_signal, *output_signal;
-    gint signal_length, stream_size;
-    gint max_coeff, max_pos;
+    gint signal_length, input_length, stream_size;
+    gint levels, approx, lap;
+    agress_stats stats;
+    gint64 start;
     gint *dwt;
     gint i;
 
@@ -995,26 +2455,68 @@ encode_frame (void *input_buffer, gint input_size,
     else
         g_assert_not_reached ();
 
-    power_of_two (signal_length);
+    levels = power_of_two (signal_length);
 
-    input_signal = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
+    if (basis != NULL)
+        levels = basis->levels;
+
+    approx = signal_length >> levels;
+    lap = basis != NULL ? basis->lap : 0;
+    input_length = signal_length + 2 * lap;
+
+    memset (&stats, 0, sizeof (stats));
+
+    /* Zero coefficients: the bare header byte the full path ends with */
+    if (is_silent (input_buffer, input_size / signal_length * input_length,
+                   input_bits, input_endian, input_sign))
+    {
+        output_buffer[0] = 0;
+
+        if (layers != NULL)
+            layers->count = 0;
+
+        if (weights != NULL)
+        {
+            weights->count = power_of_two (signal_length / approx);
+            memset (weights->gain, 0, sizeof (weights->gain));
+        }
+
+        if ((basis != NULL) && basis->packets)
+            basis->split = 0;
+
+        if (curve != NULL)
+        {
+            curve->count = 0;
+            curve_point (curve, 0, 0.0);
+        }
+
+        stats.frames = 1;
+        stats.silent = 1;
+        agress_stats_merge (&stats);
+
+        return 1;
+    }
+
+    input_signal = (gdouble *) g_malloc (input_length * sizeof (gdouble));
     output_signal = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
     dwt = (gint *) g_malloc (signal_length * sizeof (gint));
 
+    start = agress_stats_clock ();
+
     if (input_bits == FMT_8)
     {
         if (input_sign == FMT_U)
         {
             guint8 *sample = input_buffer;
 
-            for (i = 0; i < signal_length; i++)
+            for (i = 0; i < input_length; i++)
                 input_signal[i] = sample[i] + G_MININT8;
         }
         else if (input_sign == FMT_S)
         {
             gint8 *sample = input_buffer;
 
-            for (i = 0; i < signal_length; i++)
+            for (i = 0; i < input_length; i++)
                 input_signal[i] = sample[i];
         }
         else
@@ -1028,14 +2530,14 @@ encode_frame (void *input_buffer, gint input_size,
             {
                 guint16 *sample = input_buffer;
 
-                for (i = 0; i < signal_length; i++)
+                for (i = 0; i < input_length; i++)
                     input_signal[i] = GUINT16_FROM_LE (sample[i]) + G_MININT16;
             }
             else if (input_endian == FMT_BE)
             {
                 guint16 *sample = input_buffer;
 
-                for (i = 0; i < signal_length; i++)
+                for (i = 0; i < input_length; i++)
                     input_signal[i] = GUINT16_FROM_BE (sample[i]) + G_MININT16;
             }
             else
@@ -1047,14 +2549,14 @@ encode_frame (void *input_buffer, gint input_size,
             {
                 gint16 *sample = input_buffer;
 
-                for (i = 0; i < signal_length; i++)
+                for (i = 0; i < input_length; i++)
                     input_signal[i] = GINT16_FROM_LE (sample[i]);
             }
             else if (input_endian == FMT_BE)
             {
                 gint16 *sample = input_buffer;
 
-                for (i = 0; i < signal_length; i++)
+                for (i = 0; i < input_length; i++)
                     input_signal[i] = GINT16_FROM_BE (sample[i]);
             }
             else
@@ -1066,11 +2568,41 @@ encode_frame (void *input_buffer, gint input_size,
     else
         g_assert_not_reached ();
 
-    fdwt (input_signal, output_signal, signal_length);
+    agress_stats_stage (&stats, STAGE_CONVERT, start);
+    start = agress_stats_clock ();
+
+    if (lap > 0)
+    {
+        lap_edge (input_signal, input_signal + lap, lap, FALSE);
+        lap_edge (input_signal + signal_length,
+                  input_signal + signal_length + lap, lap, FALSE);
+    }
+
+    fdwt_blocks (input_signal + lap, output_signal, signal_length, levels,
+                 blocks);
+
+    if (basis != NULL)
+        packet_split (output_signal, signal_length, basis);
+
+    if (weights != NULL)
+    {
+        perceptual_weights (output_signal, signal_length, approx,
+                            input_bits == FMT_8 ? -G_MININT8 : -G_MININT16,
+                            weights);
+        weight_signal (output_signal, signal_length, approx, weights,
+                       FALSE);
+    }
+
     round_signal (output_signal, dwt, signal_length);
 
+    agress_stats_stage (&stats, STAGE_FDWT, start);
+
     stream_size =
-        spiht_encode (dwt, signal_length, output_buffer, output_size);
+        spiht_encode (dwt, signal_length, approx, output_buffer,
+                      output_size, coder, quality, &stats, layers, curve);
+
+    stats.frames = 1;
+    agress_stats_merge (&stats);
 
     g_free (input_signal);
     g_free (output_signal);
@@ -1084,16 +2616,38 @@ decode_frame (guint8 *input_buffer, gint input_size,
               void *output_buffer, gint output_size,
               gint input_bits, gint output_endian,
               gint output_sign)
+{
+    decode_frame_blocks (input_buffer, input_size,
+                         output_buffer, output_size,
+                         input_bits, output_endian,
+                         output_sign, NULL, NULL, NULL);
+}
+
+/*
+ * Decodes a frame encoded with a basis, blocks and weights, which have
+ * to be the ones it was encoded with. Any of them may be NULL. A
+ * lapped basis carries its edge on to the next frame.
+ */
+void
+decode_frame_blocks (guint8 *input_buffer, gint input_size,
+                     void *output_buffer, gint output_size,
+                     gint input_bits, gint output_endian,
+                     gint output_sign, const agress_basis *basis,
+                     const agress_blocks *blocks,
+                     const agress_weights *weights)
 {
     gdouble *input_signal, *output_signal;
     gint signal_length;
-    gint max_coeff, max_pos;
+    gint levels, approx, lap;
+    gboolean silent;
+    agress_stats stats;
+    gint64 start;
     gint *dwt;
     gint i;
 
     g_assert (input_buffer != NULL);
     g_assert (output_buffer != NULL);
-    g_assert (input_size >= MIN_FRAME_SIZE);
+    g_assert (input_size >= 0);
     g_assert (output_size > 1);
     power_of_two (output_size);
 
@@ -1104,18 +2658,87 @@ decode_frame (guint8 *input_buffer, gint input_size,
     else
         g_assert_not_reached ();
 
-    power_of_two (signal_length);
+    levels = power_of_two (signal_length);
+
+    if (basis != NULL)
+        levels = basis->levels;
+
+    approx = signal_length >> levels;
+    lap = basis != NULL ? basis->lap : 0;
+
+    memset (&stats, 0, sizeof (stats));
+
+    silent = (input_size < MIN_FRAME_SIZE)
+             || ((input_buffer[0] & PLANES_MASK) == 0);
+
+    /* An empty record or no bitplanes: silence, without the transform */
+    if (silent && (lap == 0))
+    {
+        guint8 *sample = output_buffer;
+        guint8 pattern[SILENCE_BYTES];
+
+        start = agress_stats_clock ();
+        silence_pattern (pattern, input_bits, output_endian, output_sign);
+
+        for (i = 0; i < output_size; i++)
+            sample[i] = pattern[i % SILENCE_BYTES];
+
+        agress_stats_stage (&stats, STAGE_CONVERT, start);
+
+        stats.frames = 1;
+        stats.silent = 1;
+        agress_stats_merge (&stats);
+
+        return;
+    }
 
     input_signal = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
     output_signal = (gdouble *) g_malloc (signal_length * sizeof (gdouble));
     dwt = (gint *) g_malloc (signal_length * sizeof (gint));
 
-    spiht_decode (dwt, signal_length, input_buffer, input_size);
+    if (silent)
+    {
+        memset (output_signal, 0, signal_length * sizeof (gdouble));
+        stats.silent = 1;
+        start = agress_stats_clock ();
+    }
+    else
+    {
+        spiht_decode (dwt, signal_length, approx, input_buffer, input_size,
+                      &stats);
+
+        start = agress_stats_clock ();
 
-    for (i = 0; i < signal_length; i++)
-        input_signal[i] = dwt[i];
+        for (i = 0; i < signal_length; i++)
+            input_signal[i] = dwt[i];
+
+        if (weights != NULL)
+            weight_signal (input_signal, signal_length, approx, weights,
+                           TRUE);
 
-    idwt (input_signal, output_signal, signal_length);
+        if (basis != NULL)
+            packet_join (input_signal, signal_length, basis);
+
+        idwt_blocks (input_signal, output_signal, signal_length, levels,
+                     blocks);
+    }
+
+    /* The frame goes out lap samples late, its end waits in the edge */
+    if (lap > 0)
+    {
+        lap_edge (basis->edge, output_signal, lap, TRUE);
+
+        memcpy (input_signal, basis->edge, lap * sizeof (gdouble));
+        memcpy (input_signal + lap, output_signal,
+                (signal_length - lap) * sizeof (gdouble));
+        memcpy (basis->edge, output_signal + signal_length - lap,
+                lap * sizeof (gdouble));
+        memcpy (output_signal, input_signal,
+                signal_length * sizeof (gdouble));
+    }
+
+    agress_stats_stage (&stats, STAGE_IDWT, start);
+    start = agress_stats_clock ();
 
     if (input_bits == FMT_8)
     {
@@ -1202,6 +2825,11 @@ decode_frame (guint8 *input_buffer, gint input_size,
     else
         g_assert_not_reached ();
 
+    agress_stats_stage (&stats, STAGE_CONVERT, start);
+
+    stats.frames = 1;
+    agress_stats_merge (&stats);
+
     g_free (input_signal);
     g_free (output_signal);
     g_free (dwt);
@@ -27,17 +27,135 @@ G_BEGIN_DECLS
 #define FMT_LE          0x00
 #define FMT_BE          0x01
 
+#define CODER_BITS      0x00    /* SPIHT decisions as raw bits */
+#define CODER_ARITH     0x01    /* adaptive binary range coder */
+#define CODER_NLS       0x02    /* no-list SPIHT, may be or-ed in */
+
+/*
+ * Bit of the leading byte of an encoded frame left to the caller:
+ * the encoder keeps it clear and the decoder ignores it.
+ */
+#define FRAME_USER      0x20
+
+#define MAX_LAYERS      32
+#define MAX_POINTS      (1 + 2 * MAX_LAYERS)
+#define MAX_BLOCKS      64
+#define MAX_BANDS       16
+#define WEIGHT_MAX      15
+
+/*
+ * Quality layers of an encoded frame: end[i] is the number of
+ * bits, the leading bitplane count byte included, needed to hold
+ * the significance and refinement passes of the first i + 1
+ * bitplanes. Only passes that fit the output completely are counted.
+ */
+typedef struct agress_layers_tag
+{
+    gint count;
+    guint32 end[MAX_LAYERS];
+} agress_layers;
+
+/*
+ * Where a frame may stop short of its budget: after max_planes
+ * bitplanes, or once the squared error of its coefficients is down
+ * to noise per coefficient. Zero turns either off.
+ */
+typedef struct agress_quality_tag
+{
+    gint max_planes;
+    gdouble noise;
+} agress_quality;
+
+/*
+ * Rate-distortion points of an encoded frame: after bits[i] bits,
+ * counted as in agress_layers, the squared error of its coefficients
+ * is dist[i]. The first point is the header byte alone, then one
+ * follows every significance and every refinement pass that fit.
+ * Within a pass the error falls about linearly.
+ */
+typedef struct agress_curve_tag
+{
+    gint count;
+    guint32 bits[MAX_POINTS];
+    gdouble dist[MAX_POINTS];
+} agress_curve;
+
+/*
+ * Blocks a frame is transformed as one by one, so the error of an
+ * attack stays out of the blocks ahead of it: size[i] is the base two
+ * logarithm of the length of the i-th block in time order. A block
+ * starts at a multiple of its length, together they cover the frame.
+ */
+typedef struct agress_blocks_tag
+{
+    gint count;
+    guint8 size[MAX_BLOCKS];
+} agress_blocks;
+
+/*
+ * Basis a frame is transformed in: levels levels of decomposition,
+ * from 1 to the base two logarithm of its length, leave length >>
+ * levels lowpass coefficients, the roots of the SPIHT trees together
+ * with the coarsest details. Bit k of split splits the detail band of
+ * (length >> levels) << k coefficients in two once more, a wavelet
+ * packet. With packets the encoder picks split by a best basis cost
+ * and fills it in. With lap > 0 both edges of the frame are lapped
+ * into the lap samples beyond them, which the encoder is given on
+ * either side of the frame. The decoder keeps the lapped end of the
+ * previous frame in edge, lap samples, and puts out the frame lap
+ * samples late: edge lapped back, then all but the end of the frame.
+ */
+typedef struct agress_basis_tag
+{
+    gint levels;
+    gboolean packets;
+    guint32 split;
+    gint lap;
+    gdouble *edge;
+} agress_basis;
+
+/*
+ * Perceptual weights of a frame: the coefficients of octave band k,
+ * 0 being the lowpass ones and the coarsest details and k > 0 the
+ * details that follow, are multiplied by 2^(gain[k] / 2) before
+ * coding and divided by it after decoding. Bands where noise is
+ * easier to hear get more of the budget. freq is the sample rate the
+ * encoder's masking model works at, it fills count and gain,
+ * 0..WEIGHT_MAX.
+ */
+typedef struct agress_weights_tag
+{
+    gint freq;
+    gint count;
+    guint8 gain[MAX_BANDS];
+} agress_weights;
+
 gint
 encode_frame (void *input_buffer, gint input_size,
               guint8 *output_buffer, gint output_size,
               gint input_bits, gint input_endian,
               gint input_sign);
+gint
+encode_frame_layers (void *input_buffer, gint input_size,
+                     guint8 *output_buffer, gint output_size,
+                     gint input_bits, gint input_endian,
+                     gint input_sign, gint coder, agress_basis *basis,
+                     const agress_blocks *blocks, agress_weights *weights,
+                     agress_quality *quality, agress_layers *layers,
+                     agress_curve *curve);
 void
 decode_frame (guint8 *input_buffer, gint input_size,
               void *output_buffer, gint output_size,
               gint input_bits, gint output_endian,
               gint output_sign);
 void
+decode_frame_blocks (guint8 *input_buffer, gint input_size,
+                     void *output_buffer, gint output_size,
+                     gint input_bits, gint output_endian,
+                     gint output_sign, const agress_basis *basis,
+                     const agress_blocks *blocks,
+                     const agress_weights *weights);
+void
 smooth_edge (void *signal_1, void *signal_2, gint signal_length,
              gint smooth_factor, gint bits, gint endian, gint sign);
 
@@ -0,0 +1,184 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <agstats.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+static const gchar *stage_names[STAGE_COUNT] =
+{
+    "read", "split", "convert", "fdwt", "zeromap", "significance",
+    "refinement", "idwt", "smooth", "merge", "write"
+};
+
+static gboolean enabled = FALSE;
+static agress_stats total;
+static GMutex lock;
+
+void
+agress_stats_enable (gboolean enable)
+{
+    enabled = enable;
+}
+
+gboolean
+agress_stats_enabled (void)
+{
+    return enabled;
+}
+
+/*
+ * Monotonic time in nanoseconds, or 0 when statistics are off.
+ */
+gint64
+agress_stats_clock (void)
+{
+    struct timespec ts;
+
+    if (!enabled)
+        return 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Charges the time since start to stage. A NULL stats goes straight
+ * to the totals, which is meant for calls made once per frame.
+ */
+void
+agress_stats_stage (agress_stats *stats, gint stage, gint64 start)
+{
+    gint64 elapsed;
+
+    if (!enabled)
+        return;
+
+    elapsed = agress_stats_clock () - start;
+
+    if (stats == NULL)
+    {
+        g_mutex_lock (&lock);
+        total.time[stage] += elapsed;
+        total.calls[stage]++;
+        g_mutex_unlock (&lock);
+    }
+    else
+    {
+        stats->time[stage] += elapsed;
+        stats->calls[stage]++;
+    }
+}
+
+void
+agress_stats_merge (agress_stats *stats)
+{
+    gint s;
+
+    if (!enabled)
+        return;
+
+    g_mutex_lock (&lock);
+
+    for (s = 0; s < STAGE_COUNT; s++)
+    {
+        total.time[s] += stats->time[s];
+        total.calls[s] += stats->calls[s];
+    }
+
+    total.frames += stats->frames;
+    total.silent += stats->silent;
+    total.bitplanes += stats->bitplanes;
+    total.max_bitplanes = MAX (total.max_bitplanes, stats->max_bitplanes);
+    total.significance_bits += stats->significance_bits;
+    total.refinement_bits += stats->refinement_bits;
+    total.lip += stats->lip;
+    total.lsp += stats->lsp;
+    total.lis += stats->lis;
+    total.max_lip = MAX (total.max_lip, stats->max_lip);
+    total.max_lsp = MAX (total.max_lsp, stats->max_lsp);
+    total.max_lis = MAX (total.max_lis, stats->max_lis);
+
+    g_mutex_unlock (&lock);
+}
+
+void
+agress_stats_get (agress_stats *stats)
+{
+    g_mutex_lock (&lock);
+    *stats = total;
+    g_mutex_unlock (&lock);
+}
+
+/*
+ * Prints the totals. Stage times are summed over all threads, wall
+ * is the elapsed time of the whole run in seconds.
+ */
+void
+agress_stats_print (FILE *file, gdouble wall)
+{
+    agress_stats stats;
+    guint64 frames, bits;
+    gdouble busy = 0.0;
+    gint s;
+
+    agress_stats_get (&stats);
+
+    for (s = 0; s < STAGE_COUNT; s++)
+        busy += stats.time[s] / 1e9;
+
+    fprintf (file, "%-14s %10s %12s %7s\n",
+             "stage", "calls", "seconds", "share");
+
+    for (s = 0; s < STAGE_COUNT; s++)
+    {
+        if (stats.calls[s] == 0)
+            continue;
+
+        fprintf (file, "%-14s %10" G_GUINT64_FORMAT " %12.6f %6.1f%%\n",
+                 stage_names[s], stats.calls[s], stats.time[s] / 1e9,
+                 busy > 0.0 ? 100.0 * stats.time[s] / 1e9 / busy : 0.0);
+    }
+
+    fprintf (file, "%-14s %10s %12.6f\n", "total", "", busy);
+    fprintf (file, "%-14s %10s %12.6f\n", "wall", "", wall);
+
+    frames = MAX (stats.frames, 1);
+    bits = MAX (stats.significance_bits + stats.refinement_bits, 1);
+
+    fprintf (file, "\nframes         %" G_GUINT64_FORMAT ", %"
+             G_GUINT64_FORMAT " silent\n", stats.frames, stats.silent);
+    fprintf (file, "bitplanes      %.2f per frame, %" G_GUINT64_FORMAT
+             " max\n", (gdouble) stats.bitplanes / frames,
+             stats.max_bitplanes);
+    fprintf (file, "significance   %" G_GUINT64_FORMAT " bits, %.1f%%\n",
+             stats.significance_bits,
+             100.0 * stats.significance_bits / bits);
+    fprintf (file, "refinement     %" G_GUINT64_FORMAT " bits, %.1f%%\n",
+             stats.refinement_bits, 100.0 * stats.refinement_bits / bits);
+    fprintf (file, "LIP            %.1f per frame, %" G_GUINT64_FORMAT
+             " max\n", (gdouble) stats.lip / frames, stats.max_lip);
+    fprintf (file, "LSP            %.1f per frame, %" G_GUINT64_FORMAT
+             " max\n", (gdouble) stats.lsp / frames, stats.max_lsp);
+    fprintf (file, "LIS            %.1f per frame, %" G_GUINT64_FORMAT
+             " max\n", (gdouble) stats.lis / frames, stats.max_lis);
+}
@@ -0,0 +1,73 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifndef __AGSTATS_H__
+#define __AGSTATS_H__
+
+#include <glib.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+#define STAGE_READ          0
+#define STAGE_SPLIT         1
+#define STAGE_CONVERT       2
+#define STAGE_FDWT          3
+#define STAGE_ZEROMAP       4
+#define STAGE_SIGNIFICANCE  5
+#define STAGE_REFINEMENT    6
+#define STAGE_IDWT          7
+#define STAGE_SMOOTH        8
+#define STAGE_MERGE         9
+#define STAGE_WRITE         10
+#define STAGE_COUNT         11
+
+/*
+ * Counters are kept per frame by the coding thread and merged into
+ * the process totals once the frame is done. Everything is a no-op
+ * until agress_stats_enable is called.
+ */
+typedef struct agress_stats_tag
+{
+    guint64 time[STAGE_COUNT];      /* nanoseconds */
+    guint64 calls[STAGE_COUNT];
+    guint64 frames;                 /* channel frames coded */
+    guint64 silent;                 /* of them digital silence */
+    guint64 bitplanes;              /* summed over frames */
+    guint64 max_bitplanes;
+    guint64 significance_bits;
+    guint64 refinement_bits;
+    guint64 lip, lsp, lis;          /* list sizes at frame end, summed */
+    guint64 max_lip, max_lsp, max_lis;
+} agress_stats;
+
+void
+agress_stats_enable (gboolean enable);
+gboolean
+agress_stats_enabled (void);
+gint64
+agress_stats_clock (void);
+void
+agress_stats_stage (agress_stats *stats, gint stage, gint64 start);
+void
+agress_stats_merge (agress_stats *stats);
+void
+agress_stats_get (agress_stats *stats);
+void
+agress_stats_print (FILE *file, gdouble wall);
+
+G_END_DECLS
+
+#endif /* __AGSTATS_H__ */
@@ -0,0 +1,1663 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <agstream.h>
+#include <agstats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+
+#define MIN_BUDGET 2
+
+/* Least and most of the front pair's budget one channel may get */
+#define MIN_SPLIT  5.0
+#define MAX_SPLIT  95.0
+
+/* Mid/side has to code the pair in half the error energy */
+#define STEREO_GAIN 2.0
+
+/* A block this much louder than the ones before it splits its frame */
+#define ATTACK      10.0
+
+/* Bytes of the largest tree of blocks */
+#define BLOCK_TREE  ((2 * MAX_BLOCKS - 1 + 7) / 8)
+
+/* Bytes of the weights of a frame, a nibble per band */
+#define WEIGHT_BYTES(levels) (((levels) + 1) / 2)
+
+/* Bytes of the split of a basis, a bit per level */
+#define SPLIT_BYTES(levels)  (((levels) + 7) / 8)
+
+/* Samples of either side of an edge that are lapped */
+#define LAP_LENGTH  8
+
+static gint
+get_sample (void *buffer, gint format, gint index);
+
+static void
+set_sample (void *buffer, gint format, gint index, gint value);
+
+static void
+channel_worker (gpointer data, gpointer user_data);
+
+static channel_pool *
+channel_pool_new (channel_func func, gpointer owner, gint threads);
+
+static void
+channel_pool_free (channel_pool *workers);
+
+static void
+channel_pool_run (channel_pool *workers, gint count);
+
+static gint
+put_layers (guint8 *record, agress_layers *layers, gint size);
+
+static void
+split_blocks (agress_blocks *blocks, gboolean *attack, gint first,
+              gint count, gint size);
+
+static void
+choose_blocks (agress_encoder *encoder, gint channel,
+               agress_blocks *blocks);
+
+static gint
+least_block (gint frame);
+
+static void
+put_node (guint8 *out, gint *bit, const agress_blocks *blocks,
+          gint *leaf, gint size, gint least);
+
+static gint
+put_blocks (guint8 *out, const agress_blocks *blocks, gint frame);
+
+static gboolean
+get_node (const guint8 *in, gint bits, gint *bit, agress_blocks *blocks,
+          gint size, gint least);
+
+static gint
+get_blocks (const guint8 *in, gint size, gint frame,
+            agress_blocks *blocks);
+
+static void
+put_weights (guint8 *out, const agress_weights *weights);
+
+static void
+get_weights (const guint8 *in, gint levels, agress_weights *weights);
+
+static gint
+stream_levels (gint flags, gint frame);
+
+static gint
+stream_lap (gint flags, gint frame);
+
+static void *
+coded_plane (agress_encoder *encoder, gint channel);
+
+static void
+encode_channel (gpointer owner, gint channel);
+
+static void
+decode_channel (gpointer owner, gint channel);
+
+static void
+choose_stereo (agress_encoder *encoder, void *pcm);
+
+static void
+split_frame (agress_encoder *encoder, void *pcm);
+
+static void *
+lap_window (agress_encoder *encoder, void *pcm);
+
+static gboolean
+frame_lr (agress_decoder *decoder, guint8 *record, gint size);
+
+static gint
+payload_start (agress_decoder *decoder, guint8 *record, gint size,
+               agress_blocks *blocks, agress_weights *weights,
+               agress_basis *basis);
+
+static void
+smooth_channel (agress_decoder *decoder, gint channel);
+
+static void
+mid_side_to_lr (agress_decoder *decoder, void **plane);
+
+static void
+merge_frame (agress_decoder *decoder, void **plane, gboolean lr);
+
+static void
+lap_stereo (agress_decoder *decoder);
+
+static gint
+tail_size (agress_decoder *decoder);
+
+static gint
+get_sample (void *buffer, gint format, gint index)
+{
+    if (format == FMT_8)
+        return ((guint8 *) buffer)[index];
+    else if (format == FMT_16)
+        return GINT16_FROM_LE (((gint16 *) buffer)[index]);
+    else
+        g_assert_not_reached ();
+}
+
+static void
+set_sample (void *buffer, gint format, gint index, gint value)
+{
+    if (format == FMT_8)
+    {
+        ((guint8 *) buffer)[index] = CLAMP (value, 0, G_MAXUINT8);
+    }
+    else if (format == FMT_16)
+    {
+        value = CLAMP (value, G_MININT16, G_MAXINT16);
+        ((gint16 *) buffer)[index] = GINT16_TO_LE (value);
+    }
+    else
+        g_assert_not_reached ();
+}
+
+static void
+channel_worker (gpointer data, gpointer user_data)
+{
+    channel_pool *workers = user_data;
+
+    workers->func (workers->owner, GPOINTER_TO_INT (data) - 1);
+
+    g_mutex_lock (&workers->lock);
+
+    if (--workers->pending == 0)
+        g_cond_signal (&workers->done);
+
+    g_mutex_unlock (&workers->lock);
+}
+
+static channel_pool *
+channel_pool_new (channel_func func, gpointer owner, gint threads)
+{
+    channel_pool *workers;
+
+    workers = g_new0 (channel_pool, 1);
+    workers->func = func;
+    workers->owner = owner;
+
+    if (threads > 1)
+    {
+        g_mutex_init (&workers->lock);
+        g_cond_init (&workers->done);
+        workers->pool = g_thread_pool_new (channel_worker, workers,
+                                           threads, TRUE, NULL);
+    }
+
+    return workers;
+}
+
+static void
+channel_pool_free (channel_pool *workers)
+{
+    if (workers->pool != NULL)
+    {
+        g_thread_pool_free (workers->pool, FALSE, TRUE);
+        g_mutex_clear (&workers->lock);
+        g_cond_clear (&workers->done);
+    }
+
+    g_free (workers);
+}
+
+static void
+channel_pool_run (channel_pool *workers, gint count)
+{
+    gint channel;
+
+    if ((workers->pool == NULL) || (count < 2))
+    {
+        for (channel = 0; channel < count; channel++)
+            workers->func (workers->owner, channel);
+
+        return;
+    }
+
+    workers->pending = count;
+
+    for (channel = 0; channel < count; channel++)
+        g_thread_pool_push (workers->pool, GINT_TO_POINTER (channel + 1), NULL);
+
+    g_mutex_lock (&workers->lock);
+
+    while (workers->pending > 0)
+        g_cond_wait (&workers->done, &workers->lock);
+
+    g_mutex_unlock (&workers->lock);
+}
+
+void
+agress_header_init (agress_header *header, gint freq, gint frame,
+                    gint bits, gint channels, gint mode)
+{
+    header->magic = AG_MAGIC;
+    header->freq = freq;
+    header->frame = frame;
+    header->bits = bits;
+    header->more = 0;
+
+    if ((channels == 1) || (mode == MODE_MONO))
+        header->channels = MODE_MONO;
+    else if (channels == 2)
+        header->channels = mode;
+    else if (mode == MODE_JSTEREO)
+        header->channels = MODE_MULTI | MODE_JOINT | channels;
+    else
+        header->channels = MODE_MULTI | channels;
+}
+
+gboolean
+agress_header_parse (agress_header *header, gint *channels,
+                     gint *coded, gint *mode)
+{
+    gint count, joint;
+
+    if ((header->magic != AG_MAGIC) && (header->magic != AG_MAGIC_MORE))
+        return FALSE;
+
+    if ((header->magic == AG_MAGIC_MORE)
+            && (header->more & ~((AG_WEIGHTS | AG_PACKETS | AG_LAPPED
+                                  | AG_TAIL | AG_LEVELS) >> 8)))
+        return FALSE;
+
+    if (header->bits & ~(AG_BITS | AG_LAYERS | AG_GROUPS | AG_ARITH
+                         | AG_NLS | AG_STEREO | AG_BLOCKS))
+        return FALSE;
+
+    if ((header->bits & AG_GROUPS) && !(header->bits & AG_LAYERS))
+        return FALSE;
+
+    if (((header->bits & AG_BITS) != 8) && ((header->bits & AG_BITS) != 16))
+        return FALSE;
+
+    if ((header->frame < 2)
+            || (g_bit_nth_msf (header->frame, -1)
+                != g_bit_nth_lsf (header->frame, -1)))
+        return FALSE;
+
+    if ((header->magic == AG_MAGIC_MORE)
+            && ((header->more << 8 & AG_LEVELS) >> LEVELS_SHIFT
+                > g_bit_nth_msf (header->frame, -1)))
+        return FALSE;
+
+    if (header->channels & MODE_MULTI)
+    {
+        count = header->channels & MODE_COUNT;
+        joint = header->channels & MODE_JOINT;
+
+        if (count < 1)
+            return FALSE;
+
+        if (joint && (count < 2))
+            return FALSE;
+
+        *mode = joint ? MODE_JSTEREO : MODE_STEREO;
+    }
+    else
+    {
+        switch (header->channels)
+        {
+        case MODE_MONO:
+            count = 1;
+            break;
+
+        case MODE_STEREO:
+        case MODE_JSTEREO:
+            count = 2;
+            break;
+
+        default:
+            return FALSE;
+        }
+
+        *mode = header->channels;
+    }
+
+    if ((header->bits & AG_STEREO) && (*mode != MODE_JSTEREO))
+        return FALSE;
+
+    *channels = count;
+    *coded = count;
+
+    return TRUE;
+}
+
+/*
+ * Bytes header takes in a stream, the more field only follows
+ * AG_MAGIC_MORE.
+ */
+gint
+agress_header_size (const agress_header *header)
+{
+    return header->magic == AG_MAGIC_MORE ? sizeof (*header) : AG_HEADER;
+}
+
+/*
+ * Record size holding the table and the first layers layers of
+ * a record with a layer table.
+ */
+gint
+agress_layers_size (const guint8 *record, gint size, gint layers)
+{
+    gint count, table;
+    guint16 end;
+
+    if (size < 1)
+        return size;
+
+    count = record[0];
+    table = 1 + 2 * count;
+
+    if ((layers < 1) || (layers > count) || (table > size))
+        return size;
+
+    memcpy (&end, record + 1 + 2 * (layers - 1), sizeof (end));
+
+    return MIN (table + GUINT16_FROM_LE (end), size);
+}
+
+/*
+ * Copies record, as written with flags, to out cut to a payload of
+ * at most budget bytes, the layers that no longer fit are dropped
+ * from its table. The payload is embedded, so this is the record an
+ * encoder with that budget would have written, for raw bits byte for
+ * byte. Returns the size of the cut record.
+ */
+gint
+agress_record_cut (const guint8 *record, gint size, gint budget,
+                   gint flags, guint8 *out)
+{
+    gint count, table, keep;
+    guint16 end;
+
+    if (!(flags & AG_LAYERS) || (size < 1))
+    {
+        size = MIN (size, budget);
+        memcpy (out, record, size);
+        return size;
+    }
+
+    count = record[0];
+    table = 1 + 2 * count;
+
+    if (table > size)
+    {
+        memcpy (out, record, size);
+        return size;
+    }
+
+    size = MIN (size - table, budget);
+
+    for (keep = 0; keep < count; keep++)
+    {
+        memcpy (&end, record + 1 + 2 * keep, sizeof (end));
+
+        if (GUINT16_FROM_LE (end) > size)
+            break;
+    }
+
+    out[0] = keep;
+    memcpy (out + 1, record + 1, 2 * keep);
+    memcpy (out + 1 + 2 * keep, record + table, size);
+
+    return 1 + 2 * keep + size;
+}
+
+/*
+ * The payload was encoded at record + LAYER_TABLE, moves it right
+ * behind the table actually needed. Returns the record size.
+ */
+static gint
+put_layers (guint8 *record, agress_layers *layers, gint size)
+{
+    guint16 end;
+    gint i;
+
+    record[0] = layers->count;
+
+    for (i = 0; i < layers->count; i++)
+    {
+        end = GUINT16_TO_LE ((layers->end[i] + 7) / 8);
+        memcpy (record + 1 + 2 * i, &end, sizeof (end));
+    }
+
+    memmove (record + 1 + 2 * layers->count, record + LAYER_TABLE, size);
+
+    return 1 + 2 * layers->count + size;
+}
+
+/*
+ * Halves the count shortest blocks from first on, 2^size samples,
+ * until no attack is left inside a block but only at its start.
+ */
+static void
+split_blocks (agress_blocks *blocks, gboolean *attack, gint first,
+              gint count, gint size)
+{
+    gint i;
+
+    for (i = 1; i < count; i++)
+    {
+        if (attack[first + i])
+        {
+            split_blocks (blocks, attack, first, count / 2, size - 1);
+            split_blocks (blocks, attack, first + count / 2, count / 2,
+                          size - 1);
+            return;
+        }
+    }
+
+    blocks->size[blocks->count++] = size;
+}
+
+/*
+ * Blocks to transform a channel of the frame as. An attack is a block
+ * of encoder->block samples whose high-passed energy is ATTACK times
+ * the mean of those before it in the frame. The error of a transform
+ * spreads over all of its length, so every attack is made to start a
+ * block and the blocks ahead of it stay as long as they can.
+ */
+static void
+choose_blocks (agress_encoder *encoder, gint channel,
+               agress_blocks *blocks)
+{
+    gboolean attack[MAX_BLOCKS];
+    gdouble energy, before = 0.0;
+    gint count, length, last, x;
+    gint b, i;
+
+    length = encoder->block;
+    count = encoder->frame / length;
+    last = get_sample (coded_plane (encoder, channel), encoder->format, 0);
+
+    for (b = 0; b < count; b++)
+    {
+        energy = 0.0;
+
+        for (i = b * length; i < (b + 1) * length; i++)
+        {
+            x = get_sample (coded_plane (encoder, channel), encoder->format,
+                            i);
+            energy += (gdouble) (x - last) * (x - last);
+            last = x;
+        }
+
+        /* A sample of energy keeps near silence from triggering */
+        attack[b] = (b > 0) && (energy > ATTACK * (before / b + length));
+        before += energy;
+    }
+
+    blocks->count = 0;
+    split_blocks (blocks, attack, 0, count,
+                  g_bit_nth_msf (encoder->frame, -1));
+}
+
+/*
+ * Blocks of a frame are the leaves of a binary tree, stored as one
+ * bit per node in preorder, set where the node is halved, padded to
+ * whole bytes. Nodes this short or shorter are leaves without a bit,
+ * which keeps a frame to MAX_BLOCKS blocks.
+ */
+static gint
+least_block (gint frame)
+{
+    return MAX (1, g_bit_nth_msf (frame, -1)
+                - g_bit_nth_msf (MAX_BLOCKS, -1));
+}
+
+static void
+put_node (guint8 *out, gint *bit, const agress_blocks *blocks,
+          gint *leaf, gint size, gint least)
+{
+    gboolean split;
+
+    if (size <= least)
+    {
+        (*leaf)++;
+        return;
+    }
+
+    split = blocks->size[*leaf] < size;
+
+    if (*bit % 8 == 0)
+        out[*bit / 8] = 0;
+
+    if (split)
+        out[*bit / 8] |= 0x80 >> (*bit % 8);
+
+    (*bit)++;
+
+    if (split)
+    {
+        put_node (out, bit, blocks, leaf, size - 1, least);
+        put_node (out, bit, blocks, leaf, size - 1, least);
+    }
+    else
+    {
+        (*leaf)++;
+    }
+}
+
+/*
+ * Writes the tree of blocks to out, returns its size in bytes.
+ */
+static gint
+put_blocks (guint8 *out, const agress_blocks *blocks, gint frame)
+{
+    gint bit = 0, leaf = 0;
+
+    put_node (out, &bit, blocks, &leaf, g_bit_nth_msf (frame, -1),
+              least_block (frame));
+
+    return (bit + 7) / 8;
+}
+
+static gboolean
+get_node (const guint8 *in, gint bits, gint *bit, agress_blocks *blocks,
+          gint size, gint least)
+{
+    gboolean split;
+
+    if (size > least)
+    {
+        if (*bit >= bits)
+            return FALSE;
+
+        split = (in[*bit / 8] & (0x80 >> (*bit % 8))) != 0;
+        (*bit)++;
+
+        if (split)
+            return get_node (in, bits, bit, blocks, size - 1, least)
+                   && get_node (in, bits, bit, blocks, size - 1, least);
+    }
+
+    blocks->size[blocks->count++] = size;
+
+    return TRUE;
+}
+
+/*
+ * Reads the tree of blocks of a frame from the first size bytes of in.
+ * Returns the bytes it takes, -1 when they were cut off.
+ */
+static gint
+get_blocks (const guint8 *in, gint size, gint frame,
+            agress_blocks *blocks)
+{
+    gint bit = 0;
+
+    blocks->count = 0;
+
+    if (!get_node (in, size * 8, &bit, blocks, g_bit_nth_msf (frame, -1),
+                   least_block (frame)))
+        return -1;
+
+    return (bit + 7) / 8;
+}
+
+static void
+put_weights (guint8 *out, const agress_weights *weights)
+{
+    gint k;
+
+    memset (out, 0, (weights->count + 1) / 2);
+
+    for (k = 0; k < weights->count; k++)
+        out[k / 2] |= weights->gain[k] << (4 * (k % 2));
+}
+
+static void
+get_weights (const guint8 *in, gint levels, agress_weights *weights)
+{
+    gint k;
+
+    weights->count = levels;
+
+    for (k = 0; k < weights->count; k++)
+        weights->gain[k] = (in[k / 2] >> (4 * (k % 2))) & WEIGHT_MAX;
+}
+
+/*
+ * Levels of the decomposition of frames of a stream with flags.
+ */
+static gint
+stream_levels (gint flags, gint frame)
+{
+    gint levels;
+
+    levels = (flags & AG_LEVELS) >> LEVELS_SHIFT;
+
+    return levels > 0 ? levels : g_bit_nth_msf (frame, -1);
+}
+
+/*
+ * Samples lapped over either side of an edge of frames of a stream
+ * with flags, no more than half a frame.
+ */
+static gint
+stream_lap (gint flags, gint frame)
+{
+    return flags & AG_LAPPED ? MIN (LAP_LENGTH, frame / 2) : 0;
+}
+
+/*
+ * Samples of channel the frame is coded from, past the lap before it.
+ */
+static void *
+coded_plane (agress_encoder *encoder, gint channel)
+{
+    return (guint8 *) encoder->plane[channel]
+           + encoder->lap * encoder->width;
+}
+
+static void
+encode_channel (gpointer owner, gint channel)
+{
+    agress_encoder *encoder = owner;
+    agress_layers layers;
+    agress_curve *curve;
+    agress_blocks blocks;
+    agress_weights weights;
+    agress_basis basis;
+    guint8 tree[BLOCK_TREE];
+    guint8 *payload, *weight = NULL, *split = NULL;
+    gint sign, size, coder;
+    gint budget, head, i;
+
+    sign = encoder->format == FMT_8 ? FMT_U : FMT_S;
+    coder = encoder->flags & AG_ARITH ? CODER_ARITH : CODER_BITS;
+
+    if (encoder->flags & AG_NLS)
+        coder |= CODER_NLS;
+
+    curve = encoder->measure ? &encoder->curve[channel] : NULL;
+    payload = encoder->data[channel];
+
+    if (encoder->flags & AG_LAYERS)
+        payload += LAYER_TABLE;
+
+    budget = encoder->budget[channel];
+    head = 0;
+
+    basis.levels = encoder->levels;
+    basis.packets = (encoder->flags & AG_PACKETS) != 0;
+    basis.split = 0;
+    basis.lap = encoder->lap;
+    basis.edge = NULL;
+
+    if (encoder->flags & AG_WEIGHTS)
+        budget -= WEIGHT_BYTES (encoder->levels);
+
+    if (encoder->flags & AG_PACKETS)
+        budget -= SPLIT_BYTES (encoder->levels);
+
+    if (encoder->flags & AG_BLOCKS)
+    {
+        choose_blocks (encoder, channel, &blocks);
+        head = put_blocks (tree, &blocks, encoder->frame);
+
+        /* A small budget goes to the frame rather than the tree */
+        if (head >= budget)
+        {
+            blocks.count = 1;
+            blocks.size[0] = g_bit_nth_msf (encoder->frame, -1);
+            head = put_blocks (tree, &blocks, encoder->frame);
+        }
+
+        memcpy (payload, tree, head);
+        payload += head;
+        budget -= head;
+    }
+
+    /* Filled in once the frame is coded */
+    if (encoder->flags & AG_WEIGHTS)
+    {
+        weights.freq = encoder->header.freq;
+        weight = payload;
+        payload += WEIGHT_BYTES (encoder->levels);
+        head += WEIGHT_BYTES (encoder->levels);
+    }
+
+    if (encoder->flags & AG_PACKETS)
+    {
+        split = payload;
+        payload += SPLIT_BYTES (encoder->levels);
+        head += SPLIT_BYTES (encoder->levels);
+    }
+
+    size = encode_frame_layers (encoder->plane[channel],
+                                encoder->frame * encoder->width,
+                                payload, budget,
+                                encoder->format, FMT_LE, sign, coder,
+                                &basis,
+                                encoder->flags & AG_BLOCKS ? &blocks : NULL,
+                                weight != NULL ? &weights : NULL,
+                                &encoder->quality,
+                                encoder->flags & AG_LAYERS ? &layers : NULL,
+                                curve);
+
+    if ((channel == 0) && encoder->lr)
+        payload[0] |= FRAME_USER;
+
+    if (weight != NULL)
+        put_weights (weight, &weights);
+
+    for (i = 0; (split != NULL) && (i < SPLIT_BYTES (encoder->levels)); i++)
+        split[i] = basis.split >> (8 * i);
+
+    /* Layers and points count from the tree of blocks and weights */
+    if (head > 0)
+    {
+        size += head;
+
+        for (i = 0; (encoder->flags & AG_LAYERS) && (i < layers.count); i++)
+            layers.end[i] += 8 * head;
+
+        for (i = 0; (curve != NULL) && (i < curve->count); i++)
+            curve->bits[i] += 8 * head;
+    }
+
+    if (encoder->flags & AG_LAYERS)
+        size = put_layers (encoder->data[channel], &layers, size);
+
+    encoder->size[channel] = size;
+}
+
+/*
+ * Picks left/right or mid/side for the front pair of a frame and
+ * splits the pair's budget. With M = (L + R) / 2 and S = (L - R) / 2
+ * coding M and S gains over L and R as E(L) E(R) over 4 E(M) E(S);
+ * mid/side is kept where that is worth STEREO_GAIN. Its split moves
+ * from ms_ratio towards an even one as the channels decorrelate,
+ * a left/right split follows the RMS of the channels.
+ */
+static void
+choose_stereo (agress_encoder *encoder, void *pcm)
+{
+    gdouble el = 0.0, er = 0.0, elr = 0.0;
+    gdouble mid_side;
+    gint offset, a, b, i;
+
+    offset = encoder->format == FMT_8 ? G_MININT8 : 0;
+
+    for (i = 0; i < encoder->frame; i++)
+    {
+        a = get_sample (pcm, encoder->format, i * encoder->channels) + offset;
+        b = get_sample (pcm, encoder->format, i * encoder->channels + 1)
+            + offset;
+
+        el += (gdouble) a * a;
+        er += (gdouble) b * b;
+        elr += (gdouble) a * b;
+    }
+
+    /* 4 E(M) E(S) */
+    mid_side = ((el + er) * (el + er) - 4.0 * elr * elr) / 4.0;
+
+    encoder->lr = STEREO_GAIN * mid_side > el * er;
+    encoder->split = encoder->ms_ratio;
+
+    if (encoder->lr && (el + er > 0.0))
+        encoder->split = CLAMP (100.0 * sqrt (el) / (sqrt (el) + sqrt (er)),
+                                MIN_SPLIT, MAX_SPLIT);
+    else if (el * er > 0.0)
+        encoder->split = 50.0 + (encoder->ms_ratio - 50.0)
+                         * fabs (elr) / sqrt (el * er);
+
+    agress_encoder_budget (encoder, encoder->ratio, encoder->split,
+                           encoder->budget);
+}
+
+/*
+ * Splits pcm into the planes, with the lap around the frame. The
+ * stereo mode is chosen by the frame alone.
+ */
+static void
+split_frame (agress_encoder *encoder, void *pcm)
+{
+    gint format, channels, frame;
+    gint first, sum;
+    gint a, b;
+    gint c, i;
+
+    format = encoder->format;
+    channels = encoder->channels;
+    frame = encoder->frame + 2 * encoder->lap;
+
+    if (encoder->mode == MODE_MONO)
+    {
+        for (i = 0; i < frame; i++)
+        {
+            sum = 0;
+
+            for (c = 0; c < channels; c++)
+                sum += get_sample (pcm, format, i * channels + c);
+
+            set_sample (encoder->plane[0], format, i, sum / channels);
+        }
+
+        return;
+    }
+
+    first = 0;
+
+    if (encoder->flags & AG_STEREO)
+        choose_stereo (encoder, (guint8 *) pcm
+                       + encoder->lap * channels * encoder->width);
+
+    if ((encoder->mode == MODE_JSTEREO) && !encoder->lr)
+    {
+        for (i = 0; i < frame; i++)
+        {
+            a = get_sample (pcm, format, i * channels);
+            b = get_sample (pcm, format, i * channels + 1);
+
+            set_sample (encoder->plane[0], format, i, (a + b) / 2);
+            set_sample (encoder->plane[1], format, i, (a - b) / 2);
+        }
+
+        first = 2;
+    }
+
+    for (c = first; c < channels; c++)
+    {
+        for (i = 0; i < frame; i++)
+            set_sample (encoder->plane[c], format, i,
+                        get_sample (pcm, format, i * channels + c));
+    }
+}
+
+/*
+ * Window of a lapped frame: the previous input frame, which starts
+ * with silence, followed by pcm.
+ */
+static void *
+lap_window (agress_encoder *encoder, void *pcm)
+{
+    gint size;
+
+    size = encoder->frame * encoder->channels * encoder->width;
+
+    memmove (encoder->window, encoder->window + size, size);
+    memcpy (encoder->window + size, pcm, size);
+
+    return encoder->window;
+}
+
+/*
+ * Byte budget of every coded channel of the encoder at ratio: its
+ * share of the input frame. Lower ratios never get smaller budgets,
+ * so records encoded at one ratio can be cut to those of a higher one.
+ */
+void
+agress_encoder_budget (agress_encoder *encoder, gdouble ratio,
+                       gdouble ms_ratio, gint *budget)
+{
+    gdouble frame_bytes;
+    gint least, most, c;
+
+    g_assert (ratio >= 1.0);
+
+    frame_bytes = (gdouble) encoder->frame * encoder->width;
+    least = MIN_BUDGET;
+
+    /* The weights and the split come with every record */
+    if (encoder->flags & AG_WEIGHTS)
+        least += WEIGHT_BYTES (encoder->levels);
+
+    if (encoder->flags & AG_PACKETS)
+        least += SPLIT_BYTES (encoder->levels);
+
+    if (encoder->mode == MODE_MONO)
+    {
+        budget[0] =
+            CLAMP (frame_bytes * encoder->channels / ratio - 2,
+                   least, G_MAXUINT16);
+    }
+    else
+    {
+        for (c = 0; c < encoder->coded; c++)
+            budget[c] =
+                CLAMP (frame_bytes / ratio - 2, least, G_MAXUINT16);
+
+        if (encoder->mode == MODE_JSTEREO)
+        {
+            budget[0] =
+                CLAMP (2.0 * frame_bytes / ratio * ms_ratio / 100.0 - 2,
+                       least, G_MAXUINT16);
+            budget[1] =
+                CLAMP (2.0 * frame_bytes / ratio - budget[0] - 2,
+                       least, G_MAXUINT16);
+        }
+    }
+
+    most = G_MAXUINT16;
+
+    if (encoder->flags & AG_LAYERS)
+        most -= LAYER_TABLE;
+
+    /* A record of G_MAXUINT16 bytes would start a tail marker */
+    if (encoder->flags & AG_TAIL)
+        most -= 1;
+
+    for (c = 0; c < encoder->coded; c++)
+        budget[c] = MIN (budget[c], most);
+}
+
+agress_encoder *
+agress_encoder_new (gint freq, gint bits, gint channels, gint frame,
+                    gint mode, gdouble ratio, gdouble ms_ratio,
+                    gint threads, gint flags)
+{
+    agress_encoder *encoder;
+    gint c, size;
+
+    g_assert ((bits == 8) || (bits == 16));
+    g_assert ((channels >= 1) && (channels <= MAX_CHANNELS));
+    g_assert (ratio >= 1.0);
+
+    encoder = g_new0 (agress_encoder, 1);
+
+    if (channels == 1)
+        mode = MODE_MONO;
+
+    /* Only a mid/side pair can switch to left/right */
+    if (mode != MODE_JSTEREO)
+        flags &= ~AG_STEREO;
+
+    agress_header_init (&encoder->header, freq, frame, bits, channels, mode);
+    encoder->header.bits |= flags & 0xff;
+    encoder->header.more = flags >> 8;
+
+    if (encoder->header.more != 0)
+        encoder->header.magic = AG_MAGIC_MORE;
+
+    encoder->format = bits == 8 ? FMT_8 : FMT_16;
+    encoder->width = bits / 8;
+    encoder->channels = channels;
+    encoder->coded = mode == MODE_MONO ? 1 : channels;
+    encoder->mode = mode;
+    encoder->frame = frame;
+    encoder->flags = flags;
+    encoder->ratio = ratio;
+    encoder->ms_ratio = ms_ratio;
+    encoder->split = ms_ratio;
+    encoder->block = frame;
+    encoder->levels = stream_levels (flags, frame);
+    encoder->lap = stream_lap (flags, frame);
+
+    encoder->budget = g_new0 (gint, encoder->coded);
+    encoder->plane = g_new0 (void *, encoder->coded);
+    encoder->data = g_new0 (guint8 *, encoder->coded);
+    encoder->size = g_new0 (gint, encoder->coded);
+    encoder->curve = g_new0 (agress_curve, encoder->coded);
+
+    agress_encoder_budget (encoder, ratio, ms_ratio, encoder->budget);
+
+    for (c = 0; c < encoder->coded; c++)
+    {
+        encoder->plane[c] = g_malloc ((frame + 2 * encoder->lap)
+                                      * encoder->width);
+
+        /* Either channel of a switching pair may get all of its budget */
+        size = encoder->budget[c];
+
+        if ((flags & AG_STEREO) && (c < 2))
+            size = encoder->budget[0] + encoder->budget[1];
+
+        /* The table is not part of the budget but of the record */
+        if (flags & AG_LAYERS)
+            encoder->data[c] = g_malloc (size + LAYER_TABLE);
+        else
+            encoder->data[c] = g_malloc (size);
+    }
+
+    if (encoder->lap > 0)
+    {
+        size = 2 * frame * channels * encoder->width;
+        encoder->window = g_malloc (size);
+        memset (encoder->window, bits == 8 ? -G_MININT8 : 0, size);
+    }
+
+    encoder->pending = g_malloc (frame * channels * encoder->width);
+
+    encoder->workers = channel_pool_new (encode_channel, encoder, threads);
+
+    return encoder;
+}
+
+void
+agress_encoder_free (agress_encoder *encoder)
+{
+    gint c;
+
+    channel_pool_free (encoder->workers);
+
+    for (c = 0; c < encoder->coded; c++)
+    {
+        g_free (encoder->plane[c]);
+        g_free (encoder->data[c]);
+    }
+
+    g_free (encoder->budget);
+    g_free (encoder->plane);
+    g_free (encoder->data);
+    g_free (encoder->size);
+    g_free (encoder->curve);
+    g_free (encoder->window);
+    g_free (encoder->pending);
+    g_free (encoder);
+}
+
+/*
+ * Codes a frame of pcm into encoder->data. A lapped stream codes the
+ * frame that ends lap samples into pcm, with both of its edges lapped
+ * into the samples beyond them, see agress_basis. The decoder puts it
+ * out lap samples late, so it gets the previous frame of pcm back.
+ */
+void
+agress_encoder_frame (agress_encoder *encoder, void *pcm)
+{
+    gint64 start;
+
+    start = agress_stats_clock ();
+
+    if (encoder->lap > 0)
+        pcm = lap_window (encoder, pcm);
+
+    split_frame (encoder, pcm);
+    agress_stats_stage (NULL, STAGE_SPLIT, start);
+
+    channel_pool_run (encoder->workers, encoder->coded);
+}
+
+/*
+ * Codes the last frame a lapped stream still holds back by following
+ * it with one of silence. Returns TRUE when encoder->data holds it.
+ */
+gboolean
+agress_encoder_flush (agress_encoder *encoder)
+{
+    guint8 *pcm;
+    gint size;
+
+    if (encoder->lap == 0)
+        return FALSE;
+
+    size = encoder->frame * encoder->channels * encoder->width;
+    pcm = g_malloc (size);
+    memset (pcm, encoder->format == FMT_8 ? -G_MININT8 : 0, size);
+
+    agress_encoder_frame (encoder, pcm);
+    g_free (pcm);
+
+    return TRUE;
+}
+
+/*
+ * Hands samples per channel of interleaved pcm to the encoder, which
+ * codes them a frame at a time as they are pulled. Returns how many
+ * samples it took, none while a frame is waiting to be pulled. A whole
+ * frame at the start of pcm is coded from pcm itself without a copy,
+ * so pcm has to stay as it is until that frame is pulled.
+ */
+gint
+agress_encoder_push (agress_encoder *encoder, void *pcm, gint samples)
+{
+    gint width, take;
+
+    if ((encoder->ready != NULL) || encoder->finished || (samples <= 0))
+        return 0;
+
+    if ((encoder->held == 0) && (samples >= encoder->frame))
+    {
+        encoder->ready = pcm;
+        return encoder->frame;
+    }
+
+    width = encoder->channels * encoder->width;
+    take = MIN (samples, encoder->frame - encoder->held);
+
+    memcpy (encoder->pending + encoder->held * width, pcm, take * width);
+    encoder->held += take;
+
+    if (encoder->held == encoder->frame)
+    {
+        encoder->ready = encoder->pending;
+        encoder->held = 0;
+    }
+
+    return take;
+}
+
+/*
+ * Ends the input, the frames still held are then pulled.
+ */
+void
+agress_encoder_finish (agress_encoder *encoder)
+{
+    encoder->finished = TRUE;
+}
+
+/*
+ * Codes the next frame of the samples pushed into encoder->data,
+ * returns FALSE when there is none yet. Once the input is finished
+ * a short last frame is padded with silence, and a lapped stream is
+ * flushed. With AG_TAIL encoder->tail gives the samples of the short
+ * last frame on the frame whose output is that frame, the last one,
+ * and is 0 on every other one: a tail marker goes in front of it.
+ */
+gboolean
+agress_encoder_pull (agress_encoder *encoder)
+{
+    gint width;
+
+    encoder->tail = 0;
+
+    if (encoder->ready != NULL)
+    {
+        agress_encoder_frame (encoder, encoder->ready);
+        encoder->ready = NULL;
+
+        return TRUE;
+    }
+
+    if (!encoder->finished)
+        return FALSE;
+
+    if (encoder->held > 0)
+    {
+        width = encoder->channels * encoder->width;
+
+        memset (encoder->pending + encoder->held * width,
+                encoder->format == FMT_8 ? -G_MININT8 : 0,
+                (encoder->frame - encoder->held) * width);
+
+        if (encoder->flags & AG_TAIL)
+            encoder->last = encoder->held;
+
+        encoder->held = 0;
+        agress_encoder_frame (encoder, encoder->pending);
+
+        /* A lapped stream puts the frame out a frame later */
+        if (encoder->lap == 0)
+            encoder->tail = encoder->last;
+
+        return TRUE;
+    }
+
+    if (encoder->flushed)
+        return FALSE;
+
+    encoder->flushed = TRUE;
+
+    if (!agress_encoder_flush (encoder))
+        return FALSE;
+
+    encoder->tail = encoder->last;
+
+    return TRUE;
+}
+
+static void
+decode_channel (gpointer owner, gint channel)
+{
+    agress_decoder *decoder = owner;
+    agress_blocks *blocks;
+    agress_weights weights;
+    agress_basis basis;
+    guint8 *data;
+    gint sign, size, start;
+
+    sign = decoder->format == FMT_8 ? FMT_U : FMT_S;
+
+    data = decoder->in_data[channel];
+    size = decoder->in_size[channel];
+    blocks = &decoder->cur_blocks[channel];
+
+    if ((decoder->flags & AG_LAYERS) && (decoder->max_layers > 0))
+        size = agress_layers_size (data, size, decoder->max_layers);
+
+    /* Nothing past the table decodes to silence */
+    start = payload_start (decoder, data, size, blocks, &weights, &basis);
+    basis.edge = decoder->edge != NULL ? decoder->edge[channel] : NULL;
+
+    decode_frame_blocks (data + start, size - start,
+                         decoder->cur[channel],
+                         decoder->frame * decoder->width,
+                         decoder->format, FMT_LE, sign, &basis, blocks,
+                         decoder->flags & AG_WEIGHTS ? &weights : NULL);
+
+    /* A pair that switches stereo mode is smoothed once it matches */
+    if (decoder->have_prev && (decoder->lap == 0)
+            && ((channel > 1) || (decoder->prev_lr == decoder->cur_lr)))
+        smooth_channel (decoder, channel);
+}
+
+/*
+ * Offset of the coded frame in a record, past the layer table, the
+ * tree of blocks, which is read to blocks, the weights, read to
+ * weights, and the split of the basis, read to basis. A record cut
+ * short of them gives its size and a frame of one block.
+ */
+static gint
+payload_start (agress_decoder *decoder, guint8 *record, gint size,
+               agress_blocks *blocks, agress_weights *weights,
+               agress_basis *basis)
+{
+    gint start = 0, head, i;
+
+    basis->levels = decoder->levels;
+    basis->packets = FALSE;
+    basis->split = 0;
+    basis->lap = decoder->lap;
+    basis->edge = NULL;
+
+    blocks->count = 1;
+    blocks->size[0] = g_bit_nth_msf (decoder->frame, -1);
+
+    if ((decoder->flags & AG_LAYERS) && (size > 0))
+        start = 1 + 2 * record[0];
+
+    if ((decoder->flags & AG_BLOCKS) && (start < size))
+    {
+        head = get_blocks (record + start, size - start, decoder->frame,
+                           blocks);
+
+        if (head < 0)
+        {
+            blocks->count = 1;
+            blocks->size[0] = g_bit_nth_msf (decoder->frame, -1);
+            return size;
+        }
+
+        start += head;
+    }
+
+    if (decoder->flags & AG_WEIGHTS)
+    {
+        if (start + WEIGHT_BYTES (decoder->levels) > size)
+            return size;
+
+        get_weights (record + start, decoder->levels, weights);
+        start += WEIGHT_BYTES (decoder->levels);
+    }
+
+    if (decoder->flags & AG_PACKETS)
+    {
+        if (start + SPLIT_BYTES (decoder->levels) > size)
+            return size;
+
+        for (i = 0; i < SPLIT_BYTES (decoder->levels); i++)
+            basis->split |= (guint32) record[start + i] << (8 * i);
+
+        start += SPLIT_BYTES (decoder->levels);
+    }
+
+    return MIN (start, size);
+}
+
+/*
+ * Smooths the edge between the last block of the previous frame of
+ * channel and the first one of the current frame. Edges between the
+ * blocks of a frame are left as they are, they lie at attacks.
+ */
+static void
+smooth_channel (agress_decoder *decoder, gint channel)
+{
+    agress_blocks *prev, *cur;
+    gint last, first;
+    gint64 start;
+
+    prev = &decoder->prev_blocks[channel];
+    cur = &decoder->cur_blocks[channel];
+    last = 1 << prev->size[prev->count - 1];
+    first = 1 << cur->size[0];
+
+    start = agress_stats_clock ();
+    smooth_edge ((guint8 *) decoder->prev[channel]
+                 + (decoder->frame - last) * decoder->width,
+                 decoder->cur[channel], last,
+                 MIN (decoder->smooth, MIN (last, first)),
+                 decoder->format, FMT_LE,
+                 decoder->format == FMT_8 ? FMT_U : FMT_S);
+    agress_stats_stage (NULL, STAGE_SMOOTH, start);
+}
+
+/*
+ * Stereo mode of a frame of an AG_STEREO stream from its first
+ * record. A record cut before its first payload byte keeps the mode
+ * of the previous frame.
+ */
+static gboolean
+frame_lr (agress_decoder *decoder, guint8 *record, gint size)
+{
+    agress_blocks blocks;
+    agress_weights weights;
+    agress_basis basis;
+    gint start;
+
+    start = payload_start (decoder, record, size, &blocks, &weights,
+                           &basis);
+
+    if (start >= size)
+        return decoder->prev_lr;
+
+    return (record[start] & FRAME_USER) != 0;
+}
+
+/*
+ * Turns a decoded mid/side pair into left/right, as merge_frame
+ * would, so it can be smoothed against a left/right neighbour.
+ */
+static void
+mid_side_to_lr (agress_decoder *decoder, void **plane)
+{
+    gint format, m, s, i;
+
+    format = decoder->format;
+
+    for (i = 0; i < decoder->frame; i++)
+    {
+        m = get_sample (plane[0], format, i);
+        s = get_sample (plane[1], format, i);
+
+        set_sample (plane[0], format, i, m + s);
+        set_sample (plane[1], format, i, m - s);
+    }
+}
+
+static void
+merge_frame (agress_decoder *decoder, void **plane, gboolean lr)
+{
+    gint format, channels, frame;
+    gint first;
+    gint m, s;
+    gint c, i;
+
+    format = decoder->format;
+    channels = decoder->channels;
+    frame = decoder->frame;
+    first = 0;
+
+    if ((decoder->mode == MODE_JSTEREO) && !lr)
+    {
+        for (i = 0; i < frame; i++)
+        {
+            m = get_sample (plane[0], format, i);
+            s = get_sample (plane[1], format, i);
+
+            set_sample (decoder->pcm, format, i * channels, m + s);
+            set_sample (decoder->pcm, format, i * channels + 1, m - s);
+        }
+
+        first = 2;
+    }
+
+    for (c = first; c < channels; c++)
+    {
+        for (i = 0; i < frame; i++)
+            set_sample (decoder->pcm, format, i * channels + c,
+                        get_sample (plane[c], format, i));
+    }
+}
+
+/*
+ * Turns the edges of the front pair of a lapped stream to the stereo
+ * mode of the current frame, the one they are lapped back in.
+ */
+static void
+lap_stereo (agress_decoder *decoder)
+{
+    gdouble a, b;
+    gint i;
+
+    for (i = 0; i < decoder->lap; i++)
+    {
+        a = decoder->edge[0][i];
+        b = decoder->edge[1][i];
+
+        if (decoder->cur_lr)
+        {
+            decoder->edge[0][i] = a + b;
+            decoder->edge[1][i] = a - b;
+        }
+        else
+        {
+            decoder->edge[0][i] = (a + b) / 2.0;
+            decoder->edge[1][i] = (a - b) / 2.0;
+        }
+    }
+}
+
+/*
+ * Bytes of pcm the last frame keeps after a tail marker.
+ */
+static gint
+tail_size (agress_decoder *decoder)
+{
+    return MIN (decoder->tail, decoder->frame) * decoder->width
+           * decoder->channels;
+}
+
+agress_decoder *
+agress_decoder_new (agress_header *header, gint smooth, gint threads)
+{
+    agress_decoder *decoder;
+    gint c;
+
+    decoder = g_new0 (agress_decoder, 1);
+
+    if (agress_header_parse (header, &decoder->channels,
+                             &decoder->coded, &decoder->mode) != TRUE)
+    {
+        g_free (decoder);
+        return NULL;
+    }
+
+    decoder->header = *header;
+    decoder->format = (header->bits & AG_BITS) == 8 ? FMT_8 : FMT_16;
+    decoder->width = (header->bits & AG_BITS) / 8;
+    decoder->frame = header->frame;
+    decoder->flags = header->bits & ~AG_BITS;
+
+    if (header->magic == AG_MAGIC_MORE)
+        decoder->flags |= header->more << 8;
+
+    decoder->levels = stream_levels (decoder->flags, decoder->frame);
+    decoder->lap = stream_lap (decoder->flags, decoder->frame);
+    decoder->smooth = CLAMP (smooth, 1, decoder->frame);
+
+    decoder->prev = g_new0 (void *, decoder->coded);
+    decoder->cur = g_new0 (void *, decoder->coded);
+    decoder->in_data = g_new0 (guint8 *, decoder->coded);
+    decoder->in_size = g_new0 (gint, decoder->coded);
+    decoder->prev_blocks = g_new0 (agress_blocks, decoder->coded);
+    decoder->cur_blocks = g_new0 (agress_blocks, decoder->coded);
+
+    if (decoder->lap > 0)
+        decoder->edge = g_new0 (gdouble *, decoder->coded);
+
+    for (c = 0; c < decoder->coded; c++)
+    {
+        decoder->prev[c] = g_malloc (decoder->frame * decoder->width);
+        decoder->cur[c] = g_malloc (decoder->frame * decoder->width);
+
+        if (decoder->lap > 0)
+            decoder->edge[c] = g_new0 (gdouble, decoder->lap);
+    }
+
+    decoder->pcm_size = decoder->frame * decoder->width * decoder->channels;
+    decoder->pcm = g_malloc (decoder->pcm_size);
+
+    decoder->workers = channel_pool_new (decode_channel, decoder, threads);
+
+    return decoder;
+}
+
+void
+agress_decoder_free (agress_decoder *decoder)
+{
+    gint c;
+
+    channel_pool_free (decoder->workers);
+
+    for (c = 0; c < decoder->coded; c++)
+    {
+        g_free (decoder->prev[c]);
+        g_free (decoder->cur[c]);
+
+        if (decoder->edge != NULL)
+            g_free (decoder->edge[c]);
+    }
+
+    g_free (decoder->edge);
+    g_free (decoder->prev);
+    g_free (decoder->cur);
+    g_free (decoder->in_data);
+    g_free (decoder->in_size);
+    g_free (decoder->prev_blocks);
+    g_free (decoder->cur_blocks);
+    g_free (decoder->pcm);
+    g_free (decoder);
+}
+
+/*
+ * Decodes one frame of every coded channel. The edge between two
+ * frames is smoothed in place, so output lags one frame behind:
+ * returns TRUE when decoder->pcm holds the previous frame. Set
+ * decoder->tail from a tail marker before the frame after it.
+ */
+gboolean
+agress_decoder_frame (agress_decoder *decoder, guint8 **data, gint *size)
+{
+    agress_blocks *blocks;
+    gboolean ready;
+    gint64 start;
+    void **temp;
+    gint c;
+
+    for (c = 0; c < decoder->coded; c++)
+    {
+        decoder->in_data[c] = data[c];
+        decoder->in_size[c] = size[c];
+    }
+
+    if (decoder->flags & AG_STEREO)
+        decoder->cur_lr = frame_lr (decoder, data[0], size[0]);
+
+    if ((decoder->lap > 0) && (decoder->prev_lr != decoder->cur_lr))
+        lap_stereo (decoder);
+
+    channel_pool_run (decoder->workers, decoder->coded);
+
+    /* A lapped frame comes out whole, it is the previous one */
+    if (decoder->lap > 0)
+    {
+        ready = decoder->have_prev;
+
+        if (ready)
+        {
+            start = agress_stats_clock ();
+            merge_frame (decoder, decoder->cur, decoder->cur_lr);
+            agress_stats_stage (NULL, STAGE_MERGE, start);
+        }
+
+        /* The tail marker comes before the frame that puts it out */
+        if (ready && (decoder->tail > 0))
+            decoder->pcm_size = tail_size (decoder);
+
+        decoder->prev_lr = decoder->cur_lr;
+        decoder->have_prev = TRUE;
+
+        return ready;
+    }
+
+    /* Left/right is exact from mid/side, not the other way round */
+    if (decoder->have_prev && (decoder->prev_lr != decoder->cur_lr))
+    {
+        if (decoder->prev_lr)
+            mid_side_to_lr (decoder, decoder->cur);
+        else
+            mid_side_to_lr (decoder, decoder->prev);
+
+        decoder->prev_lr = decoder->cur_lr = TRUE;
+
+        for (c = 0; c < 2; c++)
+            smooth_channel (decoder, c);
+    }
+
+    ready = decoder->have_prev;
+
+    if (ready)
+    {
+        start = agress_stats_clock ();
+        merge_frame (decoder, decoder->prev, decoder->prev_lr);
+        agress_stats_stage (NULL, STAGE_MERGE, start);
+    }
+
+    temp = decoder->prev;
+    decoder->prev = decoder->cur;
+    decoder->cur = temp;
+
+    blocks = decoder->prev_blocks;
+    decoder->prev_blocks = decoder->cur_blocks;
+    decoder->cur_blocks = blocks;
+    decoder->prev_lr = decoder->cur_lr;
+    decoder->have_prev = TRUE;
+
+    return ready;
+}
+
+/*
+ * Puts out the frame still held, cut to decoder->tail samples if set.
+ */
+gboolean
+agress_decoder_flush (agress_decoder *decoder)
+{
+    gint64 start;
+
+    if (!decoder->have_prev)
+        return FALSE;
+
+    /* A lapped stream has put out every frame already */
+    if (decoder->lap > 0)
+    {
+        decoder->have_prev = FALSE;
+        return FALSE;
+    }
+
+    start = agress_stats_clock ();
+    merge_frame (decoder, decoder->prev, decoder->prev_lr);
+    agress_stats_stage (NULL, STAGE_MERGE, start);
+    decoder->have_prev = FALSE;
+
+    if (decoder->tail > 0)
+        decoder->pcm_size = tail_size (decoder);
+
+    return TRUE;
+}
@@ -0,0 +1,227 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+#ifndef __AGSTREAM_H__
+#define __AGSTREAM_H__
+
+#include <agress.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define AG_PACKED __attribute__ ((packed))
+
+#define AG_MAGIC      0x4741
+#define AG_MAGIC_MORE 0x4742
+
+/*
+ * Channel modes. MONO, STEREO and JSTEREO are stored in the header
+ * as is, so files written by older versions remain readable.
+ * Any other channel count is stored as MODE_MULTI | count, with
+ * MODE_JOINT set when the front pair (channels 0 and 1) is coded
+ * as mid/side.
+ */
+#define MODE_MONO     1
+#define MODE_STEREO   2
+#define MODE_JSTEREO  3
+#define MODE_MULTI    0x80
+#define MODE_JOINT    0x40
+#define MODE_COUNT    0x3f
+
+#define MAX_CHANNELS  MODE_COUNT
+
+/*
+ * Stream flags, kept in the bits field around the sample width,
+ * which is 8 or 16.
+ * AG_LAYERS: every channel record starts with a layer table, a count
+ * byte followed by that many little endian guint16 payload sizes,
+ * one per bitplane. Cutting a record to the table plus one of these
+ * sizes keeps whole quality layers without decoding anything.
+ * AG_GROUPS: records with layer tables are stored layer-major in
+ * groups of frames, see aggroup.h.
+ * AG_ARITH: SPIHT decisions are range coded with adaptive contexts.
+ * AG_NLS: frames are coded by the no-list SPIHT engine.
+ * AG_STEREO: the mid/side pair is coded as left/right in frames
+ * whose first record has FRAME_USER set in its first payload byte.
+ * AG_BLOCKS: every payload starts with the tree of blocks its frame
+ * was transformed as, see agress_blocks, in whole bytes. FRAME_USER
+ * goes to the first byte after it.
+ * Flags from 0x100 up are kept in the more field of the header,
+ * which only headers with AG_MAGIC_MORE have, shifted right by 8.
+ * AG_WEIGHTS: the payload goes on with the weights of the frame, see
+ * agress_weights, a nibble per band from band 0 on, low nibble first.
+ * AG_PACKETS: the payload goes on with the split of the basis of the
+ * frame, see agress_basis, a bit per level, in whole bytes.
+ * FRAME_USER goes to the first byte after them.
+ * AG_LEVELS: levels of the decomposition, zero for all of them.
+ * AG_LAPPED: the edges between frames are lapped, see
+ * agress_encoder_frame, and the stream ends with one frame more.
+ * AG_TAIL: the last frame may be short. A tail marker, see
+ * agress_reader_tail, then comes right before the last frame, or the
+ * last group, and gives the samples of the last frame that are kept.
+ * Records stay shorter than G_MAXUINT16 bytes.
+ */
+#define AG_NLS        0x01
+#define AG_STEREO     0x02
+#define AG_BLOCKS     0x04
+#define AG_BITS       0x18
+#define AG_ARITH      0x20
+#define AG_GROUPS     0x40
+#define AG_LAYERS     0x80
+#define AG_WEIGHTS    0x100
+#define AG_PACKETS    0x200
+#define AG_LAPPED     0x400
+#define AG_TAIL       0x800
+#define AG_LEVELS     0xf000
+#define LEVELS_SHIFT  12
+
+#define LAYER_TABLE   (1 + 2 * MAX_LAYERS)
+
+typedef struct agress_header_tag
+{
+    guint16 magic AG_PACKED;
+    guint16 freq AG_PACKED;
+    guint16 frame AG_PACKED;
+    guint8 channels AG_PACKED;
+    guint8 bits AG_PACKED;
+    guint8 more AG_PACKED;
+} agress_header;
+
+/* Size of a header without the more field */
+#define AG_HEADER     8
+
+typedef void (*channel_func) (gpointer owner, gint channel);
+
+typedef struct channel_pool_tag
+{
+    GThreadPool *pool;
+    channel_func func;
+    gpointer owner;
+    GMutex lock;
+    GCond done;
+    gint pending;
+} channel_pool;
+
+typedef struct agress_encoder_tag
+{
+    agress_header header;
+    gint format;            /* FMT_8 or FMT_16 */
+    gint width;             /* bytes per sample */
+    gint channels;          /* interleaved input channels */
+    gint coded;             /* coded channels per frame */
+    gint mode;
+    gint frame;             /* samples per channel */
+    gint flags;
+    gdouble ratio;
+    gdouble ms_ratio;       /* percent of the pair's budget for mid */
+    gboolean lr;            /* AG_STEREO: the frame is left/right */
+    gdouble split;          /* percent for channel 0 in this frame */
+    gint block;             /* AG_BLOCKS: shortest block of a frame */
+    gint levels;            /* of the decomposition */
+    gint lap;               /* AG_LAPPED: samples lapped over an edge */
+    guint8 *window;         /* AG_LAPPED: last input frame and this one */
+    guint8 *pending;        /* pushed samples short of a frame */
+    gint held;              /* samples per channel in pending */
+    void *ready;            /* whole frame waiting to be pulled */
+    gboolean finished;      /* no more samples are pushed */
+    gboolean flushed;
+    gint last;              /* AG_TAIL: samples of the short last frame */
+    gint tail;              /* AG_TAIL: of the frame pulled, see pull */
+    gint *budget;           /* output bytes per coded channel */
+    agress_quality quality; /* zero fills every budget */
+    gboolean measure;       /* fill curve for every coded channel */
+    agress_curve *curve;
+    void **plane;           /* deinterleaved input, lap more each side */
+    guint8 **data;          /* encoded payload per coded channel */
+    gint *size;
+    channel_pool *workers;
+} agress_encoder;
+
+typedef struct agress_decoder_tag
+{
+    agress_header header;
+    gint format;
+    gint width;
+    gint channels;          /* interleaved output channels */
+    gint coded;
+    gint mode;
+    gint frame;
+    gint levels;
+    gint lap;
+    gint smooth;
+    gint flags;
+    gint max_layers;        /* 0 decodes every layer */
+    void **prev;            /* decoded frame waiting for its right edge */
+    void **cur;
+    gboolean prev_lr;       /* AG_STEREO: the frames are left/right */
+    gboolean cur_lr;
+    agress_blocks *prev_blocks; /* of every coded channel */
+    agress_blocks *cur_blocks;
+    gboolean have_prev;
+    gdouble **edge;         /* AG_LAPPED: lapped end of the last frame */
+    gint tail;              /* AG_TAIL: samples kept of the last frame */
+    guint8 **in_data;
+    gint *in_size;
+    void *pcm;              /* interleaved output frame */
+    gint pcm_size;
+    channel_pool *workers;
+} agress_decoder;
+
+void
+agress_header_init (agress_header *header, gint freq, gint frame,
+                    gint bits, gint channels, gint mode);
+gboolean
+agress_header_parse (agress_header *header, gint *channels,
+                     gint *coded, gint *mode);
+gint
+agress_header_size (const agress_header *header);
+gint
+agress_layers_size (const guint8 *record, gint size, gint layers);
+gint
+agress_record_cut (const guint8 *record, gint size, gint budget,
+                   gint flags, guint8 *out);
+
+agress_encoder *
+agress_encoder_new (gint freq, gint bits, gint channels, gint frame,
+                    gint mode, gdouble ratio, gdouble ms_ratio,
+                    gint threads, gint flags);
+void
+agress_encoder_free (agress_encoder *encoder);
+void
+agress_encoder_budget (agress_encoder *encoder, gdouble ratio,
+                       gdouble ms_ratio, gint *budget);
+void
+agress_encoder_frame (agress_encoder *encoder, void *pcm);
+gboolean
+agress_encoder_flush (agress_encoder *encoder);
+gint
+agress_encoder_push (agress_encoder *encoder, void *pcm, gint samples);
+void
+agress_encoder_finish (agress_encoder *encoder);
+gboolean
+agress_encoder_pull (agress_encoder *encoder);
+
+agress_decoder *
+agress_decoder_new (agress_header *header, gint smooth, gint threads);
+void
+agress_decoder_free (agress_decoder *decoder);
+gboolean
+agress_decoder_frame (agress_decoder *decoder, guint8 **data, gint *size);
+gboolean
+agress_decoder_flush (agress_decoder *decoder);
+
+G_END_DECLS
+
+#endif /* __AGSTREAM_H__ */
@@ -0,0 +1,161 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+/*
+ * Writes a deterministic test wav for the conformance suite. Only
+ * integer arithmetic is used, so the input is the same everywhere.
+ *
+ * usage: agsignal BITS CHANNELS SAMPLES OUTPUT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#define FREQ 8000
+
+void put16 (FILE *f, gint value);
+void put32 (FILE *f, guint32 value);
+gint triangle (gint i, gint period, gint amplitude);
+gint sample (gint i, gint channel, guint32 *seed);
+
+void
+put16 (FILE *f, gint value)
+{
+    fputc (value & 0xff, f);
+    fputc ((value >> 8) & 0xff, f);
+}
+
+void
+put32 (FILE *f, guint32 value)
+{
+    put16 (f, value & 0xffff);
+    put16 (f, value >> 16);
+}
+
+gint
+triangle (gint i, gint period, gint amplitude)
+{
+    gint phase;
+
+    phase = i % period;
+
+    if (phase < period / 2)
+        return amplitude * (4 * phase - period) / period;
+
+    return amplitude * (3 * period - 4 * phase) / period;
+}
+
+/*
+ * 16-bit sample: a few partials, a burst of noise, a step and a
+ * stretch of digital silence, shifted per channel.
+ */
+gint
+sample (gint i, gint channel, guint32 *seed)
+{
+    gint value, segment;
+
+    *seed = *seed * 1664525u + 1013904223u;
+    segment = (i / 1000 + channel) % 5;
+
+    value = triangle (i, 37 + 6 * channel, 9000)
+            + triangle (i, 5 + channel, 1500);
+
+    switch (segment)
+    {
+    case 0:
+        value += (gint) (*seed >> 20) - 2048;
+        break;
+    case 1:
+        value += (i & 256) ? 12000 : -12000;
+        break;
+    case 2:
+        value = 0;
+        break;
+    default:
+        break;
+    }
+
+    return CLAMP (value, G_MININT16, G_MAXINT16);
+}
+
+int
+main (int argc, char **argv)
+{
+    gint bits, channels, samples, width;
+    guint32 seed = 12345;
+    FILE *f;
+    gint i, c, value;
+
+    if (argc != 5)
+    {
+        fprintf (stderr, "usage: agsignal BITS CHANNELS SAMPLES OUTPUT\n");
+        exit (1);
+    }
+
+    bits = atoi (argv[1]);
+    channels = atoi (argv[2]);
+    samples = atoi (argv[3]);
+    width = bits / 8;
+
+    if (((bits != 8) && (bits != 16)) || (channels < 1) || (samples < 1))
+    {
+        fprintf (stderr, "agsignal: bad arguments\n");
+        exit (1);
+    }
+
+    f = fopen (argv[4], "wb");
+
+    if (!f)
+    {
+        fprintf (stderr, "Cannot create file: %s: %m\n", argv[4]);
+        exit (1);
+    }
+
+    fwrite ("RIFF", 1, 4, f);
+    put32 (f, 36 + samples * channels * width);
+    fwrite ("WAVEfmt ", 1, 8, f);
+    put32 (f, 16);
+    put16 (f, 1);
+    put16 (f, channels);
+    put32 (f, FREQ);
+    put32 (f, FREQ * channels * width);
+    put16 (f, channels * width);
+    put16 (f, bits);
+    fwrite ("data", 1, 4, f);
+    put32 (f, samples * channels * width);
+
+    for (i = 0; i < samples; i++)
+    {
+        for (c = 0; c < channels; c++)
+        {
+            value = sample (i, c, &seed);
+
+            if (bits == 8)
+                fputc ((value >> 8) + 128, f);
+            else
+                put16 (f, value);
+        }
+    }
+
+    if (fclose (f) != 0)
+    {
+        fprintf (stderr, "%s: i/o error\n", argv[4]);
+        exit (1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * AGRESS - Прогрессивный аудио кодер
+ *
+ * Данная программа является свободным программным обеспечением.
+ * Вы вправе распространять ее и/или модифицировать в соответствии
+ * с условиями версии 2 либо по вашему выбору с условиями более
+ * поздней версии Стандартной Общественной Лицензии GNU,
+ * опубликованной Free Software Foundation.
+ *
+ * Copyleft (С) 2004 Александр Симаков
+ *
+ * http://www.entropyware.info
+ * xander@entropyware.info
+ */
+
+/*
+ * Cuts every record of an agress file to PERCENT of its payload,
+ * as a server dropping the tail of each frame would.
+ *
+ * usage: agtrunc PERCENT INPUT OUTPUT
+ */
+
+#include <agstream.h>
+#include <agio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+int
+main (int argc, char **argv)
+{
+    agress_reader *reader;
+    agress_header header;
+    guint8 **data;
+    gint *size;
+    gint channels, coded, mode;
+    gint percent;
+    guint16 cut;
+    guint32 marker = TAIL_SIZE;
+    guint16 tail;
+    FILE *f;
+    gint c, rc;
+
+    if (argc != 4)
+    {
+        fprintf (stderr, "usage: agtrunc PERCENT INPUT OUTPUT\n");
+        exit (1);
+    }
+
+    percent = CLAMP (atoi (argv[1]), 0, 100);
+    reader = agress_reader_open (argv[2]);
+
+    if (!reader)
+    {
+        fprintf (stderr, "Cannot open file: %s: %m\n", argv[2]);
+        exit (1);
+    }
+
+    if (!agress_header_read (reader, &header)
+            || !agress_header_parse (&header, &channels, &coded, &mode))
+    {
+        fprintf (stderr, "%s: not an agress file\n", argv[2]);
+        exit (1);
+    }
+
+    f = fopen (argv[3], "wb");
+
+    if (!f)
+    {
+        fprintf (stderr, "Cannot create file: %s: %m\n", argv[3]);
+        exit (1);
+    }
+
+    fwrite (&header, 1, agress_header_size (&header), f);
+
+    data = g_new (guint8 *, coded);
+    size = g_new (gint, coded);
+
+    for (;;)
+    {
+        /* A tail marker is kept as it is */
+        if ((header.magic == AG_MAGIC_MORE) && (header.more & AG_TAIL >> 8)
+                && ((tail = agress_reader_tail (reader)) > 0))
+        {
+            tail = GUINT16_TO_LE (tail);
+
+            fwrite (&marker, 1, sizeof (marker), f);
+            fwrite (&tail, 1, sizeof (tail), f);
+        }
+
+        if ((rc = agress_reader_frame (reader, coded, data, size)) != 1)
+            break;
+
+        for (c = 0; c < coded; c++)
+        {
+            /* The first byte holds the bitplane count, keep it */
+            cut = MAX (size[c] * percent / 100, MIN (size[c], 1));
+
+            fwrite (&cut, 1, sizeof (cut), f);
+            fwrite (data[c], 1, cut, f);
+        }
+    }
+
+    if (rc != 0)
+        fprintf (stderr, "%s: unexcpected end of file\n", argv[2]);
+
+    g_free (data);
+    g_free (size);
+    agress_reader_close (reader);
+
+    if (fclose (f) != 0)
+    {
+        fprintf (stderr, "%s: i/o error\n", argv[3]);
+        exit (1);
+    }
+
+    return 0;
+}
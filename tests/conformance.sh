@@ -0,0 +1,261 @@
+#!/bin/sh
+#
+# Bit-exact conformance check. Encodes deterministic signals for every
+# supported (bits, channels, mode) combination, decodes them whole, with
+# every record cut short and with the file cut short, and compares the
+# checksums of all results with golden.md5.
+#
+# usage: conformance.sh [--update]
+#
+# --update rewrites golden.md5, only do that for an intended change
+# of the bitstream or of the decoder output.
+#
+
+srcdir=${srcdir:-.}
+AGCODEC=${AGCODEC:-../src/agcodec}
+AGSIGNAL=${AGSIGNAL:-./agsignal}
+AGTRUNC=${AGTRUNC:-./agtrunc}
+GOLDEN=$srcdir/golden.md5
+WORK=conformance.tmp
+
+# Whole frames of either size, and a length that ends in a short frame
+SAMPLES=4096
+TAIL_SAMPLES=5000
+
+if command -v md5sum > /dev/null 2>&1; then
+    MD5="md5sum"
+else
+    MD5="md5 -r"
+fi
+
+fail ()
+{
+    echo "conformance: $*" >&2
+    exit 1
+}
+
+rm -rf $WORK
+mkdir $WORK || fail "cannot create $WORK"
+
+for bits in 8 16; do
+    for channels in 1 2 6; do
+        src=s${bits}_${channels}
+        $AGSIGNAL $bits $channels $SAMPLES $WORK/$src.wav \
+            || fail "agsignal $bits $channels"
+
+        for mode in m s j; do
+            for frame in 64 1024; do
+                for ratio in 2 8; do
+                    name=${src}_${mode}_${frame}_${ratio}
+
+                    $AGCODEC -e -$mode -f $frame -r $ratio \
+                        -i $WORK/$src.wav -o $WORK/$name.ag \
+                        || fail "encode $name"
+                    $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+                        || fail "decode $name"
+
+                    # Embedded stream: every cut must still decode
+                    for percent in 50 10; do
+                        $AGTRUNC $percent $WORK/$name.ag \
+                            $WORK/$name.t$percent.ag \
+                            || fail "agtrunc $name"
+                        $AGCODEC -d -i $WORK/$name.t$percent.ag \
+                            -o $WORK/$name.t$percent.wav \
+                            || fail "decode $name.t$percent"
+                    done
+                done
+            done
+        done
+
+        # Threads must not change the bitstream
+        name=${src}_j_64_8
+        $AGCODEC -e -j -f 64 -r 8 -t 4 -i $WORK/$src.wav \
+            -o $WORK/threads.ag || fail "encode $name with threads"
+        cmp -s $WORK/threads.ag $WORK/$name.ag \
+            || fail "$name: threaded encoding differs"
+        rm -f $WORK/threads.ag
+
+        # One encode to several ratios writes the single rate streams
+        $AGCODEC -e -j -f 64 -M 8,2 -i $WORK/$src.wav \
+            -o $WORK/ladder_%r.ag || fail "encode ${src} ladder"
+        for ratio in 2 8; do
+            cmp -s $WORK/ladder_$ratio.ag $WORK/${src}_j_64_$ratio.ag \
+                || fail "${src}_j_64_$ratio: ladder output differs"
+        done
+        rm -f $WORK/ladder_*.ag
+
+        # Range coded decisions, whole and cut short
+        name=${src}_j_1024_2
+        $AGCODEC -e -j -f 1024 -r 2 -a -i $WORK/$src.wav \
+            -o $WORK/$name.arith.ag || fail "encode $name.arith"
+        $AGCODEC -d -i $WORK/$name.arith.ag -o $WORK/$name.arith.wav \
+            || fail "decode $name.arith"
+
+        for percent in 50 10; do
+            $AGTRUNC $percent $WORK/$name.arith.ag \
+                $WORK/$name.arith.t$percent.ag || fail "agtrunc $name.arith"
+            $AGCODEC -d -i $WORK/$name.arith.t$percent.ag \
+                -o $WORK/$name.arith.t$percent.wav \
+                || fail "decode $name.arith.t$percent"
+        done
+
+        # State markers instead of lists, alone and range coded
+        for coder in n na; do
+            $AGCODEC -e -j -f 1024 -r 2 -$coder -i $WORK/$src.wav \
+                -o $WORK/$name.$coder.ag || fail "encode $name.$coder"
+            $AGCODEC -d -i $WORK/$name.$coder.ag \
+                -o $WORK/$name.$coder.wav || fail "decode $name.$coder"
+            $AGTRUNC 50 $WORK/$name.$coder.ag $WORK/$name.$coder.t50.ag \
+                || fail "agtrunc $name.$coder"
+            $AGCODEC -d -i $WORK/$name.$coder.t50.ag \
+                -o $WORK/$name.$coder.t50.wav \
+                || fail "decode $name.$coder.t50"
+        done
+
+        # Quality targeted frames under a 2:1 cap, and a bitplane limit
+        for quality in "Q 40" "B 4"; do
+            tag=`echo $quality | tr -d ' '`
+            $AGCODEC -e -j -f 1024 -r 2 -$quality -i $WORK/$src.wav \
+                -o $WORK/$name.$tag.ag || fail "encode $name.$tag"
+            $AGCODEC -d -i $WORK/$name.$tag.ag \
+                -o $WORK/$name.$tag.wav || fail "decode $name.$tag"
+        done
+
+        # Left/right or mid/side picked per frame, whole and cut short
+        name=${src}_J_64_8
+        $AGCODEC -e -J -f 64 -r 8 -i $WORK/$src.wav -o $WORK/$name.ag \
+            || fail "encode $name"
+        $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+            || fail "decode $name"
+        $AGTRUNC 50 $WORK/$name.ag $WORK/$name.t50.ag || fail "agtrunc $name"
+        $AGCODEC -d -i $WORK/$name.t50.ag -o $WORK/$name.t50.wav \
+            || fail "decode $name.t50"
+
+        # Frames split into blocks at attacks, whole and cut short
+        name=${src}_b_1024_8
+        $AGCODEC -e -s -f 1024 -b 64 -r 8 -i $WORK/$src.wav -o $WORK/$name.ag \
+            || fail "encode $name"
+        $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+            || fail "decode $name"
+        $AGTRUNC 50 $WORK/$name.ag $WORK/$name.t50.ag || fail "agtrunc $name"
+        $AGCODEC -d -i $WORK/$name.t50.ag -o $WORK/$name.t50.wav \
+            || fail "decode $name.t50"
+
+        # Bands weighted by the masking model, whole and cut short
+        name=${src}_P_1024_8
+        $AGCODEC -e -j -f 1024 -P -r 8 -i $WORK/$src.wav -o $WORK/$name.ag \
+            || fail "encode $name"
+        $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+            || fail "decode $name"
+        $AGTRUNC 50 $WORK/$name.ag $WORK/$name.t50.ag || fail "agtrunc $name"
+        $AGCODEC -d -i $WORK/$name.t50.ag -o $WORK/$name.t50.wav \
+            || fail "decode $name.t50"
+
+        # Shallow decomposition split into packets, whole and cut short
+        name=${src}_k_1024_8
+        $AGCODEC -e -j -f 1024 -k 6 -p -r 8 -i $WORK/$src.wav \
+            -o $WORK/$name.ag || fail "encode $name"
+        $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+            || fail "decode $name"
+        $AGTRUNC 50 $WORK/$name.ag $WORK/$name.t50.ag || fail "agtrunc $name"
+        $AGCODEC -d -i $WORK/$name.t50.ag -o $WORK/$name.t50.wav \
+            || fail "decode $name.t50"
+
+        # Lapped frames switching stereo mode, whole and cut short
+        name=${src}_O_1024_8
+        $AGCODEC -e -J -f 1024 -O -r 8 -i $WORK/$src.wav -o $WORK/$name.ag \
+            || fail "encode $name"
+        $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+            || fail "decode $name"
+        $AGTRUNC 50 $WORK/$name.ag $WORK/$name.t50.ag || fail "agtrunc $name"
+        $AGCODEC -d -i $WORK/$name.t50.ag -o $WORK/$name.t50.wav \
+            || fail "decode $name.t50"
+
+        # Bytes moved between frames through the reservoir
+        name=${src}_j_64_8
+        $AGCODEC -e -j -f 64 -r 8 -W 8 -i $WORK/$src.wav \
+            -o $WORK/$name.W8.ag || fail "encode $name.W8"
+        $AGCODEC -d -i $WORK/$name.W8.ag -o $WORK/$name.W8.wav \
+            || fail "decode $name.W8"
+
+        name=${src}_j_64_8
+        # A file cut in the middle of a record decodes up to the cut
+        size=`wc -c < $WORK/$name.ag`
+        head -c `expr $size \* 2 / 3` $WORK/$name.ag > $WORK/$name.cut.ag
+        $AGCODEC -d -i $WORK/$name.cut.ag -o $WORK/$name.cut.wav 2> /dev/null \
+            || fail "decode $name.cut"
+
+        # A layer table changes the records, not the decoded output
+        name=${src}_j_1024_8
+        $AGCODEC -e -j -f 1024 -r 8 -l -i $WORK/$src.wav \
+            -o $WORK/$name.layers.ag || fail "encode $name with layers"
+        $AGCODEC -d -i $WORK/$name.layers.ag -o $WORK/layers.wav \
+            || fail "decode $name.layers"
+        cmp -s $WORK/layers.wav $WORK/$name.wav \
+            || fail "$name: layer table changes the output"
+        rm -f $WORK/layers.wav
+        $AGCODEC -d -L 4 -i $WORK/$name.layers.ag \
+            -o $WORK/$name.layers4.wav || fail "decode $name.layers4"
+
+        # Layer-major groups only reorder the layered records
+        name=${src}_j_64_8
+        $AGCODEC -e -j -f 64 -r 8 -g 16 -i $WORK/$src.wav \
+            -o $WORK/$name.group.ag || fail "encode $name in groups"
+        $AGCODEC -d -i $WORK/$name.group.ag -o $WORK/group.wav \
+            || fail "decode $name.group"
+        cmp -s $WORK/group.wav $WORK/$name.wav \
+            || fail "$name: groups change the output"
+        rm -f $WORK/group.wav
+        $AGCODEC -d -L 4 -i $WORK/$name.group.ag \
+            -o $WORK/$name.group4.wav || fail "decode $name.group4"
+
+        # A short last frame is cut to the length of the input
+        tail=${src}_tail
+        $AGSIGNAL $bits $channels $TAIL_SAMPLES $WORK/$tail.wav \
+            || fail "agsignal $bits $channels $TAIL_SAMPLES"
+        length=`wc -c < $WORK/$tail.wav`
+
+        for case in "j_64_8:-j -f 64 -r 8" "j_1024_2:-j -f 1024 -r 2" \
+                "O_1024_8:-J -f 1024 -O -r 8" "g_64_8:-j -f 64 -r 8 -g 16" \
+                "W_64_8:-j -f 64 -r 8 -W 8"; do
+            name=${tail}_${case%%:*}
+            flags=${case#*:}
+
+            $AGCODEC -e $flags -i $WORK/$tail.wav -o $WORK/$name.ag \
+                || fail "encode $name"
+            $AGCODEC -d -i $WORK/$name.ag -o $WORK/$name.wav \
+                || fail "decode $name"
+            test `wc -c < $WORK/$name.wav` -eq $length \
+                || fail "$name: decoded length differs"
+        done
+
+        # Markers survive cut records and pipes
+        name=${tail}_j_64_8
+        $AGTRUNC 50 $WORK/$name.ag $WORK/$name.t50.ag || fail "agtrunc $name"
+        $AGCODEC -d -i $WORK/$name.t50.ag -o $WORK/$name.t50.wav \
+            || fail "decode $name.t50"
+        $AGCODEC -d -i - -o - < $WORK/$name.ag > $WORK/pipe.wav \
+            || fail "decode $name from a pipe"
+        for wav in $name.t50.wav pipe.wav; do
+            test `wc -c < $WORK/$wav` -eq $length \
+                || fail "$wav: decoded length differs"
+        done
+        rm -f $WORK/pipe.wav
+    done
+done
+
+(cd $WORK && $MD5 *.wav *.ag | sed 's/ \*/  /' | sort -k 2) > $WORK.md5
+
+if [ "$1" = "--update" ]; then
+    cp $WORK.md5 $GOLDEN || fail "cannot write $GOLDEN"
+    echo "conformance: `wc -l < $GOLDEN` checksums written to $GOLDEN"
+    exit 0
+fi
+
+if ! diff $GOLDEN $WORK.md5 > $WORK.diff; then
+    cat $WORK.diff >&2
+    fail "output differs from $GOLDEN"
+fi
+
+rm -rf $WORK $WORK.md5 $WORK.diff
+exit 0